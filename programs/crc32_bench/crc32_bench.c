@@ -0,0 +1,185 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * crc32_bench.c
+ *
+ * Microbenchmark for the crc32 engines of libocfs2test, reports
+ * throughput of each engine the running cpu supports.
+ *
+ * Copyright (C) 2010 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "crc32.h"
+
+#define DEFAULT_BUF_SIZE	(64 * 1024 * 1024)
+#define DEFAULT_LOOPS		16
+
+static char *prog;
+
+static unsigned long buf_size = DEFAULT_BUF_SIZE;
+static unsigned long chunk_size;
+static unsigned long loops = DEFAULT_LOOPS;
+static char *engine;
+
+static void usage(void)
+{
+	printf("Usage: %s [-s buf_size] [-c chunk_size] [-l loops] "
+	       "[-e engine]\n"
+	       "-s buffer size in bytes checksummed per loop, default %d\n"
+	       "-c checksum the buffer in chunks of this size, as pattern "
+	       "verifiers do,\n   default is the whole buffer at once\n"
+	       "-l number of loops, default %d\n"
+	       "-e only benchmark the named engine\n", prog,
+	       DEFAULT_BUF_SIZE, DEFAULT_LOOPS);
+
+	exit(1);
+}
+
+static int parse_opts(int argc, char **argv)
+{
+	int c;
+
+	while (1) {
+		c = getopt(argc, argv, "s:c:l:e:h");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 's':
+			buf_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			chunk_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			loops = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			engine = optarg;
+			break;
+		case 'h':
+		default:
+			return -1;
+		}
+	}
+
+	if (!buf_size || !loops)
+		return -1;
+
+	if (!chunk_size || chunk_size > buf_size)
+		chunk_size = buf_size;
+
+	return 0;
+}
+
+static double get_time_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t run_engine(crc32_fn fn, char *buf)
+{
+	unsigned long off, len;
+	uint32_t crc = 0;
+
+	for (off = 0; off < buf_size; off += chunk_size) {
+		len = chunk_size;
+		if (off + len > buf_size)
+			len = buf_size - off;
+		crc ^= fn(~0, buf + off, len);
+	}
+
+	return crc;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct crc32_engine *engines;
+	int i, nr_engines, ret = 0;
+	unsigned long l;
+	uint32_t crc, expected;
+	double start, elapsed;
+	char *buf;
+
+	prog = strrchr(argv[0], '/');
+	if (prog == NULL)
+		prog = argv[0];
+	else
+		prog++;
+
+	if (parse_opts(argc, argv))
+		usage();
+
+	buf = malloc(buf_size);
+	if (!buf) {
+		fprintf(stderr, "failed to allocate %lu bytes\n", buf_size);
+		return 1;
+	}
+
+	srand(getpid());
+	for (l = 0; l < buf_size; l++)
+		buf[l] = rand();
+
+	nr_engines = crc32_get_engines(&engines);
+
+	/* the last engine is the plain table-driven one, our reference */
+	expected = run_engine(engines[nr_engines - 1].ce_fn, buf);
+
+	printf("default engine: %s\n", crc32_engine_name());
+	printf("%-10s %12s %12s %10s\n", "engine", "buf_size", "chunk_size",
+	       "GB/s");
+
+	for (i = 0; i < nr_engines; i++) {
+		if (engine && strcmp(engine, engines[i].ce_name))
+			continue;
+
+		if (!engines[i].ce_supported()) {
+			printf("%-10s %12lu %12lu %10s\n", engines[i].ce_name,
+			       buf_size, chunk_size, "n/a");
+			continue;
+		}
+
+		crc = run_engine(engines[i].ce_fn, buf);
+		if (crc != expected) {
+			fprintf(stderr, "engine %s checksum mismatch, "
+				"expected %08x, got %08x\n",
+				engines[i].ce_name, expected, crc);
+			ret = 1;
+			continue;
+		}
+
+		start = get_time_seconds();
+		for (l = 0; l < loops; l++)
+			crc ^= run_engine(engines[i].ce_fn, buf);
+		elapsed = get_time_seconds() - start;
+
+		printf("%-10s %12lu %12lu %10.2f\n", engines[i].ce_name,
+		       buf_size, chunk_size,
+		       (double)buf_size * loops / elapsed / 1e9);
+	}
+
+	free(buf);
+
+	return ret;
+}
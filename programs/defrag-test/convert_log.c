@@ -0,0 +1,106 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * convert_log.c
+ *
+ * A simple utility to convert write logs between the text and the
+ * binary format.
+ *
+ * Copyright (C) 2011 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE 500
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <linux/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "file_verify.h"
+
+char *src = NULL, *dest = NULL;
+unsigned long chunksize = 0;
+
+static int usage(void)
+{
+	fprintf(stdout, "convert_log <-i src_log> <-o dest_log> "
+		"[-k chunksize]\n");
+	fprintf(stdout, "The format of src_log is detected, a binary log "
+		"gets converted to text\nand a text log to binary, which "
+		"needs the chunksize it was written with.\n");
+	fprintf(stdout, "Example:\n"
+			"       ./convert_log -i logs/logfile -o "
+		"logs/logfile.bin -k 32768\n");
+	exit(1);
+}
+
+int parse_opts(int argc, char **argv)
+{
+	char c;
+
+	while (1) {
+		c = getopt(argc, argv, "i:o:hk:");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'i':
+			src = optarg;
+			break;
+		case 'o':
+			dest = optarg;
+			break;
+		case 'k':
+			chunksize = atol(optarg);
+			break;
+		case 'h':
+			usage();
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (parse_opts(argc, argv)) {
+		printf("parse_opts failed\n");
+		usage();
+	}
+
+	if ((!src) || (!dest)) {
+		fprintf(stderr, "src_log and dest_log is a mandatory"
+			" option.\n");
+		usage();
+	}
+
+	return convert_logfile(src, dest, chunksize);
+}
@@ -68,6 +68,7 @@ unsigned long chunk_size = 32 * 1024;
 int is_random = 0;
 int verbose = 0;
 int do_refcount = 0;
+int binary_log = 0;
 union log_handler w_log;
 
 pid_t *child_pid_list;
@@ -76,7 +77,10 @@ static int usage(void)
 {
 	fprintf(stdout, "frager <-n num_files_per_process> <-m num_processes> "
 		"<-l file_size> <-k chunk_size> <-o logfiles_place> <-r> <-v>"
-		" <-w work_place> [-R]\n");
+		" <-w work_place> [-R] [-b]\n");
+	fprintf(stdout, "-b writes logs in binary format, which verify_file "
+		"replays much faster,\n   use convert_log to get them in "
+		"text.\n");
 	fprintf(stdout, "Example:\n"
 			"       ./frager -n 10 -m 10 -l 104857600 -k 32768 -o "
 		"logs -w /storage\n");
@@ -125,7 +129,7 @@ int parse_opts(int argc, char **argv)
 	char c;
 
 	while (1) {
-		c = getopt(argc, argv, "n:m:w:hk:rRl:vo:");
+		c = getopt(argc, argv, "n:m:w:hk:rRl:vo:b");
 		if (c == -1)
 			break;
 
@@ -154,6 +158,9 @@ int parse_opts(int argc, char **argv)
 		case 'R':
 			do_refcount = 1;
 			break;
+		case 'b':
+			binary_log = 1;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -326,7 +333,10 @@ again:
 		goto bail;
 	}
 
-	ret = open_logfile(&logfile, logfile_name, 0);
+	if (binary_log)
+		ret = open_binary_logfile(&logfile, logfile_name, chunk_size);
+	else
+		ret = open_logfile(&logfile, logfile_name, 0);
 	if (ret)
 		goto bail;
 
@@ -353,7 +363,10 @@ again:
 		/*
 		 * writes the log records into local logfile.
 		 */
-		ret = log_write(&wu, w_log, 0);
+		if (binary_log)
+			ret = log_write_binary(&wu, w_log.stream_log);
+		else
+			ret = log_write(&wu, w_log, 0);
 		if (ret < 0)
 			goto bail;
 	}
@@ -368,8 +381,12 @@ bail:
 	if (fd > 0)
 		close(fd);
 
-	if (w_log.stream_log)
-		fclose(w_log.stream_log);
+	if (w_log.stream_log) {
+		if (binary_log)
+			close_binary_logfile(w_log.stream_log);
+		else
+			fclose(w_log.stream_log);
+	}
 
 	return ret;
 }
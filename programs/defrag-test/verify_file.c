@@ -52,11 +52,14 @@ unsigned long filesize = 0;
 unsigned long chunksize = 0;
 union log_handler r_log;
 int verbose = 0;
+int nr_threads = 1;
 
 static int usage(void)
 {
 	fprintf(stdout, "frager <-f file> <-o log> <-l filesize> "
-		"<-k chunksize> <-v>\n");
+		"<-k chunksize> <-v> [-t threads]\n");
+	fprintf(stdout, "-t splits the verification across threads, each "
+		"reading its own range.\n");
 	fprintf(stdout, "Example:\n"
 			"       ./verify_file -f /storage/testfile -o "
 		"logs/logfile -l 104857600 -k 32768\n");
@@ -68,7 +71,7 @@ int parse_opts(int argc, char **argv)
 	char c;
 
 	while (1) {
-		c = getopt(argc, argv, "f:o:l:hvk:");
+		c = getopt(argc, argv, "f:o:l:hvk:t:");
 		if (c == -1)
 			break;
 
@@ -87,6 +90,9 @@ int parse_opts(int argc, char **argv)
 		case 'v':
 			verbose = 1;
 			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
 		case 'h':
 			usage();
 			break;
@@ -134,8 +140,8 @@ int main(int argc, char *argv[])
 	if (ret)
 		return ret;
 
-	ret = verify_file(0, r_log.stream_log, NULL, filename, filesize,
-			  chunksize, verbose);
+	ret = verify_file_parallel(0, r_log.stream_log, NULL, filename,
+				   filesize, chunksize, verbose, nr_threads);
 
 	return ret;
 }
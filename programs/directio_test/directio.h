@@ -48,7 +48,7 @@
 #include <arpa/inet.h>
 
 #include <ocfs2/byteorder.h>
-#include "crc32table.h"
+#include "crc32.h"
 
 #ifndef O_DIRECT
 #define O_DIRECT		040000 /* direct disk access hint */
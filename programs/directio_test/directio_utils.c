@@ -25,54 +25,6 @@ extern int open_ro_flags;
 extern int test_flags;
 extern int verbose;
 
-static uint32_t crc32_checksum(uint32_t crc, char *p, size_t len)
-{
-	const uint32_t      *b = (uint32_t *)p;
-	const uint32_t      *tab = crc32table_le;
-
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-# define DO_CRC(x) crc = tab[(crc ^ (x)) & 255] ^ (crc >> 8)
-#else
-# define DO_CRC(x) crc = tab[((crc >> 24) ^ (x)) & 255] ^ (crc << 8)
-#endif
-
-	crc = cpu_to_le32(crc);
-	/* Align it */
-	if (((long)b)&3 && len) {
-		do {
-			uint8_t *p = (uint8_t *)b;
-			DO_CRC(*p++);
-			b = (void *)p;
-		} while ((--len) && ((long)b)&3);
-	}
-	if (len >= 4) {
-		/* load data 32 bits wide, xor data 32 bits wide. */
-		size_t save_len = len & 3;
-		len = len >> 2;
-		--b; /* use pre increment below(*++b) for speed */
-		do {
-			crc ^= *++b;
-			DO_CRC(0);
-			DO_CRC(0);
-			DO_CRC(0);
-			DO_CRC(0);
-		} while (--len);
-		b++; /* point to next byte(s) */
-		len = save_len;
-	}
-	/* And the last few bytes */
-	if (len) {
-		do {
-			uint8_t *p = (uint8_t *)b;
-			DO_CRC(*p++);
-			b = (void *)p;
-		} while (--len);
-	}
-
-	return le32_to_cpu(crc);
-#undef DO_CRC
-}
-
 unsigned long get_rand_ul(unsigned long min, unsigned long max)
 {
 	if (min == 0 && max == 0)
@@ -0,0 +1,372 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * dlm_domain_bench.c
+ *
+ * A mpi program timing how dlm domains scale with the number of lock
+ * resources and nodes, through dlmfs and the o2dlm api.
+ *
+ * For each resource count N, every rank:
+ *
+ *  - joins a fresh domain, all ranks at once,
+ *  - takes and drops N fresh resources in EX, which makes it the
+ *    master of them,
+ *  - takes N resources of the next rank in PR, which gives their
+ *    master remote references to migrate,
+ *  - leaves the domain, one rank after the other, so that every leave
+ *    but the last migrates resources to the nodes left, and the last
+ *    one is a plain teardown.
+ *
+ * Dropped resources are only kept around by the dlm until they are
+ * purged (8 seconds on o2dlm), -k keeps the PR locks held until the
+ * leave instead, at the cost of a file descriptor per resource.
+ *
+ * Copyright (C) 2010 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <o2dlm/o2dlm.h>
+
+#include "mpi_ops.h"
+
+#define DEFAULT_DLMFS_PATH	"/dlm/"
+#define DEFAULT_DOMAIN		"dlmbench"
+#define DEFAULT_COUNTS		"1000,10000,100000"
+
+#define MAX_COUNTS		32
+
+/* Per rank timings of one resource count, in ns */
+struct node_times {
+	unsigned long long nt_join;
+	unsigned long long nt_release;
+	unsigned long long nt_leave;
+};
+
+char hostname[HOSTNAME_MAX_SZ];
+int rank = -1, size;
+
+static char *prog;
+static char *dlmfs_path = DEFAULT_DLMFS_PATH;
+static char *domain_prefix = DEFAULT_DOMAIN;
+static unsigned long counts[MAX_COUNTS];
+static int nr_counts;
+static int hold_remote;
+
+static void usage(void)
+{
+	root_printf("usage: %s [-d <dlmfs path>] [-D <domain prefix>] "
+		    "[-n <count>[,<count>...]] [-k]\n"
+		    "-d dlmfs mount point, defaults to %s\n"
+		    "-D domains are named <domain prefix><count>, defaults "
+		    "to %s\n"
+		    "-n resource counts to run with, defaults to %s\n"
+		    "-k hold the PR locks on the next rank's resources until "
+		    "leaving\n"
+		    "Heartbeat is expected to be up on every node.\n",
+		    prog, DEFAULT_DLMFS_PATH, DEFAULT_DOMAIN,
+		    DEFAULT_COUNTS);
+
+	MPI_Finalize();
+	exit(1);
+}
+
+static int parse_counts(char *arg)
+{
+	char *p, *end;
+
+	nr_counts = 0;
+	for (p = strtok(arg, ","); p; p = strtok(NULL, ",")) {
+		if (nr_counts == MAX_COUNTS)
+			return -1;
+
+		counts[nr_counts] = strtoul(p, &end, 0);
+		if (*end || !counts[nr_counts])
+			return -1;
+		nr_counts++;
+	}
+
+	return nr_counts ? 0 : -1;
+}
+
+static int parse_opts(int argc, char **argv)
+{
+	int c;
+	char def_counts[] = DEFAULT_COUNTS;
+
+	while (1) {
+		c = getopt(argc, argv, "d:D:n:kh");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			dlmfs_path = optarg;
+			break;
+		case 'D':
+			domain_prefix = optarg;
+			break;
+		case 'n':
+			if (parse_counts(optarg))
+				return EINVAL;
+			break;
+		case 'k':
+			hold_remote = 1;
+			break;
+		case 'h':
+		default:
+			return EINVAL;
+		}
+	}
+
+	if (optind < argc)
+		return EINVAL;
+
+	if (!nr_counts)
+		parse_counts(def_counts);
+
+	return 0;
+}
+
+/* Every held lock keeps a file descriptor open */
+static void setup_nofile(unsigned long want)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		abort_printf("getrlimit failed: %s\n", strerror(errno));
+
+	if (rl.rlim_cur < want && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			abort_printf("setrlimit failed: %s\n", strerror(errno));
+	}
+
+	if (rl.rlim_cur < want)
+		abort_printf("-k with %lu resources needs %lu file "
+			     "descriptors, the limit is %lu\n",
+			     want - 64, want, (unsigned long)rl.rlim_cur);
+}
+
+static void res_name(char *name, int owner, unsigned long i)
+{
+	/* bounded so that the name always fits */
+	snprintf(name, O2DLM_LOCK_ID_MAX_LEN, "M%04d%012lu", owner % 10000, i);
+}
+
+static void lock_resources(struct o2dlm_ctxt *dlm, int owner,
+			   unsigned long count, enum o2dlm_lock_level level,
+			   int hold, struct mpi_lat_hist *h)
+{
+	unsigned long i;
+	unsigned long long start;
+	char name[O2DLM_LOCK_ID_MAX_LEN];
+	errcode_t err;
+
+	mpi_lat_init(h);
+
+	for (i = 0; i < count; i++) {
+		res_name(name, owner, i);
+
+		start = mpi_lat_now();
+		err = o2dlm_lock(dlm, name, 0, level);
+		if (err)
+			abort_printf("o2dlm_lock of %s failed: %d\n", name,
+				     (int)err);
+		mpi_lat_record(h, start, 0);
+
+		if (hold)
+			continue;
+
+		err = o2dlm_unlock(dlm, name);
+		if (err)
+			abort_printf("o2dlm_unlock of %s failed: %d\n", name,
+				     (int)err);
+	}
+}
+
+static unsigned long long unlock_resources(struct o2dlm_ctxt *dlm,
+					   int owner, unsigned long count)
+{
+	unsigned long i;
+	unsigned long long start;
+	char name[O2DLM_LOCK_ID_MAX_LEN];
+	errcode_t err;
+
+	start = mpi_lat_now();
+
+	for (i = 0; i < count; i++) {
+		res_name(name, owner, i);
+		err = o2dlm_unlock(dlm, name);
+		if (err)
+			abort_printf("o2dlm_unlock of %s failed: %d\n", name,
+				     (int)err);
+	}
+
+	return mpi_lat_now() - start;
+}
+
+static void report_nodes(unsigned long count, struct node_times *mine)
+{
+	int ret, i;
+	struct node_times *all = NULL;
+	char *hosts = NULL;
+	unsigned long long max_join = 0, max_leave = 0;
+
+	if (!rank) {
+		all = malloc(sizeof(struct node_times) * size);
+		hosts = malloc(HOSTNAME_MAX_SZ * size);
+		if (!all || !hosts)
+			abort_printf("report_nodes: out of memory\n");
+	}
+
+	ret = MPI_Gather(mine, sizeof(*mine), MPI_BYTE, all, sizeof(*mine),
+			 MPI_BYTE, 0, MPI_COMM_WORLD);
+	if (ret == MPI_SUCCESS)
+		ret = MPI_Gather(hostname, HOSTNAME_MAX_SZ, MPI_CHAR, hosts,
+				 HOSTNAME_MAX_SZ, MPI_CHAR, 0, MPI_COMM_WORLD);
+	if (ret != MPI_SUCCESS)
+		abort_printf("MPI_Gather failed: %d\n", ret);
+
+	if (rank)
+		return;
+
+	printf("%lu resources per node, domain %s%lu\n", count,
+	       domain_prefix, count);
+	printf("  %-5s %-20s %12s %12s %12s  %s\n", "rank", "host",
+	       "join(ms)", "release(ms)", "leave(ms)", "leave is");
+
+	for (i = 0; i < size; i++) {
+		printf("  %-5d %-20s %12.3f %12.3f %12.3f  %s\n", i,
+		       hosts + i * HOSTNAME_MAX_SZ, all[i].nt_join / 1e6,
+		       all[i].nt_release / 1e6, all[i].nt_leave / 1e6,
+		       (i == size - 1) ? "teardown" : "migration");
+
+		if (all[i].nt_join > max_join)
+			max_join = all[i].nt_join;
+		if (all[i].nt_leave > max_leave)
+			max_leave = all[i].nt_leave;
+	}
+
+	printf("  slowest join %.3fms, slowest leave %.3fms\n\n",
+	       max_join / 1e6, max_leave / 1e6);
+
+	free(hosts);
+	free(all);
+}
+
+static void run_count(unsigned long count)
+{
+	int r, next = (rank + 1) % size;
+	char domain[NAME_MAX];
+	unsigned long long start;
+	struct o2dlm_ctxt *dlm = NULL;
+	struct mpi_lat_hist lat;
+	struct node_times times;
+	errcode_t err;
+
+	memset(&times, 0, sizeof(times));
+	snprintf(domain, sizeof(domain), "%s%lu", domain_prefix, count);
+
+	root_printf("Joining domain %s with %lu resources per node\n",
+		    domain, count);
+	MPI_Barrier_Sync();
+
+	start = mpi_lat_now();
+	err = o2dlm_initialize(dlmfs_path, domain, &dlm);
+	if (err)
+		abort_printf("o2dlm_initialize of %s failed: %d\n", domain,
+			     (int)err);
+	times.nt_join = mpi_lat_now() - start;
+
+	MPI_Barrier_Sync();
+
+	/* Fresh resources, mastered by whoever asks first */
+	lock_resources(dlm, rank, count, O2DLM_LEVEL_EXMODE, 0, &lat);
+	mpi_lat_report("master EX", &lat);
+
+	MPI_Barrier_Sync();
+
+	if (size > 1) {
+		lock_resources(dlm, next, count, O2DLM_LEVEL_PRMODE,
+			       hold_remote, &lat);
+		mpi_lat_report("remote PR", &lat);
+
+		MPI_Barrier_Sync();
+	}
+
+	/* One at a time, so that every leave is timed on its own */
+	for (r = 0; r < size; r++) {
+		if (r == rank) {
+			if (hold_remote && size > 1)
+				times.nt_release =
+					unlock_resources(dlm, next, count);
+
+			start = mpi_lat_now();
+			err = o2dlm_destroy(dlm);
+			if (err)
+				abort_printf("o2dlm_destroy of %s failed: "
+					     "%d\n", domain, (int)err);
+			times.nt_leave = mpi_lat_now() - start;
+		}
+
+		MPI_Barrier_Sync();
+	}
+
+	report_nodes(count, &times);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	unsigned long max_count = 0;
+
+	prog = strrchr(argv[0], '/');
+	if (prog == NULL)
+		prog = argv[0];
+	else
+		prog++;
+
+	MPI_Setup(argc, argv);
+
+	if (parse_opts(argc, argv))
+		usage();
+
+	initialize_o2dl_error_table();
+
+	for (i = 0; i < nr_counts; i++)
+		if (counts[i] > max_count)
+			max_count = counts[i];
+
+	if (hold_remote)
+		setup_nofile(max_count + 64);
+
+	root_printf("%s: %d nodes, dlmfs %s, %d resource counts%s\n", prog,
+		    size, dlmfs_path, nr_counts,
+		    hold_remote ? ", remote locks held" : "");
+
+	for (i = 0; i < nr_counts; i++)
+		run_count(counts[i]);
+
+	mpi_barrier_report(5);
+
+	MPI_Finalize();
+
+	return 0;
+}
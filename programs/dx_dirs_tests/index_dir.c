@@ -44,8 +44,8 @@
 #include <sys/wait.h>
 #include <inttypes.h>
 
-#define OCFS2_MAX_FILENAME_LEN          255
-#define MAX_DIRENTS			40000
+#include "dir_tree.h"
+#include "dirents.h"
 
 #define FILE_BUFFERED_RW_FLAGS  (O_CREAT|O_RDWR|O_TRUNC)
 #define FILE_MODE               (S_IRUSR|S_IWUSR|S_IXUSR|S_IROTH|\
@@ -59,13 +59,6 @@
 #define BOUND_TEST		0x00000020
 #define STRSS_TEST		0x00000040
 
-struct my_dirent {
-        unsigned int    type;
-        unsigned int    name_len;
-        unsigned int    seen;
-        char            name[OCFS2_MAX_FILENAME_LEN];
-};
-
 union semun {
         int val;                    /* value for SETVAL */
         struct semid_ds *buf;       /* buffer for IPC_STAT, IPC_SET */
@@ -96,6 +89,7 @@ static unsigned long child_nums = 2;
 static unsigned long file_nums = 2;
 unsigned long operated_entries = 20;
 unsigned long operated_depth = 5;
+static int tree_threads;
 
 pid_t *child_pid_list;
 
@@ -103,7 +97,7 @@ int shm_id;
 int sem_id;
 
 struct my_dirent *dirents;
-unsigned int num_dirents;
+unsigned long num_dirents;
 
 char path[PATH_MAX];
 char path1[PATH_MAX];
@@ -140,21 +134,9 @@ unsigned int get_rand_nam(char *str, unsigned int least, unsigned most)
 	return nam_len;
 }
 
-int is_dot_entry(struct my_dirent *dirent)
-{
-	if (dirent->name_len == 1 && dirent->name[0] == '.')
-		return 1;
-	if (dirent->name_len == 2 && dirent->name[0] == '.'
-	    && dirent->name[1] == '.')
-		return 1;
-
-	return 0;
-}
-
 int unlink_dirent(struct my_dirent *dirent)
 {
-	dirent->name_len = 0;
-	dirent->seen = 0;
+	forget_my_dirent(dirent);
 	sprintf(path1, "%s/%s", dir_name, dirent->name);
 
 	return unlink(path1);
@@ -163,21 +145,11 @@ int unlink_dirent(struct my_dirent *dirent)
 void create_and_prep_dir(void)
 {
 	int ret;
-	struct my_dirent *dirent;
-	
-	memset(dirents, 0, sizeof(struct my_dirent) * MAX_DIRENTS);
-	
-	dirent = &dirents[0];
-	dirent->type = S_IFDIR >> S_SHIFT;
-	dirent->name_len = 1;
-	strcpy(dirent->name, ".");
-	
-	dirent = &dirents[1];
-	dirent->type = S_IFDIR >> S_SHIFT;
-	dirent->name_len = 2;
-	strcpy(dirent->name, "..");
-	
-	num_dirents = 2;
+
+	ret = init_my_dirents();
+	if (ret)
+		exit(ret);
+
 	ret = mkdir(dir_name, FILE_MODE);
 	if (ret) {
 	        ret = errno;
@@ -204,8 +176,6 @@ void destroy_dir(void)
 				fprintf(stderr, "unlink failure %d: %s\n", ret,
 					strerror(ret));
 			}
-
-			dirent->name_len = 0;
 		}
 
         }
@@ -221,41 +191,15 @@ void destroy_dir(void)
 	num_dirents = 0;
 }
 
-struct my_dirent *find_my_dirent(char *name)
-{
-	int i, len;
-	struct my_dirent *my_dirent;
-
-	len = strlen(name);
-
-	for (i = 0; i < num_dirents; i++) {
-		my_dirent = &dirents[i];
-
-		if (my_dirent->name_len == 0)
-			continue;
-
-		if (my_dirent->name_len == len &&
-		    strcmp(my_dirent->name, name) == 0)
-			return my_dirent;
-	}
-
-	return NULL;
-}
-
-
 void create_file(char *filename)
 {
 	int ret, fd;
 	struct my_dirent *dirent;
-	
-	dirent = &dirents[num_dirents];
-	num_dirents++;
-	
-	dirent->type = S_IFREG >> S_SHIFT;
-	dirent->name_len = strlen(filename);
-	dirent->seen = 0;
-	strcpy(dirent->name, filename);
-	
+
+	ret = add_my_dirent(filename, S_IFREG >> S_SHIFT, &dirent);
+	if (ret)
+		exit(ret);
+
 	sprintf(path, "%s/%s", dir_name, dirent->name);
 	
 	fd = open(path, FILE_BUFFERED_RW_FLAGS, FILE_MODE);
@@ -559,7 +503,6 @@ void random_unlink(int iters)
 			fprintf(stderr, "unlink failure %d: %s\n", ret,
 				strerror(ret));
 		}
-		dirent->name_len = 0;
 
 		iters--;
 		times++;
@@ -584,9 +527,12 @@ void random_fill_empty_entries(int iters)
                 if (dirent->name_len > 0)
                         continue;
 
+                /* another entry may have been renamed to this name */
+                if (revive_my_dirent(dirent)) {
+                        times++;
+                        continue;
+                }
                 dirent->type = S_IFREG >> S_SHIFT;
-                dirent->name_len = strlen(dirent->name);
-                dirent->seen = 0;
 
                 sprintf(path, "%s/%s", dir_name, dirent->name);
 
@@ -645,7 +591,9 @@ void random_rename_same_reclen(int iters)
 
 			exit(ret);
 		}
-		dirent->name[0] = 'R';
+		strcpy(path, dirent->name);
+		path[0] = 'R';
+		rename_my_dirent(dirent, path);
 		iters--;
 		times++;
         }
@@ -689,7 +637,7 @@ void random_deleting_rename(int iters)
 		}
 
 		dirent2->type = dirent1->type;
-		dirent1->name_len = 0;
+		forget_my_dirent(dirent1);
 
 		iters--;
 		times++;
@@ -701,7 +649,7 @@ static void usage(void)
 {
         printf("Usage: index_dir [-i <iteration>] [-n <operated_entries>]"
 	       " [-v <volume disk>] [-d depth] [-c <concurrent_process_num>]"
-	       " [-m <multi_file_num>] "
+	       " [-m <multi_file_num>] [-t <tree_threads>] "
                "<-w workplace> [-r <random_times>] [-f ] [-p] [-b] [-s]\n"
                "iteration specify the running times.\n"
                "operated_dir_entries specify the entires number to be "
@@ -710,6 +658,8 @@ static void usage(void)
                "concurrent_process_num specify the number of concurrent "
                "multi_file_num specify the number of multiple dirs"
                "processes to perform inline-data read/rename.\n"
+               "tree_threads builds and destroys directory trees with "
+               "that many threads, reporting per level rates.\n"
                "-f to launch functional basic test.\n"
                "-b to launch boundary test.\n"
                "-r to launch random test.\n"
@@ -726,7 +676,7 @@ static int parse_opts(int argc, char **argv)
 
 	while (1) {
 		c = getopt(argc, argv,
-			   "I:i:C:c:M:m:N:n:w:W:d:sSfFpPbBD:r:R:v:V:");
+			   "I:i:C:c:M:m:N:n:w:W:d:sSfFpPbBD:r:R:v:V:t:T:");
 		if (c == -1)
                         break;
 		switch (c) {
@@ -765,6 +715,12 @@ static int parse_opts(int argc, char **argv)
 				test_flags |= RANDO_TEST;
 				random_times = atol(optarg);
 				break;
+			case 't':
+			case 'T':
+				tree_threads = atoi(optarg);
+				if (tree_threads < 1)
+					return EINVAL;
+				break;
 			case 'p':
 			case 'P':
 				test_flags |= PRESE_TEST;
@@ -788,9 +744,6 @@ static int parse_opts(int argc, char **argv)
 	if (strcmp(workplace, "") == 0)
 		return EINVAL;
 
-	if (operated_entries > MAX_DIRENTS)
-		test_flags = STRSS_TEST;
-
 	return 0;
 }
 
@@ -847,11 +800,6 @@ void setup(int argc, char *argv[])
 	if (test_flags & MULTI_TEST)
 	        child_pid_list = (pid_t *)malloc(sizeof(pid_t) * file_nums);
 	
-	dirents = (struct my_dirent *)malloc(sizeof(struct my_dirent) *
-	                                     MAX_DIRENTS);
-
-	memset(dirents, 0, sizeof(struct my_dirent) * MAX_DIRENTS);
-	
 	srand(getpid());
 
         snprintf(dir_name_prefix, OCFS2_MAX_FILENAME_LEN, "indexed-dirs-test");
@@ -861,13 +809,52 @@ void setup(int argc, char *argv[])
 
 void teardown(void)
 {
-	if (dirents)
-		free(dirents);
+	free_my_dirents();
 
 	if (child_pid_list)
                 free(child_pid_list);
 }
 
+void build_tree(unsigned long entries, unsigned long depth, int is_random)
+{
+	struct dir_tree_stats stats;
+	int ret;
+
+	if (!tree_threads) {
+		build_dir_tree(dir_name, entries, depth, is_random);
+		return;
+	}
+
+	ret = build_dir_tree_parallel(dir_name, entries, depth, is_random,
+				      tree_threads, &stats);
+	if (ret) {
+		fprintf(stderr, "build_dir_tree_parallel failed %d\n", ret);
+		exit(ret);
+	}
+
+	print_dir_tree_stats(stdout, "creates", &stats);
+}
+
+void destroy_tree(void)
+{
+	struct dir_tree_stats stats;
+	int ret;
+
+	if (!tree_threads) {
+		traverse_and_destroy(dir_name);
+		return;
+	}
+
+	ret = traverse_and_destroy_parallel(dir_name, tree_threads, &stats);
+	if (ret) {
+		fprintf(stderr, "traverse_and_destroy_parallel failed %d\n",
+			ret);
+		exit(ret);
+	}
+
+	print_dir_tree_stats(stdout, "unlinks", &stats);
+}
+
 void basic_test()
 {
 	printf("Test %d: Basic diectory manipulation test.\n", testno);
@@ -876,8 +863,8 @@ void basic_test()
 	create_files("testfile", operated_entries);
 	verify_dirents(dir_name);
 	destroy_dir();
-	build_dir_tree(dir_name, operated_entries, operated_depth , 0);
-	traverse_and_destroy(dir_name);
+	build_tree(operated_entries, operated_depth, 0);
+	destroy_tree();
 	testno++;
 }
 
@@ -917,8 +904,8 @@ void random_test(void)
 		destroy_dir();
 	}
 
-        build_dir_tree(dir_name, operated_entries, operated_depth, 1);
-        traverse_and_destroy(dir_name);
+        build_tree(operated_entries, operated_depth, 1);
+        destroy_tree();
 
 	testno++;
 }
@@ -1034,11 +1021,14 @@ void concurrent_test(void)
 	        exit(1);
 	}
 	
-	/*should use shared memory here */
+	/*
+	 * should use shared memory here, children only rename so the
+	 * entries created so far are all it has to hold.
+	 */
 	old_dirents = dirents;
 	dirents = NULL;
 
-	shm_id = shmget(shm_key, sizeof(struct my_dirent) * MAX_DIRENTS,
+	shm_id = shmget(shm_key, sizeof(struct my_dirent) * num_dirents,
 			IPC_CREAT | 0766);
 	if (shm_id < 0) {
 		perror("shmget");
@@ -1052,7 +1042,7 @@ void concurrent_test(void)
 	}
 
 	shmctl(shm_id, IPC_RMID, 0);
-        memmove(dirents, old_dirents, sizeof(struct my_dirent) * MAX_DIRENTS);
+        memmove(dirents, old_dirents, sizeof(struct my_dirent) * num_dirents);
 
 
 	/*flush out the father's i/o buffer*/
@@ -1070,6 +1060,9 @@ void concurrent_test(void)
                 if (pid == 0) {
                         if (semaphore_p() < 0)
                                 exit(-1);
+                        /*pick up the renames of the children before us*/
+                        if (index_my_dirents())
+                                exit(-1);
                         /*Concurrent rename for dirents*/
                         random_rename_same_reclen(operated_entries / 2);
                         if (semaphore_v() < 0)
@@ -1097,6 +1090,8 @@ void concurrent_test(void)
         }
         /*father help to verfiy dirents' consistency*/
         sleep(2);
+	if (index_my_dirents())
+		exit(1);
 	destroy_dir();
 
 	/*detach shared memory*/
@@ -1218,7 +1213,7 @@ void preserve_test(void)
 {
 	printf("Test %d: Preserving test used for space consumption.\n", testno);
 
-        build_dir_tree(dir_name, operated_entries, operated_depth , 0);
+        build_tree(operated_entries, operated_depth, 0);
 	testno++;
 }
 
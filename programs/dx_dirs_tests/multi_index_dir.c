@@ -50,9 +50,9 @@
 
 #include <mpi.h>
 
-#define OCFS2_MAX_FILENAME_LEN		255
+#include "dirents.h"
+
 #define HOSTNAME_MAX_SZ			255
-#define MAX_DIRENTS			20000
 
 #define FILE_BUFFERED_RW_FLAGS  (O_CREAT|O_RDWR|O_TRUNC)
 #define FILE_MODE               (S_IRUSR|S_IWUSR|S_IXUSR|S_IROTH|\
@@ -68,13 +68,6 @@
 #define ULNK_TEST			0x00000010
 #define FLUP_TEST			0x00000020
 
-struct my_dirent {
-	unsigned int	type;
-	unsigned int	name_len;
-	unsigned int	seen;
-	char		name[OCFS2_MAX_FILENAME_LEN];
-};
-
 char *prog;
 
 /*
@@ -102,8 +95,15 @@ int mmap_num_fd;
 int iteration = 1;
 unsigned int operated_entries = 20;
 
+/*
+ * dirents[] and its count live in cluster-shared mmaps, sized for what
+ * all ranks may create.  num_dirents is the local copy the index is
+ * built from before verifying.
+ */
 struct my_dirent *dirents;
-unsigned long *num_dirents;
+unsigned long *shared_num_dirents;
+unsigned long max_dirents;
+unsigned long num_dirents;
 
 char path[PATH_MAX];
 char path1[PATH_MAX];
@@ -238,19 +238,6 @@ int parse_opts(int argc, char **argv)
 	if (strcmp(work_place, "") == 0)
 		return EINVAL;
 
-	if (operated_entries > MAX_DIRENTS)
-		test_flags = STRS_TEST;
-
-	return 0;
-}
-
-int is_dot_entry(struct my_dirent *dirent)
-{
-	if (dirent->name_len == 1 && dirent->name[0] == '.')
-		return 1;
-	if (dirent->name_len == 2 && dirent->name[0] == '.'
-	    && dirent->name[1] == '.')
-		return 1;
 	return 0;
 }
 
@@ -266,7 +253,7 @@ void destroy_dir(void)
 	int ret, i;
 	struct my_dirent *dirent;
 
-	for (i = 0; i < *num_dirents; i++) {
+	for (i = 0; i < *shared_num_dirents; i++) {
 		dirent = &dirents[i];
 
 		if (dirent->name_len == 0)
@@ -291,28 +278,7 @@ void destroy_dir(void)
 			     strerror(ret));
 	}
 	
-	*num_dirents = 0;
-}
-
-struct my_dirent *find_my_dirent(char *name)
-{
-	int i, len;
-	struct my_dirent *my_dirent;
-
-	len = strlen(name);
-
-	for (i = 0; i < *num_dirents; i++) {
-		my_dirent = &dirents[i];
-
-		if (my_dirent->name_len == 0)
-			continue;
-
-		if (my_dirent->name_len == len &&
-		    strcmp(my_dirent->name, name) == 0)
-			return my_dirent;
-	}
-
-	return NULL;
+	*shared_num_dirents = 0;
 }
 
 void create_and_prep_dir(void)
@@ -320,7 +286,7 @@ void create_and_prep_dir(void)
 	int ret;
 	struct my_dirent *dirent;
 
-	memset(dirents, 0, sizeof(struct my_dirent) * MAX_DIRENTS);
+	memset(dirents, 0, sizeof(struct my_dirent) * max_dirents);
 
 	dirent = &dirents[0];
 	dirent->type = S_IFDIR >> S_SHIFT;
@@ -332,7 +298,7 @@ void create_and_prep_dir(void)
 	dirent->name_len = 2;
 	strcpy(dirent->name, "..");
 
-	*num_dirents = 2;
+	*shared_num_dirents = 2;
 
 	ret = mkdir(dir_name, FILE_MODE);
 	if (ret) {
@@ -346,8 +312,12 @@ void create_file(char *filename)
 	int ret, fd;
 	struct my_dirent *dirent;
 
-	dirent = &dirents[*num_dirents];
-	*num_dirents += 1;
+	if (*shared_num_dirents >= max_dirents)
+		abort_printf("too many dirents, at most %lu shared\n",
+			     max_dirents);
+
+	dirent = &dirents[*shared_num_dirents];
+	*shared_num_dirents += 1;
 
 	dirent->type = S_IFREG >> S_SHIFT;
 	dirent->name_len = strlen(filename);
@@ -409,7 +379,7 @@ void random_read(int iters)
 	}
 
 	while (iters > 0) {
-		i = get_rand(0, *num_dirents - 1);
+		i = get_rand(0, *shared_num_dirents - 1);
                 my_dirent = &dirents[i];
 		sprintf(fullpath, "%s/%s", dir_name, my_dirent->name);
 		ret = stat(fullpath, &stat_info);
@@ -433,7 +403,7 @@ void random_unlink(int iters)
 
 	while ((iters > 0) && (times < threshold)) {
 		times++;
-		i = get_rand(0, *num_dirents - 1);
+		i = get_rand(0, *shared_num_dirents - 1);
 		dirent = &dirents[i];
 
 		if (is_dot_entry(dirent))
@@ -464,7 +434,7 @@ void random_fill_empty_entries(int iters)
 
 	while ((iters > 0) && (times < threshold)) {
 		times++;
-		i = get_rand(0, *num_dirents - 1);
+		i = get_rand(0, *shared_num_dirents - 1);
 		dirent = &dirents[i];
 
 		if (is_dot_entry(dirent))
@@ -502,7 +472,7 @@ void random_rename_same_reclen(int iters)
 
 	while ((iters > 0) && (times < threshold)) {
 		times++;
-		i = get_rand(0, *num_dirents - 1);
+		i = get_rand(0, *shared_num_dirents - 1);
 		dirent = &dirents[i];
 
 		if (is_dot_entry(dirent))
@@ -521,7 +491,7 @@ void random_rename_same_reclen(int iters)
 				"%s\n", ret, path, path1, strerror(ret));
 			msync(mmap_shared_dirents_region, mmap_dirents_size,
 			      MS_SYNC);
-			i = get_rand(0, *num_dirents - 1);
+			i = get_rand(0, *shared_num_dirents - 1);
 			dirent = &dirents[i];
 
 			if (is_dot_entry(dirent))
@@ -550,8 +520,8 @@ void random_deleting_rename(int iters)
 
 	while ((iters > 0) && (times < threshold)) {
 		times++;
-		i = get_rand(0, *num_dirents - 1);
-		j = get_rand(0, *num_dirents - 1);
+		i = get_rand(0, *shared_num_dirents - 1);
+		j = get_rand(0, *shared_num_dirents - 1);
 		dirent1 = &dirents[i];
 		dirent2 = &dirents[j];
 
@@ -572,8 +542,8 @@ void random_deleting_rename(int iters)
 			msync(mmap_shared_dirents_region, mmap_dirents_size,
 			      MS_SYNC);
 
-			i = get_rand(0, *num_dirents - 1);
-			j = get_rand(0, *num_dirents - 1);
+			i = get_rand(0, *shared_num_dirents - 1);
+			j = get_rand(0, *shared_num_dirents - 1);
 			dirent1 = &dirents[i];
 			dirent2 = &dirents[j];
 
@@ -604,6 +574,11 @@ void verify_dirents(void)
 
 	sync();
 
+	num_dirents = *shared_num_dirents;
+	ret = index_my_dirents();
+	if (ret)
+		abort_printf("index dirents failure %d\n", ret);
+
 	dir = opendir(dir_name);
 	if (dir == NULL) {
 		ret = errno;
@@ -642,7 +617,7 @@ void verify_dirents(void)
 		my_dirent->seen++;
 	}
 
-	for (i = 0; i < *num_dirents; i++) {
+	for (i = 0; i < *shared_num_dirents; i++) {
 		my_dirent = &dirents[i];
 
 		if (my_dirent->seen != 0 || my_dirent->name_len == 0)
@@ -655,7 +630,7 @@ void verify_dirents(void)
 	}
 
 	/* should reset the 'seen' after verification*/
-	for (i = 0; i < *num_dirents; i++) {
+	for (i = 0; i < *shared_num_dirents; i++) {
 		my_dirent = &dirents[i];
 		my_dirent->seen = 0;
 	}
@@ -915,7 +890,10 @@ void run_tests(int iter)
 void setup_mmap_sharing(void)
 {
 	int ret;
-	unsigned long total_size = sizeof(struct my_dirent) * MAX_DIRENTS;
+	unsigned long total_size;
+
+	max_dirents = 2 + (unsigned long)operated_entries * size;
+	total_size = sizeof(struct my_dirent) * max_dirents;
 
 	mmap_num_size = page_size;
 	mmap_dirents_size = page_size;
@@ -1010,7 +988,7 @@ void setup(int argc, char *argv[])
 
 	setup_mmap_sharing();
 
-	num_dirents = (unsigned long *)mmap_shared_num_region;
+	shared_num_dirents = (unsigned long *)mmap_shared_num_region;
 
 	dirents = (struct my_dirent *)mmap_shared_dirents_region;
 
@@ -1039,6 +1017,8 @@ int teardown(void)
 		close(mmap_num_fd);
 	}
 
+	free_my_dirents();
+
 	MPI_Finalize();
 
 	return 0;
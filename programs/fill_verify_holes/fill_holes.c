@@ -31,7 +31,9 @@
 #include <linux/types.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
 #include <linux/fs.h>
+#include <time.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,7 +46,7 @@
 
 static void usage(void)
 {
-	printf("fill_holes [-f] [-m] [-b] [-u] [-a] [-d] [-i ITER] [-o LOGFILE] [-r REPLAYLOG] FILE SIZE\n"
+	printf("fill_holes [-f] [-m] [-b] [-u] [-a] [-q DEPTH] [-d] [-i ITER] [-w WRITERS [-s]] [-o LOGFILE] [-r REPLAYLOG] FILE SIZE\n"
 	       "FILE is a path to a file\n"
 	       "SIZE is in bytes is required only for regular files, even with a REPLAYLOG\n"
 	       "ITER defaults to 1000, unless REPLAYLOG is specified.\n"
@@ -54,7 +56,15 @@ static void usage(void)
 	       "-b file is a block device\n"
 	       "-u will create an unwritten region instead of ftruncate\n"
 	       "-a will enable aio io mode\n"
+	       "-q keeps one aio context with up to DEPTH writes in flight for\n"
+	       "   the whole run, implies -a, writes are read back as they\n"
+	       "   complete (O2TEST_AIO_BACKEND picks libaio or io_uring)\n"
 	       "-d will enable direct io mode\n"
+	       "-w runs WRITERS processes doing ITER writes each, writer N\n"
+	       "   logs to LOGFILE.N (-o is required) with a sequence number\n"
+	       "   shared by all writers, give all the logs to verify_holes\n"
+	       "-s writers overlap over the whole file, by default each\n"
+	       "   writer fills its own region of it\n"
 	       "REPLAYLOG is an optional file to generate values from\n\n"
 	       "Regular files are truncated to zero and then truncated to SIZE.\n"
 	       "FILE will be truncated to zero, then truncated out to SIZE\n"
@@ -82,13 +92,18 @@ static uint64_t file_size;
 static uint32_t max_iter_per_chunk = 0;
 static uint32_t cur_iter_per_chunk = 0;
 static uint64_t	cur_iter_offset = 0;
+static uint64_t region_start;
+static uint64_t region_size;
 
 static uint8_t flush_output;
 static uint8_t create_unwritten;
 static uint8_t enable_aio;
+static uint32_t aio_depth;
 static uint8_t use_mmap;
 static uint8_t use_dio;
 static uint8_t is_bdev;
+static uint32_t nr_writers;
+static uint8_t shared_region;
 
 static char *fname = NULL;
 static char *logname = NULL;
@@ -97,6 +112,43 @@ static FILE *logfile = NULL;
 static FILE *replaylogfile = NULL;
 static void *mapped;
 
+/*
+ * Deep queue aio mode, each slot owns a buffer for the whole run and
+ * holds the write unit in flight with it.  Writes in flight never
+ * overlap, so they can complete in any order and still leave the file
+ * as the log says.
+ */
+struct fh_aio_slot {
+	struct fh_write_unit	s_wu;
+	char			*s_buf;
+	int			s_busy;
+};
+
+static struct o2test_aio fh_aio;
+static struct fh_aio_slot *aio_slots;
+static char *aio_bufs;
+static char *aio_cmp_buf;
+static struct o2test_aio_res *aio_res;
+static uint32_t aio_inflight;
+
+/*
+ * Multi writer mode, shared by all writers.  fs_seq orders the writes
+ * across the logs, overlapping writes are serialized with a range lock
+ * so that their sequence numbers follow the order they hit the file.
+ */
+struct fh_writer_stat {
+	uint64_t		ws_writes;
+	uint64_t		ws_bytes;
+};
+
+struct fh_shared {
+	uint64_t		fs_seq;
+	struct fh_writer_stat	fs_stats[0];
+};
+
+static struct fh_shared *shared;
+static struct fh_writer_stat *writer_stat;
+
 int fh_get_device_size(const char *device, uint64_t *size)
 {
 	int	fd;
@@ -115,7 +167,7 @@ static int fh_parse_opts(int argc, char **argv)
 	int c, iter_specified = 0, ret, num_xtra_args;
 
 	while (1) {
-		c = getopt(argc, argv, "abdumfi:o:r:");
+		c = getopt(argc, argv, "abdumfsi:o:r:q:w:");
 		if (c == -1)
 			break;
 
@@ -126,6 +178,12 @@ static int fh_parse_opts(int argc, char **argv)
 		case 'a':
 			enable_aio = 1;
 			break;
+		case 'q':
+			if (atoi(optarg) < 1)
+				return EINVAL;
+			aio_depth = atoi(optarg);
+			enable_aio = 1;
+			break;
 		case 'b':
 			is_bdev = 1;
 			break;
@@ -138,6 +196,14 @@ static int fh_parse_opts(int argc, char **argv)
 		case 'f':
 			flush_output = 1;
 			break;
+		case 'w':
+			if (atoi(optarg) < 1)
+				return EINVAL;
+			nr_writers = atoi(optarg);
+			break;
+		case 's':
+			shared_region = 1;
+			break;
 		case 'i':
 			max_iter = atoi(optarg);
 			iter_specified = 1;
@@ -182,6 +248,19 @@ static int fh_parse_opts(int argc, char **argv)
 	if (use_mmap && (file_size > TWO_GIGA_BYTE || is_bdev))
 		return EINVAL;
 
+	if (nr_writers && (!logname || replaylogname || aio_depth)) {
+		fprintf(stderr, "-w needs -o and cannot be used with -r or "
+			"-q\n");
+		return EINVAL;
+	}
+
+	if (nr_writers && !shared_region &&
+	    file_size / nr_writers < MAX_WRITE_SIZE) {
+		fprintf(stderr, "file is too small for %u writers\n",
+			nr_writers);
+		return EINVAL;
+	}
+
 	return 0;
 }
 
@@ -292,8 +371,12 @@ static void fh_log_write(struct fh_write_unit *wu)
 {
 	int fd;
 
-	fprintf(logfile, "%c\t%"PRIu64"\t%u\n", wu->w_char, wu->w_offset,
-		wu->w_len);
+	if (nr_writers)
+		fprintf(logfile, "%c\t%"PRIu64"\t%u\t%"PRIu64"\n", wu->w_char,
+			wu->w_offset, wu->w_len, wu->w_seq);
+	else
+		fprintf(logfile, "%c\t%"PRIu64"\t%u\n", wu->w_char,
+			wu->w_offset, wu->w_len);
 
 	if (flush_output) {
 		fflush(logfile);
@@ -322,8 +405,8 @@ static void fh_prep_rand_write_unit(struct fh_write_unit *wu)
 		} else
 			cur_iter_per_chunk++;
 	} else {
-		assert(file_size <= TWO_GIGA_BYTE);
-		max_range = file_size - 1;
+		assert(region_size <= TWO_GIGA_BYTE);
+		max_range = region_size - 1;
 	}
 
 	wu->w_char = RAND_CHAR_START + (char) fh_get_rand(0, 52);
@@ -332,14 +415,14 @@ again:
 	wu->w_offset = fh_get_rand(0, max_range);
 	if (use_dio)
 		wu->w_offset = ALIGN(wu->w_offset, 512);
-	wu->w_offset += cur_iter_offset;
+	wu->w_offset += region_start + cur_iter_offset;
 
 	wu->w_len = (unsigned int) fh_get_rand(1, MAX_WRITE_SIZE);
 	if (use_dio)
 		wu->w_len = ALIGN(wu->w_len, 512);
 
-	if (wu->w_offset + wu->w_len > file_size)
-		wu->w_len = file_size - wu->w_offset;
+	if (wu->w_offset + wu->w_len > region_start + region_size)
+		wu->w_len = region_start + region_size - wu->w_offset;
 
 	/* sometimes the random number might work out like this */
 	if (wu->w_len == 0 || (use_dio && wu->w_len < 512))
@@ -370,6 +453,181 @@ static int fh_prep_write_unit(struct fh_write_unit *wu)
 	return 0;
 }
 
+static int fh_aio_init(int fd)
+{
+	int ret, i;
+	struct iovec iov;
+
+	aio_slots = calloc(aio_depth, sizeof(struct fh_aio_slot));
+	aio_res = calloc(aio_depth, sizeof(struct o2test_aio_res));
+	ret = posix_memalign((void **)&aio_bufs, 512,
+			     (size_t)aio_depth * MAX_WRITE_SIZE);
+	if (!ret)
+		ret = posix_memalign((void **)&aio_cmp_buf, 512,
+				     MAX_WRITE_SIZE);
+	if (ret || !aio_slots || !aio_res) {
+		fprintf(stderr, "malloc error %d: \"%s\"\n", ENOMEM,
+			strerror(ENOMEM));
+		return -1;
+	}
+
+	for (i = 0; i < aio_depth; i++)
+		aio_slots[i].s_buf = aio_bufs + (size_t)i * MAX_WRITE_SIZE;
+
+	ret = o2test_aio_setup(&fh_aio, aio_depth);
+	if (ret < 0)
+		return ret;
+
+	/* requests queue up and go down in one batch when we have to wait */
+	fh_aio.o2a_defer_submit = 1;
+
+	/* only an optimization, io_uring falls back to plain requests */
+	iov.iov_base = aio_bufs;
+	iov.iov_len = (size_t)aio_depth * MAX_WRITE_SIZE;
+	o2test_aio_register_buffers(&fh_aio, &iov, 1);
+	o2test_aio_register_files(&fh_aio, &fd, 1);
+
+	return 0;
+}
+
+static int fh_aio_check(int fd, struct fh_aio_slot *slot, long res)
+{
+	int ret, i;
+	struct fh_write_unit *wu = &slot->s_wu;
+	unsigned long long *ubuf = (unsigned long long *)slot->s_buf;
+	unsigned long long *ubuf_cmp = (unsigned long long *)aio_cmp_buf;
+
+	if (res != wu->w_len) {
+		fprintf(stderr, "aio write of %u bytes at %"PRIu64" returned "
+			"%ld\n", wu->w_len, wu->w_offset, res);
+		return -1;
+	}
+
+	ret = pread(fd, aio_cmp_buf, wu->w_len, wu->w_offset);
+	if (ret < 0) {
+		ret = errno;
+		fprintf(stderr, "pread error %d: \"%s\"\n", ret,
+			strerror(ret));
+		return -1;
+	}
+
+	if (ret < wu->w_len) {
+		fprintf(stderr, "short read back of %u bytes at %"PRIu64": "
+			"%d\n", wu->w_len, wu->w_offset, ret);
+		return -1;
+	}
+
+	if (memcmp(slot->s_buf, aio_cmp_buf, wu->w_len)) {
+		for (i = 0; i < wu->w_len / sizeof(unsigned long long); i++)
+			printf("%d: 0x%llx[aio_write]  0x%llx[pread]\n",
+			       i, ubuf[i], ubuf_cmp[i]);
+		fprintf(stderr, "read back of %u bytes at %"PRIu64" does not "
+			"match the aio write\n", wu->w_len, wu->w_offset);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Waits for at least min_nr writes, reads each back and frees its slot */
+static int fh_aio_reap(int fd, long min_nr)
+{
+	int ret, i;
+	struct fh_aio_slot *slot;
+
+	ret = o2test_aio_reap(&fh_aio, min_nr, aio_depth, aio_res);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < ret; i++) {
+		slot = aio_res[i].or_req.oq_cookie;
+
+		if (fh_aio_check(fd, slot, aio_res[i].or_res))
+			return -1;
+
+		slot->s_busy = 0;
+		aio_inflight--;
+	}
+
+	return 0;
+}
+
+static struct fh_aio_slot *fh_aio_conflict(struct fh_write_unit *wu)
+{
+	int i;
+	struct fh_write_unit *tmp;
+
+	for (i = 0; i < aio_depth; i++) {
+		if (!aio_slots[i].s_busy)
+			continue;
+
+		tmp = &aio_slots[i].s_wu;
+		if (wu->w_offset < tmp->w_offset + tmp->w_len &&
+		    tmp->w_offset < wu->w_offset + wu->w_len)
+			return &aio_slots[i];
+	}
+
+	return NULL;
+}
+
+static int fh_aio_write(int fd, struct fh_write_unit *wu)
+{
+	int ret, i;
+	struct fh_aio_slot *slot = NULL;
+	struct o2test_aio_req req;
+
+	/* a full queue or an overlapping write in flight, wait for some */
+	while (aio_inflight == aio_depth || fh_aio_conflict(wu)) {
+		ret = fh_aio_reap(fd, 1);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < aio_depth; i++) {
+		if (!aio_slots[i].s_busy) {
+			slot = &aio_slots[i];
+			break;
+		}
+	}
+
+	slot->s_wu = *wu;
+	slot->s_busy = 1;
+	memset(slot->s_buf, wu->w_char, wu->w_len);
+
+	req.oq_write = 1;
+	req.oq_fd = fd;
+	req.oq_buf = slot->s_buf;
+	req.oq_count = wu->w_len;
+	req.oq_offset = wu->w_offset;
+	req.oq_cookie = slot;
+
+	ret = o2test_aio_queue(&fh_aio, &req, 1);
+	if (ret < 0)
+		return ret;
+
+	aio_inflight++;
+
+	return 0;
+}
+
+static int fh_aio_finish(int fd)
+{
+	int ret = 0;
+
+	while (aio_inflight && !ret)
+		ret = fh_aio_reap(fd, aio_inflight);
+
+	if (o2test_aio_destroy(&fh_aio) < 0 && !ret)
+		ret = -1;
+
+	free(aio_slots);
+	free(aio_res);
+	free(aio_bufs);
+	free(aio_cmp_buf);
+
+	return ret;
+}
+
 int fh_do_write(int fd, struct fh_write_unit *wu)
 {
 	int ret, i;
@@ -384,6 +642,9 @@ int fh_do_write(int fd, struct fh_write_unit *wu)
 		return 0;
 	}
 
+	if (aio_depth)
+		return fh_aio_write(fd, wu);
+
 	memset(buf, wu->w_char, wu->w_len);
 
 	if (enable_aio) {
@@ -445,12 +706,199 @@ bail:
 	return ret;
 }
 
-int main(int argc, char **argv)
+static double fh_get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Sets the range of the file random writes land in, regions larger
+ * than 2G are filled one 2G chunk after the other.
+ */
+static void fh_set_region(uint64_t start, uint64_t size)
+{
+	uint64_t num_chunks;
+
+	region_start = start;
+	region_size = size;
+
+	if (region_size > TWO_GIGA_BYTE) {
+		num_chunks = region_size / TWO_GIGA_BYTE;
+		region_size = num_chunks * TWO_GIGA_BYTE;
+		max_iter_per_chunk = max_iter / num_chunks;
+	}
+}
+
+static int fh_lock_range(int fd, struct fh_write_unit *wu, short type)
+{
+	int ret;
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = wu->w_offset;
+	fl.l_len = wu->w_len;
+
+	ret = fcntl(fd, F_SETLKW, &fl);
+	if (ret == -1) {
+		ret = errno;
+		fprintf(stderr, "fcntl error %d: \"%s\"\n", ret,
+			strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int fh_run_writer(int fd)
 {
-	int ret, i, fd;
+	int ret, i;
 	struct fh_write_unit wu;
+
+	memset(&wu, 0, sizeof(wu));
+
+	for(i = 0; (i < max_iter) && !fh_replay_eof(); i++) {
+		ret = fh_prep_write_unit(&wu);
+		if (ret)
+			return ret;
+
+		if (shared_region) {
+			ret = fh_lock_range(fd, &wu, F_WRLCK);
+			if (ret)
+				return ret;
+		}
+
+		if (shared)
+			wu.w_seq = __atomic_fetch_add(&shared->fs_seq, 1,
+						      __ATOMIC_SEQ_CST);
+
+		fh_log_write(&wu);
+
+#if 0
+		fprintf(stdout, "%6d. %c %"PRIu64", %"PRIu32"\n", i, wu.w_char,
+			wu.w_offset, wu.w_len);
+#endif
+		ret = fh_do_write(fd, &wu);
+		if (ret)
+			return ret;
+
+		if (shared_region) {
+			ret = fh_lock_range(fd, &wu, F_UNLCK);
+			if (ret)
+				return ret;
+		}
+
+		if (writer_stat) {
+			writer_stat->ws_writes++;
+			writer_stat->ws_bytes += wu.w_len;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Forks the writers and waits for them, each one fills its region (or
+ * the whole file with -s) and logs to LOGFILE.N.
+ */
+static int fh_run_writers(int fd)
+{
+	int ret = 0, status;
+	uint32_t i, started;
+	uint64_t size, writes = 0, bytes = 0;
+	double start, elapsed;
+	char *base = logname;
+	pid_t pid;
+
+	shared = mmap(NULL, sizeof(struct fh_shared) +
+		      nr_writers * sizeof(struct fh_writer_stat),
+		      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		fprintf(stderr, "mmap error %d: \"%s\"\n", errno,
+			strerror(errno));
+		return -1;
+	}
+
+	size = (file_size / nr_writers) & ~511ULL;
+
+	start = fh_get_time();
+
+	for (started = 0; started < nr_writers; started++) {
+		pid = fork();
+		if (pid == -1) {
+			fprintf(stderr, "fork error %d: \"%s\"\n", errno,
+				strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		if (pid)
+			continue;
+
+		i = started;
+		writer_stat = &shared->fs_stats[i];
+		if (shared_region)
+			fh_set_region(0, file_size);
+		else if (i == nr_writers - 1)
+			fh_set_region(i * size, file_size - i * size);
+		else
+			fh_set_region(i * size, size);
+
+		if (asprintf(&logname, "%s.%u", base, i) == -1) {
+			fprintf(stderr, "malloc error.\n");
+			exit(1);
+		}
+
+		if (fh_open_logfile())
+			exit(1);
+
+		srand(getpid());
+
+		ret = fh_run_writer(fd);
+		fclose(logfile);
+		exit(ret ? 1 : 0);
+	}
+
+	while (started--) {
+		if (wait(&status) == -1) {
+			fprintf(stderr, "wait error %d: \"%s\"\n", errno,
+				strerror(errno));
+			return -1;
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = -1;
+	}
+
+	elapsed = fh_get_time() - start;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	for (i = 0; i < nr_writers; i++) {
+		printf("writer %u: %"PRIu64" writes, %.2f MB\n", i,
+		       shared->fs_stats[i].ws_writes,
+		       (double)shared->fs_stats[i].ws_bytes / ONE_MEGA_BYTE);
+		writes += shared->fs_stats[i].ws_writes;
+		bytes += shared->fs_stats[i].ws_bytes;
+	}
+
+	printf("%u %s writers: %"PRIu64" writes, %.2f MB in %.2fs, "
+	       "%.2f MB/s, %.0f writes/s\n", nr_writers,
+	       shared_region ? "overlapping" : "disjoint", writes,
+	       (double)bytes / ONE_MEGA_BYTE, elapsed,
+	       (double)bytes / ONE_MEGA_BYTE / elapsed, writes / elapsed);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret, fd;
 	void *vbuf = NULL;
-	uint64_t num_chunks;
 
 	if (argc < 3) {
 		usage();
@@ -475,6 +923,13 @@ int main(int argc, char **argv)
 	if (fd == -1)
 		return 1;
 
+	if (nr_writers) {
+		ret = fh_run_writers(fd);
+		if (ret)
+			return 1;
+		goto bail;
+	}
+
 	ret = fh_open_logfile();
 	if (ret)
 		return 1;
@@ -485,24 +940,20 @@ int main(int argc, char **argv)
 
 	srand(getpid());
 
-	if (file_size > TWO_GIGA_BYTE) {
-		num_chunks = file_size / TWO_GIGA_BYTE;
-		file_size = num_chunks * TWO_GIGA_BYTE;
-		max_iter_per_chunk = max_iter / num_chunks;
-	}
+	fh_set_region(0, file_size);
 
-	for(i = 0; (i < max_iter) && !fh_replay_eof(); i++) {
-		ret = fh_prep_write_unit(&wu);
+	if (aio_depth) {
+		ret = fh_aio_init(fd);
 		if (ret)
 			return 1;
+	}
 
-		fh_log_write(&wu);
+	ret = fh_run_writer(fd);
+	if (ret)
+		return 1;
 
-#if 0
-		fprintf(stdout, "%6d. %c %"PRIu64", %"PRIu32"\n", i, wu.w_char,
-			wu.w_offset, wu.w_len);
-#endif
-		ret = fh_do_write(fd, &wu);
+	if (aio_depth) {
+		ret = fh_aio_finish(fd);
 		if (ret)
 			return 1;
 	}
@@ -7,10 +7,15 @@
 #define RAND_CHAR_START		'A'
 #define MAGIC_HOLE_CHAR		(RAND_CHAR_START - 1)
 
+/*
+ * Logs of concurrent writers (fill_holes -w) carry w_seq as a fourth
+ * column, taken from a counter shared by all writers.
+ */
 struct fh_write_unit {
 	char		w_char;
 	uint64_t	w_offset;
 	uint32_t	w_len;
+	uint64_t	w_seq;
 };
 
 #endif
@@ -34,6 +34,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include <ocfs2/ocfs2.h>
 #include <ocfs2/kernel-rbtree.h>
@@ -42,36 +45,93 @@
 
 struct rb_root	chunk_root = RB_ROOT;
 
+/*
+ * The rb-tree holds non-overlapping extents sorted by offset, adjacent
+ * extents of the same character are coalesced.  Chunks come from a pool
+ * and go back to it when an extent gets overwritten, so memory follows
+ * the number of live extents rather than the length of the log.
+ */
 struct file_chunk {
-	struct fh_write_unit	fc_write;
-	struct rb_node		fc_node;
+	uint64_t		fc_start;
+	uint64_t		fc_end;
+	char			fc_char;
+	union {
+		struct rb_node		fc_node;
+		struct file_chunk	*fc_next_free;
+	};
+};
+
+#define VH_POOL_SLAB		4096
+
+struct chunk_slab {
+	struct chunk_slab	*cs_next;
+	struct file_chunk	cs_chunks[VH_POOL_SLAB];
+};
+
+static struct chunk_slab *chunk_slabs;
+static unsigned int slab_used = VH_POOL_SLAB;
+static struct file_chunk *free_chunks;
+static unsigned long nr_chunks;
+
+/* Extents are checked in pieces no longer than this */
+#define VH_MAX_CHECK_LEN	(1U << 30)
+
+/*
+ * Fast mode reads the file in windows of this size, and confirms zero
+ * extents at least VH_SEEK_MIN long with SEEK_DATA/SEEK_HOLE instead of
+ * reading them.
+ */
+#define VH_FAST_BUF_SIZE	(8 * 1024 * 1024)
+#define VH_SEEK_MIN		(1024 * 1024)
+
+/* One log being replayed, holds its next record while logs are merged */
+struct vh_log {
+	char			*l_name;
+	FILE			*l_fp;
+	unsigned int		l_line;
+	int			l_eof;
+	int			l_has_seq;
+	struct fh_write_unit	l_wu;
 };
 
-static struct file_chunk *init_chunk = NULL;
 static char buf[MAX_WRITE_SIZE];
 static int verbose = 0;
+static int fast = 0;
+
+static char *win_buf;
+static uint64_t win_off, win_len;
+static int seek_hole_ok = 1;
+static uint64_t bytes_read, bytes_hole;
 
 static void vh_usage(void)
 {
-	printf("verify_holes [-v] LOGFILE FILE\n"
+	printf("verify_holes [-v] [-f] LOGFILE [LOGFILE...] FILE\n"
 	       "FILE is a path to a file\n"
 	       "LOGFILE is a path to a log file\n"
 	       "Use LOGFILE to verify the patterns written by fill_holes\n"
 	       "in FILE\n"
-		"-v will turn on verbose mode\n");
+	       "Logs of concurrent writers (fill_holes -w) are merged by "
+	       "sequence number\n"
+		"-v will turn on verbose mode\n"
+		"-f will turn on fast mode, holes are confirmed with "
+		"SEEK_DATA/SEEK_HOLE\n   and data is read in large windows, "
+		"throughput is reported\n");
 
 	exit(0);
 }
 
-static int vh_open_files(char *log, FILE **logfp, char *testfile, int *testfd)
+static int vh_open_files(struct vh_log *logs, int nr_logs, char *testfile,
+			 int *testfd)
 {
-	int fd;
-
-	*logfp = fopen(log, "r");
-	if (!*logfp) {
-		fprintf(stderr, "error %d opening \"%s\": \"%s\"\n", errno,
-			log, strerror(errno));
-		return -1;
+	int fd, i;
+
+	for (i = 0; i < nr_logs; i++) {
+		logs[i].l_fp = fopen(logs[i].l_name, "r");
+		if (!logs[i].l_fp) {
+			fprintf(stderr, "error %d opening \"%s\": \"%s\"\n",
+				errno, logs[i].l_name, strerror(errno));
+			return -1;
+		}
 	}
 
 	fd = open(testfile, O_RDONLY);
@@ -104,15 +164,41 @@ static int vh_get_i_size(int fd, unsigned long *size)
 
 static struct file_chunk *vh_alloc_chunk(void)
 {
-	struct file_chunk *f = calloc(1, sizeof(*init_chunk));
-	if (!f) {
-		fprintf(stderr, "malloc error.\n");
-		exit(1);
+	struct chunk_slab *slab;
+	struct file_chunk *f;
+
+	if (free_chunks) {
+		f = free_chunks;
+		free_chunks = f->fc_next_free;
+		goto out;
+	}
+
+	if (slab_used == VH_POOL_SLAB) {
+		slab = malloc(sizeof(*slab));
+		if (!slab) {
+			fprintf(stderr, "malloc error.\n");
+			exit(1);
+		}
+		slab->cs_next = chunk_slabs;
+		chunk_slabs = slab;
+		slab_used = 0;
 	}
 
+	f = &chunk_slabs->cs_chunks[slab_used++];
+out:
+	nr_chunks++;
+	memset(f, 0, sizeof(*f));
+
 	return f;
 }
 
+static void vh_free_chunk(struct file_chunk *f)
+{
+	f->fc_next_free = free_chunks;
+	free_chunks = f;
+	nr_chunks--;
+}
+
 static void vh_print_extent(const char *pre, FILE *where, struct fh_write_unit *wu)
 {
 	char ch[3] = "\\0\0";
@@ -126,111 +212,26 @@ static void vh_print_extent(const char *pre, FILE *where, struct fh_write_unit *
 		wu->w_offset, wu->w_len, wu->w_offset + wu->w_len);
 }
 
-static int recurse_level = 0;
+static double vh_get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-static void vh_insert_chunk(struct file_chunk *chunk)
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void vh_link_chunk(struct file_chunk *chunk)
 {
-	struct rb_node **p;
-	struct rb_node *parent;
+	struct rb_node **p = &chunk_root.rb_node;
+	struct rb_node *parent = NULL;
 	struct file_chunk *tmp;
-	unsigned long off = chunk->fc_write.w_offset;
-	unsigned int len = chunk->fc_write.w_len;
-	unsigned long end = off + len;
 
-	/*
-	 * This function should never recurse more than once - the
-	 * second insert (if called) should _always_ be to a region
-	 * which has been pre-cleared
-	 */
-	recurse_level++;
-	if (recurse_level > 2) {
-		fprintf(stderr, "Recursion level too high\n");
-		abort();
-	}
-
-restart_search:
-#ifdef DEBUG_INSERT
-	vh_print_extent("insert chunk", stdout, &chunk->fc_write);
-#endif
-	p = &chunk_root.rb_node;
-	parent = NULL;
-
-	while(*p) {
-		unsigned long tmpoff;
-		unsigned int tmplen;
-		unsigned long tmpend;
-		struct fh_write_unit *wu;
+	while (*p) {
 		parent = *p;
-
 		tmp = rb_entry(parent, struct file_chunk, fc_node);
 
-		wu = &tmp->fc_write;
-		tmpoff = wu->w_offset;
-		tmplen = wu->w_len;
-		tmpend = tmpoff + tmplen;
-
-		if (off <= tmpoff && end >= tmpend) {
-#ifdef DEBUG_INSERT
-			printf("Fully encompasses another extent\n");
-			vh_print_extent("extent found", stdout, wu);
-#endif
-
-			/* We fully encompass this extent */
-			rb_erase(&tmp->fc_node, &chunk_root);
-			free(tmp);
-
-			goto restart_search;
-		} else if (off > tmpoff && end < tmpend) {
-			struct file_chunk *tmp2 = vh_alloc_chunk();
-			char tmpch = wu->w_char;
-			/* We are in the middle of this extent */
-#ifdef DEBUG_INSERT
-			printf("Split existing extent\n");
-			vh_print_extent("extent found", stdout, wu);
-#endif
-
-			rb_erase(&tmp->fc_node, &chunk_root);
-
-			wu->w_len = off - tmpoff;
-
-			vh_insert_chunk(tmp);
-
-			wu = &tmp2->fc_write;
-
-			wu->w_offset = end;
-			wu->w_len = tmpend - wu->w_offset;
-			wu->w_char = tmpch;
-
-			vh_insert_chunk(tmp2);
-			goto restart_search;
-		} else if (off <= tmpoff && end <= tmpend && end > tmpoff) {
-			/* We straddle the left side of this extent */
-#ifdef DEBUG_INSERT
-			printf("Left straddle existing extent\n");
-			vh_print_extent("extent found", stdout, wu);
-#endif
-
-			rb_erase(&tmp->fc_node, &chunk_root);
-
-			wu->w_offset = end;
-			wu->w_len = tmpend - wu->w_offset;
-
-			vh_insert_chunk(tmp);
-			goto restart_search;
-		} else if (off > tmpoff && off < tmpend && end >= tmpend) {
-#ifdef DEBUG_INSERT
-			printf("Right straddle existing extent\n");
-			vh_print_extent("extent found", stdout, wu);
-#endif
-
-			/* We straddle the right side of this extent */
-			rb_erase(&tmp->fc_node, &chunk_root);
-
-			wu->w_len = off - tmpoff;
-
-			vh_insert_chunk(tmp);
-			goto restart_search;
-		} else if (off < tmpoff)
+		if (chunk->fc_start < tmp->fc_start)
 			p = &(*p)->rb_left;
 		else
 			p = &(*p)->rb_right;
@@ -238,51 +239,247 @@ restart_search:
 
 	rb_link_node(&chunk->fc_node, parent, p);
 	rb_insert_color(&chunk->fc_node, &chunk_root);
+}
+
+/* First extent ending after off */
+static struct rb_node *vh_lookup_chunk(uint64_t off)
+{
+	struct rb_node *node = chunk_root.rb_node, *found = NULL;
+	struct file_chunk *tmp;
+
+	while (node) {
+		tmp = rb_entry(node, struct file_chunk, fc_node);
 
-	recurse_level--;
+		if (tmp->fc_end > off) {
+			found = node;
+			node = node->rb_left;
+		} else
+			node = node->rb_right;
+	}
+
+	return found;
+}
+
+/*
+ * Records later in the log overwrite the ones they overlap: extents
+ * partially covered are trimmed (or split when the new one lands in
+ * their middle), fully covered ones are dropped, then the new extent is
+ * merged with same-character neighbours.
+ */
+static void vh_insert_chunk(uint64_t start, uint64_t end, char ch)
+{
+	struct rb_node *node, *next;
+	struct file_chunk *tmp, *tail, *chunk;
+
+	if (start >= end)
+		return;
+
+	node = vh_lookup_chunk(start);
+	while (node) {
+		tmp = rb_entry(node, struct file_chunk, fc_node);
+		if (tmp->fc_start >= end)
+			break;
+
+		next = rb_next(node);
+
+		if (tmp->fc_start <= start && tmp->fc_end >= end &&
+		    tmp->fc_char == ch)
+			return;
+
+		if (tmp->fc_start < start && tmp->fc_end > end) {
+			/* in the middle, tmp keeps the head */
+			tail = vh_alloc_chunk();
+			tail->fc_start = end;
+			tail->fc_end = tmp->fc_end;
+			tail->fc_char = tmp->fc_char;
+			tmp->fc_end = start;
+			vh_link_chunk(tail);
+			break;
+		} else if (tmp->fc_start < start) {
+			tmp->fc_end = start;
+		} else if (tmp->fc_end > end) {
+			/* nothing lies in between, the order is kept */
+			tmp->fc_start = end;
+			break;
+		} else {
+			rb_erase(node, &chunk_root);
+			vh_free_chunk(tmp);
+		}
+
+		node = next;
+	}
+
+	chunk = vh_alloc_chunk();
+	chunk->fc_start = start;
+	chunk->fc_end = end;
+	chunk->fc_char = ch;
+	vh_link_chunk(chunk);
+
+	node = rb_prev(&chunk->fc_node);
+	if (node) {
+		tmp = rb_entry(node, struct file_chunk, fc_node);
+		if (tmp->fc_end == start && tmp->fc_char == ch) {
+			tmp->fc_end = end;
+			rb_erase(&chunk->fc_node, &chunk_root);
+			vh_free_chunk(chunk);
+			chunk = tmp;
+		}
+	}
+
+	node = rb_next(&chunk->fc_node);
+	if (node) {
+		tmp = rb_entry(node, struct file_chunk, fc_node);
+		if (tmp->fc_start == chunk->fc_end && tmp->fc_char == ch) {
+			chunk->fc_end = tmp->fc_end;
+			rb_erase(node, &chunk_root);
+			vh_free_chunk(tmp);
+		}
+	}
 }
 
 static void vh_init_tree(unsigned long file_size)
 {
-	init_chunk = vh_alloc_chunk();
+	vh_insert_chunk(0, file_size, '\0');
+}
+
+static int vh_parse_record(char *line, struct fh_write_unit *wu,
+			   int *has_seq)
+{
+	char *p;
+
+	if (line[0] == '\0' || line[1] != '\t')
+		return EINVAL;
+
+	wu->w_char = line[0];
 
-	init_chunk->fc_write.w_char = '\0';
-	init_chunk->fc_write.w_len = file_size;
-	init_chunk->fc_write.w_offset = 0;
+	errno = 0;
+	wu->w_offset = strtoull(line + 2, &p, 10);
+	if (errno || p == line + 2 || *p != '\t')
+		return EINVAL;
+
+	line = p + 1;
+	wu->w_len = strtoul(line, &p, 10);
+	if (errno || p == line)
+		return EINVAL;
 
-	vh_insert_chunk(init_chunk);
+	*has_seq = 0;
+	if (*p == '\t') {
+		line = p + 1;
+		wu->w_seq = strtoull(line, &p, 10);
+		if (errno || p == line)
+			return EINVAL;
+		*has_seq = 1;
+	}
+
+	if (*p != '\n' && *p != '\0')
+		return EINVAL;
+
+	return 0;
 }
 
-static int vh_read_log(FILE *logfile)
+/* Loads the next record of a log, sets l_eof at the end */
+static int vh_next_record(struct vh_log *log, int merge)
 {
-	int ret;
-	unsigned int line = 0;
-	struct file_chunk *chunk;
+	int ret, has_seq;
+	char record[128];
+	uint64_t prev_seq = log->l_wu.w_seq;
+
+	if (!fgets(record, sizeof(record), log->l_fp)) {
+		if (ferror(log->l_fp)) {
+			ret = errno;
+			fprintf(stderr, "error %d reading log file %s: %s\n",
+				ret, log->l_name, strerror(ret));
+			return ret;
+		}
+		log->l_eof = 1;
+		return 0;
+	}
+
+	ret = vh_parse_record(record, &log->l_wu, &has_seq);
+	if (ret) {
+		fprintf(stderr, "input failure at log file %s line %u\n",
+			log->l_name, log->l_line);
+		return ret;
+	}
+
+	if (merge) {
+		if (!has_seq) {
+			fprintf(stderr, "log file %s line %u has no sequence "
+				"number, cannot merge it\n", log->l_name,
+				log->l_line);
+			return EINVAL;
+		}
+
+		if (log->l_line && log->l_wu.w_seq <= prev_seq) {
+			fprintf(stderr, "log file %s line %u is out of "
+				"sequence\n", log->l_name, log->l_line);
+			return EINVAL;
+		}
+	}
+
+	if (log->l_wu.w_char == MAGIC_HOLE_CHAR)
+		log->l_wu.w_char = '\0';
+
+	log->l_line++;
+
+	return 0;
+}
+
+/*
+ * Replays the logs in sequence order, records are streamed one at a time
+ * from each log.  The writer count is small, the lowest sequence is
+ * found with a linear scan.
+ */
+static int vh_read_logs(struct vh_log *logs, int nr_logs)
+{
+	int ret, i, merge = nr_logs > 1;
+	unsigned int records = 0;
+	struct vh_log *log;
 	struct fh_write_unit *wu;
+	struct rusage ru;
+	double start, elapsed;
+
+	start = vh_get_time();
+
+	for (i = 0; i < nr_logs; i++) {
+		ret = vh_next_record(&logs[i], merge);
+		if (ret)
+			return ret;
+	}
 
 	while (1) {
-		chunk = vh_alloc_chunk();
-		wu = &chunk->fc_write;
-
-		ret = fscanf(logfile, "%c\t%"PRIu64"\t%u\n", &wu->w_char,
-			     &wu->w_offset, &wu->w_len);
-		if (ret == 3) {
-			if (wu->w_char == MAGIC_HOLE_CHAR)
-				wu->w_char = '\0';
-			vh_insert_chunk(chunk);
-			line++;
-			continue;
+		log = NULL;
+		for (i = 0; i < nr_logs; i++) {
+			if (logs[i].l_eof)
+				continue;
+			if (!log || logs[i].l_wu.w_seq < log->l_wu.w_seq)
+				log = &logs[i];
 		}
 
-		if (ret == EOF)
-			return 0;
+		if (!log)
+			break;
 
-		fprintf(stderr, "input failure at log file line %u\n", line);
-		ret = EINVAL;
-		break;
+		wu = &log->l_wu;
+		vh_insert_chunk(wu->w_offset, wu->w_offset + wu->w_len,
+				wu->w_char);
+		records++;
+
+		ret = vh_next_record(log, merge);
+		if (ret)
+			return ret;
 	}
 
-	return ret;
+	elapsed = vh_get_time() - start;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("replayed %u log records from %d log(s) in %.2fs "
+	       "(%.0f inserts/s), %lu extents, peak RSS %ld KB\n", records,
+	       nr_logs, elapsed, records / elapsed, nr_chunks, ru.ru_maxrss);
+
+	return 0;
 }
 
 static int vh_check_chunk(struct fh_write_unit *wu, int fd)
@@ -344,35 +541,237 @@ static int vh_check_chunk(struct fh_write_unit *wu, int fd)
 	return 0;
 }
 
+/*
+ * Offset of the first byte in p which isn't c, len when there is none.
+ * 64 bytes are folded per iteration with generic vectors, which gcc
+ * lowers to whatever SIMD the target has.
+ */
+static size_t vh_find_mismatch(const char *p, size_t len, char c)
+{
+	typedef unsigned char vh_vec __attribute__ ((vector_size(16)));
+	vh_vec pat, v0, v1, v2, v3;
+	uint64_t w[2];
+	size_t i = 0;
+
+	memset(&pat, c, sizeof(pat));
+
+	for (; i + 64 <= len; i += 64) {
+		memcpy(&v0, p + i, 16);
+		memcpy(&v1, p + i + 16, 16);
+		memcpy(&v2, p + i + 32, 16);
+		memcpy(&v3, p + i + 48, 16);
+
+		v0 = (v0 ^ pat) | (v1 ^ pat) | (v2 ^ pat) | (v3 ^ pat);
+		memcpy(w, &v0, sizeof(w));
+		if (w[0] | w[1])
+			break;
+	}
+
+	for (; i < len; i++)
+		if (p[i] != c)
+			return i;
+
+	return len;
+}
+
+/*
+ * Returns a pointer to count bytes at off, reading a new window of up to
+ * win bytes if needed.
+ */
+static int vh_fast_read(int fd, uint64_t off, unsigned int count,
+			unsigned int win, char **p)
+{
+	ssize_t ret;
+
+	if (off < win_off || off + count > win_off + win_len) {
+		ret = pread(fd, win_buf, win, off);
+		if (ret == -1) {
+			ret = errno;
+			fprintf(stderr, "read error %d: %s\n",
+				(int)ret, strerror(ret));
+			win_len = 0;
+			return ret;
+		}
+
+		win_off = off;
+		win_len = ret;
+
+		if (ret == 0) {
+			fprintf(stderr, "premature end of file\n");
+			return EINVAL;
+		}
+
+		if (ret < count) {
+			fprintf(stderr, "short read. asked %u, read %u\n",
+				count, (unsigned int)ret);
+			return EINVAL;
+		}
+	}
+
+	*p = win_buf + (off - win_off);
+
+	return 0;
+}
+
+static int vh_fast_check_range(struct fh_write_unit *wu, int fd,
+			       uint64_t off, uint64_t len, unsigned int win)
+{
+	int ret;
+	char *p = NULL;
+	unsigned int count;
+	size_t pos;
+
+	while (len) {
+		count = len;
+		if (len > VH_FAST_BUF_SIZE)
+			count = VH_FAST_BUF_SIZE;
+
+		ret = vh_fast_read(fd, off, count, win > count ? win : count,
+				   &p);
+		if (ret)
+			return ret;
+
+		pos = vh_find_mismatch(p, count, wu->w_char);
+		if (pos < count) {
+			if (verbose)
+				fprintf(stdout, "Failure. %"PRIu64" bytes "
+					"into the file we expected "
+					"0x%x but got 0x%x\n", off + pos,
+					wu->w_char, p[pos]);
+			return 1;
+		}
+
+		bytes_read += count;
+		len -= count;
+		off += count;
+	}
+
+	return 0;
+}
+
+static int vh_fast_check_chunk(struct fh_write_unit *wu, int fd)
+{
+	int ret;
+	off_t data, hole;
+	uint64_t off = wu->w_offset;
+	uint64_t end = wu->w_offset + wu->w_len;
+
+	if (verbose)
+		vh_print_extent("check chunk", stdout, wu);
+
+	if (wu->w_char != '\0' || wu->w_len < VH_SEEK_MIN || !seek_hole_ok)
+		return vh_fast_check_range(wu, fd, off, wu->w_len,
+					   VH_FAST_BUF_SIZE);
+
+	/*
+	 * Ranges the filesystem reports as holes read back as zeros by
+	 * definition, only the data in between has to be read.
+	 */
+	while (off < end) {
+		data = lseek(fd, off, SEEK_DATA);
+		if (data == -1) {
+			if (errno != ENXIO) {
+				/* not supported, read everything from now on */
+				seek_hole_ok = 0;
+				return vh_fast_check_range(wu, fd, off,
+							   end - off,
+							   VH_FAST_BUF_SIZE);
+			}
+			data = end;
+		}
+
+		if (data > end)
+			data = end;
+
+		bytes_hole += data - off;
+		if (data == end)
+			break;
+
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1 || hole > end)
+			hole = end;
+
+		/*
+		 * Only read up to the next hole, the extents following
+		 * this one are likely in the same data range.
+		 */
+		ret = vh_fast_check_range(wu, fd, data, hole - data, 0);
+		if (ret)
+			return ret;
+
+		off = hole;
+	}
+
+	return 0;
+}
+
 static int vh_check_file(int fd)
 {
 	int ret;
+	double start = 0, elapsed;
+	uint64_t off;
 	struct rb_node *node;
 	struct file_chunk *chunk;
+	struct fh_write_unit wu;
+
+	if (fast) {
+		win_buf = malloc(VH_FAST_BUF_SIZE);
+		if (!win_buf) {
+			fprintf(stderr, "malloc error.\n");
+			return ENOMEM;
+		}
+		start = vh_get_time();
+	}
 
 	node = rb_first(&chunk_root);
 	while (node) {
 		chunk = rb_entry(node, struct file_chunk, fc_node);
 
-		ret = vh_check_chunk(&chunk->fc_write, fd);
-		if (ret) {
-			vh_print_extent("Verify failed", stderr,
-				     &chunk->fc_write);
-			return EINVAL;
+		wu.w_char = chunk->fc_char;
+		for (off = chunk->fc_start; off < chunk->fc_end;
+		     off += wu.w_len) {
+			wu.w_offset = off;
+			wu.w_len = VH_MAX_CHECK_LEN;
+			if (chunk->fc_end - off < VH_MAX_CHECK_LEN)
+				wu.w_len = chunk->fc_end - off;
+
+			if (fast)
+				ret = vh_fast_check_chunk(&wu, fd);
+			else
+				ret = vh_check_chunk(&wu, fd);
+			if (ret) {
+				vh_print_extent("Verify failed", stderr, &wu);
+				return EINVAL;
+			}
 		}
 
 		node = rb_next(node);
 	}
 
+	if (fast) {
+		elapsed = vh_get_time() - start;
+		if (elapsed <= 0)
+			elapsed = 1e-9;
+
+		printf("verified %"PRIu64" bytes read and %"PRIu64" bytes of "
+		       "holes in %.2fs, %.2f MB/s read, %.2f MB/s overall\n",
+		       bytes_read, bytes_hole, elapsed,
+		       bytes_read / elapsed / (1024 * 1024),
+		       (bytes_read + bytes_hole) / elapsed / (1024 * 1024));
+
+		free(win_buf);
+	}
+
 	return 0;
 }
 
-static int vh_parse_opts(int argc, char **argv, char **logname, char **fname)
+static int vh_parse_opts(int argc, char **argv, struct vh_log **logs,
+			 int *nr_logs, char **fname)
 {
-	int c;
+	int c, i;
 
 	while (1) {
-		c = getopt(argc, argv, "v");
+		c = getopt(argc, argv, "vf");
 		if (c == -1)
 			break;
 
@@ -380,34 +779,45 @@ static int vh_parse_opts(int argc, char **argv, char **logname, char **fname)
 		case 'v':
 			verbose = 1;
 			break;
+		case 'f':
+			fast = 1;
+			break;
 		default:
 			return EINVAL;
 		}
 	}
- 
-	if (argc - optind != 2)
+
+	if (argc - optind < 2)
 		return EINVAL;
 
-	*logname = argv[optind];
-	*fname = argv[optind + 1];
+	*nr_logs = argc - optind - 1;
+	*logs = calloc(*nr_logs, sizeof(struct vh_log));
+	if (!*logs) {
+		fprintf(stderr, "malloc error.\n");
+		exit(1);
+	}
+
+	for (i = 0; i < *nr_logs; i++)
+		(*logs)[i].l_name = argv[optind + i];
+	*fname = argv[argc - 1];
 
 	return 0;
 }
 
 int main(int argc, char **argv)
 {
-	int ret, fd;
-	FILE *logfile;
+	int ret, fd, nr_logs;
+	struct vh_log *logs;
 	unsigned long size = 0;
-	char *logname, *fname;
+	char *fname;
 
-	ret = vh_parse_opts(argc, argv, &logname, &fname);
+	ret = vh_parse_opts(argc, argv, &logs, &nr_logs, &fname);
 	if (ret) {
 		vh_usage();
 		return 0;
 	}
 
-	ret = vh_open_files(logname, &logfile, fname, &fd);
+	ret = vh_open_files(logs, nr_logs, fname, &fd);
 	if (ret)
 		return 1;
 
@@ -418,11 +828,12 @@ int main(int argc, char **argv)
 	vh_init_tree(size);
 
 	/*
-	 * Read in logfile, sorting records as we go:
-	 *  - records later in the log file are assumed to overwrite those
-	 *    with which they overlap.
+	 * Read in logfiles, sorting records as we go:
+	 *  - records later in the log file (or with a higher sequence
+	 *    number across logs) are assumed to overwrite those with
+	 *    which they overlap.
 	 */
-	ret = vh_read_log(logfile);
+	ret = vh_read_logs(logs, nr_logs);
 	if (ret)
 		return 1;
 
@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -35,123 +36,401 @@
 
 #include "aio.h"
 
+static const char *o2test_aio_backends[] = {
+	[O2TEST_AIO_LIBAIO]	= "libaio",
+	[O2TEST_AIO_URING]	= "io_uring",
+};
+
+int o2test_aio_get_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(o2test_aio_backends) / sizeof(char *); i++)
+		if (!strcmp(name, o2test_aio_backends[i]))
+			return i;
+
+	fprintf(stderr, "unknown aio backend %s\n", name);
+
+	return -1;
+}
+
+const char *o2test_aio_backend_name(struct o2test_aio *o2a)
+{
+	return o2test_aio_backends[o2a->o2a_backend];
+}
+
 int o2test_aio_setup(struct o2test_aio *o2a, int nr_events)
 {
-	int ret = 0, i;
+	int backend = O2TEST_AIO_LIBAIO;
+	char *name = getenv("O2TEST_AIO_BACKEND");
 
-	o2a->o2a_ctx = NULL;
-	o2a->o2a_nr_events = nr_events;
-	o2a->o2a_iocbs = (struct iocb **)malloc(sizeof(struct iocb *) *
-						nr_events);
+	if (name && *name) {
+		backend = o2test_aio_get_backend(name);
+		if (backend < 0)
+			return -1;
+	}
+
+	return o2test_aio_setup_backend(o2a, nr_events, backend);
+}
+
+static int o2test_aio_alloc(struct o2test_aio *o2a, int nr_events)
+{
+	int i;
+	struct iocb *pool;
+
+	o2a->o2a_reqs = calloc(nr_events, sizeof(struct o2test_aio_req));
+	o2a->o2a_free_slots = malloc(sizeof(int) * nr_events);
+	if (!o2a->o2a_reqs || !o2a->o2a_free_slots)
+		return -1;
+
+	/* popped from the end, hand out slot 0 first */
+	for (i = 0; i < nr_events; i++)
+		o2a->o2a_free_slots[i] = nr_events - 1 - i;
+	o2a->o2a_nr_free = nr_events;
+
+	if (o2a->o2a_backend == O2TEST_AIO_URING) {
+		o2a->o2a_ev_data = malloc(sizeof(unsigned long long) *
+					  nr_events);
+		o2a->o2a_ev_res = malloc(sizeof(long) * nr_events);
+		if (!o2a->o2a_ev_data || !o2a->o2a_ev_res)
+			return -1;
+
+		return 0;
+	}
+
+	/* iocbs are contiguous so that a completion maps back to its slot */
+	o2a->o2a_iocbs = calloc(nr_events, sizeof(struct iocb *));
+	pool = calloc(nr_events, sizeof(struct iocb));
+	o2a->o2a_queued = malloc(sizeof(struct iocb *) * nr_events);
+	o2a->o2a_events = malloc(sizeof(struct io_event) * nr_events);
+	if (!o2a->o2a_iocbs || !pool || !o2a->o2a_queued ||
+	    !o2a->o2a_events) {
+		free(pool);
+		return -1;
+	}
 
 	for (i = 0; i < nr_events; i++)
-		o2a->o2a_iocbs[i] = (struct iocb *)malloc(sizeof(struct iocb));
+		o2a->o2a_iocbs[i] = &pool[i];
+
+	return 0;
+}
+
+static void o2test_aio_free(struct o2test_aio *o2a)
+{
+	if (o2a->o2a_iocbs) {
+		free(o2a->o2a_iocbs[0]);
+		free(o2a->o2a_iocbs);
+	}
+
+	free(o2a->o2a_queued);
+	free(o2a->o2a_events);
+	free(o2a->o2a_ev_data);
+	free(o2a->o2a_ev_res);
+	free(o2a->o2a_reqs);
+	free(o2a->o2a_free_slots);
+
+	o2a->o2a_iocbs = NULL;
+	o2a->o2a_queued = NULL;
+	o2a->o2a_events = NULL;
+	o2a->o2a_ev_data = NULL;
+	o2a->o2a_ev_res = NULL;
+	o2a->o2a_reqs = NULL;
+	o2a->o2a_free_slots = NULL;
+}
+
+int o2test_aio_setup_backend(struct o2test_aio *o2a, int nr_events,
+			     int backend)
+{
+	int ret = 0;
+
+	memset(o2a, 0, sizeof(*o2a));
+	o2a->o2a_backend = backend;
+	o2a->o2a_nr_events = nr_events;
+
+	if (o2test_aio_alloc(o2a, nr_events)) {
+		fprintf(stderr, "error %s during %s\n", strerror(ENOMEM),
+			"malloc");
+		o2test_aio_free(o2a);
+		return -1;
+	}
+
+	if (backend == O2TEST_AIO_URING) {
+		ret = o2test_uring_setup(o2a, nr_events);
+		if (ret < 0)
+			o2test_aio_free(o2a);
+		return ret;
+	}
 
 	ret = io_setup(nr_events, &(o2a->o2a_ctx));
 	if (ret) {
-		ret = errno;
-		fprintf(stderr, "error %s during %s\n", strerror(errno),
+		ret = -ret;
+		fprintf(stderr, "error %s during %s\n", strerror(ret),
 			"io_setup");
+		o2test_aio_free(o2a);
 		ret = -1;
 	}
 
-	o2a->o2a_cr_event = 0;
-
 	return ret;
 }
 
-int o2test_aio_pwrite(struct o2test_aio *o2a, int fd, void *buf, size_t count,
-		      off_t offset)
+int o2test_aio_nr_free(struct o2test_aio *o2a)
 {
-	int ret = 0;
-	struct iocb *iocbs[] = { o2a->o2a_iocbs[o2a->o2a_cr_event] };
+	return o2a->o2a_nr_free;
+}
 
-	if (o2a->o2a_cr_event >= o2a->o2a_nr_events) {
+static int o2test_aio_prep(struct o2test_aio *o2a, struct o2test_aio_req *req)
+{
+	int ret, slot;
+	struct iocb *iocb;
+
+	if (!o2a->o2a_nr_free) {
 		fprintf(stderr, "current aio context didn't support %d "
-			"requests\n", o2a->o2a_cr_event);
+			"requests\n", o2a->o2a_cr_event + 1);
 		return -1;
 	}
 
-	io_prep_pwrite(o2a->o2a_iocbs[o2a->o2a_cr_event], fd, buf,
-		       count, offset);
-	ret = io_submit(o2a->o2a_ctx, 1, iocbs);
-	if (ret != 1) {
-		ret = errno;
-		fprintf(stderr, "error %s during %s\n", strerror(errno),
-			"io_submit");
-		ret = -1;
+	slot = o2a->o2a_free_slots[o2a->o2a_nr_free - 1];
+
+	if (o2a->o2a_backend == O2TEST_AIO_URING) {
+		ret = o2test_uring_prep(o2a, req->oq_write, req->oq_fd,
+					req->oq_buf, req->oq_count,
+					req->oq_offset, slot);
+		if (ret < 0)
+			return ret;
+	} else {
+		iocb = o2a->o2a_iocbs[slot];
+		if (req->oq_write)
+			io_prep_pwrite(iocb, req->oq_fd, req->oq_buf,
+				       req->oq_count, req->oq_offset);
+		else
+			io_prep_pread(iocb, req->oq_fd, req->oq_buf,
+				      req->oq_count, req->oq_offset);
+		o2a->o2a_queued[o2a->o2a_nr_queued] = iocb;
 	}
 
+	o2a->o2a_reqs[slot] = *req;
+	o2a->o2a_nr_free--;
 	o2a->o2a_cr_event++;
+	o2a->o2a_nr_queued++;
+
+	return 0;
+}
+
+int o2test_aio_queue(struct o2test_aio *o2a, struct o2test_aio_req *reqs,
+		     int nr)
+{
+	int ret, i;
+
+	if (nr > o2a->o2a_nr_free) {
+		fprintf(stderr, "%d requests queued with only %d free aio "
+			"slots\n", nr, o2a->o2a_nr_free);
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ret = o2test_aio_prep(o2a, &reqs[i]);
+		if (ret < 0)
+			return ret;
+	}
+
+	return nr;
+}
+
+int o2test_aio_submit_batch(struct o2test_aio *o2a,
+			    struct o2test_aio_req *reqs, int nr)
+{
+	int ret;
+
+	ret = o2test_aio_queue(o2a, reqs, nr);
+	if (ret < 0)
+		return ret;
+
+	return o2test_aio_submit(o2a);
+}
+
+static int o2test_aio_rw(struct o2test_aio *o2a, int write, int fd,
+			 void *buf, size_t count, off_t offset)
+{
+	int ret;
+	struct o2test_aio_req req = {
+		.oq_write	= write,
+		.oq_fd		= fd,
+		.oq_buf		= buf,
+		.oq_count	= count,
+		.oq_offset	= offset,
+	};
+
+	ret = o2test_aio_prep(o2a, &req);
+	if (ret < 0)
+		return ret;
+
+	if (!o2a->o2a_defer_submit)
+		ret = o2test_aio_submit(o2a);
 
 	return ret;
 }
 
+int o2test_aio_pwrite(struct o2test_aio *o2a, int fd, void *buf, size_t count,
+		      off_t offset)
+{
+	return o2test_aio_rw(o2a, 1, fd, buf, count, offset);
+}
+
 int o2test_aio_pread(struct o2test_aio *o2a, int fd, void *buf, size_t count,
 		     off_t offset)
 {
-	int ret = 0;
-	struct iocb *iocbs[] = { o2a->o2a_iocbs[o2a->o2a_cr_event] };
+	return o2test_aio_rw(o2a, 0, fd, buf, count, offset);
+}
 
-	if (o2a->o2a_cr_event >= o2a->o2a_nr_events) {
-		fprintf(stderr, "current aio context didn't support %d "
-			"requests\n", o2a->o2a_cr_event);
-		return -1;
+/* Push every queued request down with one syscall */
+int o2test_aio_submit(struct o2test_aio *o2a)
+{
+	int ret = 0, submitted = 0, slot;
+
+	if (!o2a->o2a_nr_queued)
+		return 0;
+
+	if (o2a->o2a_backend == O2TEST_AIO_URING) {
+		/* on failure the unsubmitted requests are dropped already */
+		ret = o2test_uring_submit(o2a);
+		o2a->o2a_nr_queued = 0;
+		return ret;
 	}
 
-	io_prep_pread(o2a->o2a_iocbs[o2a->o2a_cr_event], fd, buf,
-		      count, offset);
-	ret = io_submit(o2a->o2a_ctx, 1, iocbs);
-	if (ret != 1) {
-		ret = errno;
-		fprintf(stderr, "error %s during %s\n", strerror(errno),
-			"io_submit");
-		ret = -1;
+	while (submitted < o2a->o2a_nr_queued) {
+		ret = io_submit(o2a->o2a_ctx, o2a->o2a_nr_queued - submitted,
+				o2a->o2a_queued + submitted);
+		if (ret <= 0) {
+			ret = ret ? -ret : EAGAIN;
+			fprintf(stderr, "error %s during %s\n", strerror(ret),
+				"io_submit");
+			/*
+			 * The iocb the kernel refused is dropped, the ones
+			 * behind it stay queued for the next submission.
+			 */
+			slot = o2a->o2a_queued[submitted] - o2a->o2a_iocbs[0];
+			o2a->o2a_free_slots[o2a->o2a_nr_free++] = slot;
+			o2a->o2a_cr_event--;
+			submitted++;
+			memmove(o2a->o2a_queued, o2a->o2a_queued + submitted,
+				sizeof(struct iocb *) *
+				(o2a->o2a_nr_queued - submitted));
+			o2a->o2a_nr_queued -= submitted;
+			return -1;
+		}
+
+		submitted += ret;
 	}
 
-	o2a->o2a_cr_event++;
+	o2a->o2a_nr_queued = 0;
 
-	return ret;
+	return submitted;
 }
 
-int o2test_aio_query(struct o2test_aio *o2a, long min_nr, long nr)
+static void o2test_aio_complete(struct o2test_aio *o2a, int slot, long res,
+				struct o2test_aio_res *ares)
 {
-	int ret = 0;
-	struct io_event ev;
+	if (ares) {
+		ares->or_req = o2a->o2a_reqs[slot];
+		ares->or_res = res;
+	}
 
-	ret = io_getevents(o2a->o2a_ctx, min_nr, nr, &ev, NULL);
+	o2a->o2a_free_slots[o2a->o2a_nr_free++] = slot;
+	o2a->o2a_cr_event--;
+}
+
+int o2test_aio_reap(struct o2test_aio *o2a, long min_nr, long nr,
+		    struct o2test_aio_res *res)
+{
+	int ret = 0, i, slot;
+	struct iocb *iocb;
+
+	ret = o2test_aio_submit(o2a);
+	if (ret < 0)
+		return ret;
+
+	if (nr > o2a->o2a_cr_event)
+		nr = o2a->o2a_cr_event;
+	if (min_nr > nr)
+		min_nr = nr;
+
+	if (o2a->o2a_backend == O2TEST_AIO_URING) {
+		ret = o2test_uring_reap(o2a, min_nr, nr, o2a->o2a_ev_data,
+					o2a->o2a_ev_res);
+		if (ret < 0)
+			return ret;
+
+		for (i = 0; i < ret; i++)
+			o2test_aio_complete(o2a, o2a->o2a_ev_data[i],
+					    o2a->o2a_ev_res[i],
+					    res ? &res[i] : NULL);
+
+		return ret;
+	}
+
+	ret = io_getevents(o2a->o2a_ctx, min_nr, nr, o2a->o2a_events, NULL);
 	if (ret < min_nr) {
-		ret = errno;
-		fprintf(stderr, "error %s during %s\n", strerror(errno),
+		ret = ret < 0 ? -ret : EINTR;
+		fprintf(stderr, "error %s during %s\n", strerror(ret),
 			"io_getevents");
-		ret = -1;
+		return -1;
+	}
+
+	for (i = 0; i < ret; i++) {
+		iocb = (struct iocb *)(unsigned long)o2a->o2a_events[i].obj;
+		slot = iocb - o2a->o2a_iocbs[0];
+		o2test_aio_complete(o2a, slot, (long)o2a->o2a_events[i].res,
+				    res ? &res[i] : NULL);
 	}
 
 	return ret;
 }
 
+int o2test_aio_query(struct o2test_aio *o2a, long min_nr, long nr)
+{
+	return o2test_aio_reap(o2a, min_nr, nr, NULL);
+}
+
+int o2test_aio_register_buffers(struct o2test_aio *o2a,
+				const struct iovec *iovs, int nr)
+{
+	if (o2a->o2a_backend != O2TEST_AIO_URING)
+		return 0;
+
+	return o2test_uring_register_buffers(o2a, iovs, nr);
+}
+
+int o2test_aio_register_files(struct o2test_aio *o2a, const int *fds, int nr)
+{
+	if (o2a->o2a_backend != O2TEST_AIO_URING)
+		return 0;
+
+	return o2test_uring_register_files(o2a, fds, nr);
+}
+
 int o2test_aio_destroy(struct o2test_aio *o2a)
 {
-	int ret = 0, i;
+	int ret = 0;
 
-	ret = io_destroy(o2a->o2a_ctx);
-	if (ret) {
-		ret = errno;
-		fprintf(stderr, "error %s during %s\n", strerror(errno),
-			"io_destroy");
-		ret = -1;
+	if (o2a->o2a_backend == O2TEST_AIO_URING)
+		ret = o2test_uring_destroy(o2a);
+	else {
+		ret = io_destroy(o2a->o2a_ctx);
+		if (ret) {
+			ret = -ret;
+			fprintf(stderr, "error %s during %s\n", strerror(ret),
+				"io_destroy");
+			ret = -1;
+		}
 	}
 
-	for (i = 0; i < o2a->o2a_nr_events; i++)
-		if (o2a->o2a_iocbs[i])
-			free(o2a->o2a_iocbs[i]);
-
-	if (o2a->o2a_iocbs)
-		free(o2a->o2a_iocbs);
+	o2test_aio_free(o2a);
 
 	o2a->o2a_ctx = NULL;
 	o2a->o2a_nr_events = 0;
 	o2a->o2a_cr_event = 0;
+	o2a->o2a_nr_queued = 0;
+	o2a->o2a_nr_free = 0;
 
 	return ret;
 }
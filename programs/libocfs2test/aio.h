@@ -19,20 +19,111 @@
 #define AIO_H
 
 #include <libaio.h>
+#include <sys/uio.h>
+
+/*
+ * Backends, chosen at o2test_aio_setup() time from the environment
+ * variable O2TEST_AIO_BACKEND ("libaio" or "io_uring"), libaio when unset.
+ */
+#define O2TEST_AIO_LIBAIO	0
+#define O2TEST_AIO_URING	1
+
+struct o2test_uring;
+
+/* One read or write of a batch, the cookie is handed back on completion */
+struct o2test_aio_req {
+	int oq_write;
+	int oq_fd;
+	void *oq_buf;
+	size_t oq_count;
+	off_t oq_offset;
+	void *oq_cookie;
+};
+
+/* Completion of a request, or_res is the bytes done or a -errno */
+struct o2test_aio_res {
+	struct o2test_aio_req or_req;
+	long or_res;
+};
 
 struct o2test_aio {
+	int o2a_backend;
 	struct io_context *o2a_ctx;
 	int o2a_nr_events;
+	/* requests queued or in flight, at most o2a_nr_events */
 	int o2a_cr_event;
 	struct iocb **o2a_iocbs;
+	/*
+	 * When set, o2test_aio_pwrite()/o2test_aio_pread() only queue the
+	 * request, all queued requests go down with one syscall on
+	 * o2test_aio_submit() or o2test_aio_query().
+	 */
+	int o2a_defer_submit;
+	int o2a_nr_queued;
+	/* iocbs queued for the next io_submit() */
+	struct iocb **o2a_queued;
+	/*
+	 * Each request owns a slot until it is reaped, the slot indexes
+	 * o2a_reqs and o2a_iocbs and travels with the request to the kernel.
+	 */
+	struct o2test_aio_req *o2a_reqs;
+	int *o2a_free_slots;
+	int o2a_nr_free;
+	struct io_event *o2a_events;
+	unsigned long long *o2a_ev_data;
+	long *o2a_ev_res;
+	struct o2test_uring *o2a_uring;
 };
 
+int o2test_aio_get_backend(const char *name);
+const char *o2test_aio_backend_name(struct o2test_aio *o2a);
+
 int o2test_aio_setup(struct o2test_aio *o2a, int nr_events);
+int o2test_aio_setup_backend(struct o2test_aio *o2a, int nr_events,
+			     int backend);
 int o2test_aio_pwrite(struct o2test_aio *o2a, int fd, void *buf, size_t count,
 		      off_t offset);
 int o2test_aio_pread(struct o2test_aio *o2a, int fd, void *buf, size_t count,
 		     off_t offset);
+int o2test_aio_submit(struct o2test_aio *o2a);
+
+/*
+ * Batch interface: o2test_aio_queue() takes up to o2test_aio_nr_free()
+ * requests without submitting them, o2test_aio_submit_batch() queues and
+ * submits with one syscall.  o2test_aio_reap() waits for min_nr and
+ * returns up to nr completions in res (which may be NULL), freeing their
+ * slots so that callers can keep a fixed queue depth busy.
+ */
+int o2test_aio_queue(struct o2test_aio *o2a, struct o2test_aio_req *reqs,
+		     int nr);
+int o2test_aio_submit_batch(struct o2test_aio *o2a,
+			    struct o2test_aio_req *reqs, int nr);
+int o2test_aio_reap(struct o2test_aio *o2a, long min_nr, long nr,
+		    struct o2test_aio_res *res);
+int o2test_aio_nr_free(struct o2test_aio *o2a);
 int o2test_aio_query(struct o2test_aio *o2a, long min_nr, long nr);
 int o2test_aio_destroy(struct o2test_aio *o2a);
 
+/*
+ * Buffers and files registered with io_uring skip the per-request page
+ * pinning and fget(), requests whose buffer lies in a registered one or
+ * whose fd is registered use them transparently.  No-ops for libaio.
+ */
+int o2test_aio_register_buffers(struct o2test_aio *o2a,
+				const struct iovec *iovs, int nr);
+int o2test_aio_register_files(struct o2test_aio *o2a, const int *fds, int nr);
+
+/* io_uring backend, see aio_uring.c */
+int o2test_uring_setup(struct o2test_aio *o2a, int nr_events);
+int o2test_uring_prep(struct o2test_aio *o2a, int write, int fd, void *buf,
+		      size_t count, off_t offset, unsigned long long user_data);
+int o2test_uring_submit(struct o2test_aio *o2a);
+int o2test_uring_reap(struct o2test_aio *o2a, long min_nr, long nr,
+		      unsigned long long *user_data, long *res);
+int o2test_uring_register_buffers(struct o2test_aio *o2a,
+				  const struct iovec *iovs, int nr);
+int o2test_uring_register_files(struct o2test_aio *o2a, const int *fds,
+				int nr);
+int o2test_uring_destroy(struct o2test_aio *o2a);
+
 #endif
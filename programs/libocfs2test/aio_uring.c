@@ -0,0 +1,559 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * aio_uring.c
+ *
+ * io_uring backend of the o2test_aio interface, talks to the kernel with
+ * the raw syscalls so that no liburing is needed.  Requires linux 5.6 or
+ * later for IORING_OP_READ/IORING_OP_WRITE.
+ *
+ * Copyright (C) 2010 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE 500
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "aio.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup		425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter		426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register		427
+#endif
+
+/* More sqes than this only cost memory, deeper queues go via CQSIZE */
+#define URING_MAX_SQ_ENTRIES		4096
+
+struct o2test_uring {
+	int ou_fd;
+
+	unsigned int *ou_sq_head;
+	unsigned int *ou_sq_tail;
+	unsigned int *ou_sq_mask;
+	unsigned int *ou_sq_entries;
+	struct io_uring_sqe *ou_sqes;
+	/* tail including the sqes not yet made visible to the kernel */
+	unsigned int ou_sq_local_tail;
+	unsigned int ou_to_submit;
+
+	unsigned int *ou_cq_head;
+	unsigned int *ou_cq_tail;
+	unsigned int *ou_cq_mask;
+	struct io_uring_cqe *ou_cqes;
+
+	void *ou_sq_ring;
+	size_t ou_sq_ring_size;
+	void *ou_cq_ring;
+	size_t ou_cq_ring_size;
+	size_t ou_sqes_size;
+
+	struct iovec *ou_bufs;
+	int ou_nr_bufs;
+	int *ou_files;
+	int ou_nr_files;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+				 unsigned int nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void uring_unmap(struct o2test_uring *ou)
+{
+	if (ou->ou_sqes && ou->ou_sqes != MAP_FAILED)
+		munmap(ou->ou_sqes, ou->ou_sqes_size);
+
+	if (ou->ou_cq_ring && ou->ou_cq_ring != MAP_FAILED &&
+	    ou->ou_cq_ring != ou->ou_sq_ring)
+		munmap(ou->ou_cq_ring, ou->ou_cq_ring_size);
+
+	if (ou->ou_sq_ring && ou->ou_sq_ring != MAP_FAILED)
+		munmap(ou->ou_sq_ring, ou->ou_sq_ring_size);
+}
+
+static int uring_map(struct o2test_uring *ou, struct io_uring_params *p)
+{
+	unsigned int i, *array;
+	char *sq, *cq;
+
+	ou->ou_sq_ring_size = p->sq_off.array + p->sq_entries *
+		sizeof(unsigned int);
+	ou->ou_cq_ring_size = p->cq_off.cqes + p->cq_entries *
+		sizeof(struct io_uring_cqe);
+	ou->ou_sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ou->ou_cq_ring_size > ou->ou_sq_ring_size)
+			ou->ou_sq_ring_size = ou->ou_cq_ring_size;
+		ou->ou_cq_ring_size = ou->ou_sq_ring_size;
+	}
+
+	ou->ou_sq_ring = mmap(NULL, ou->ou_sq_ring_size,
+			      PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, ou->ou_fd,
+			      IORING_OFF_SQ_RING);
+	if (ou->ou_sq_ring == MAP_FAILED)
+		return -errno;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		ou->ou_cq_ring = ou->ou_sq_ring;
+	else {
+		ou->ou_cq_ring = mmap(NULL, ou->ou_cq_ring_size,
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, ou->ou_fd,
+				      IORING_OFF_CQ_RING);
+		if (ou->ou_cq_ring == MAP_FAILED)
+			return -errno;
+	}
+
+	ou->ou_sqes = mmap(NULL, ou->ou_sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ou->ou_fd,
+			   IORING_OFF_SQES);
+	if (ou->ou_sqes == MAP_FAILED)
+		return -errno;
+
+	sq = ou->ou_sq_ring;
+	ou->ou_sq_head = (unsigned int *)(sq + p->sq_off.head);
+	ou->ou_sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+	ou->ou_sq_mask = (unsigned int *)(sq + p->sq_off.ring_mask);
+	ou->ou_sq_entries = (unsigned int *)(sq + p->sq_off.ring_entries);
+	ou->ou_sq_local_tail = *ou->ou_sq_tail;
+
+	/* sqes are always used in ring order, index array is the identity */
+	array = (unsigned int *)(sq + p->sq_off.array);
+	for (i = 0; i < p->sq_entries; i++)
+		array[i] = i;
+
+	cq = ou->ou_cq_ring;
+	ou->ou_cq_head = (unsigned int *)(cq + p->cq_off.head);
+	ou->ou_cq_tail = (unsigned int *)(cq + p->cq_off.tail);
+	ou->ou_cq_mask = (unsigned int *)(cq + p->cq_off.ring_mask);
+	ou->ou_cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+int o2test_uring_setup(struct o2test_aio *o2a, int nr_events)
+{
+	int ret;
+	unsigned int sq_entries;
+	struct io_uring_params p;
+	struct o2test_uring *ou;
+
+	ou = calloc(1, sizeof(*ou));
+	if (!ou) {
+		fprintf(stderr, "error %s during %s\n", strerror(ENOMEM),
+			"malloc");
+		return -1;
+	}
+
+	sq_entries = nr_events;
+	if (sq_entries > URING_MAX_SQ_ENTRIES)
+		sq_entries = URING_MAX_SQ_ENTRIES;
+
+	/*
+	 * Every request in flight needs room in the completion ring, it is
+	 * twice the submission ring by default.
+	 */
+	memset(&p, 0, sizeof(p));
+	if (nr_events > 2 * sq_entries) {
+		p.flags |= IORING_SETUP_CQSIZE;
+		p.cq_entries = nr_events;
+	}
+
+	ou->ou_fd = sys_io_uring_setup(sq_entries, &p);
+	if (ou->ou_fd < 0) {
+		ret = errno;
+		fprintf(stderr, "error %s during %s\n", strerror(ret),
+			"io_uring_setup");
+		free(ou);
+		return -1;
+	}
+
+	ret = uring_map(ou, &p);
+	if (ret) {
+		fprintf(stderr, "error %s during %s\n", strerror(-ret),
+			"io_uring mmap");
+		uring_unmap(ou);
+		close(ou->ou_fd);
+		free(ou);
+		return -1;
+	}
+
+	o2a->o2a_uring = ou;
+
+	return 0;
+}
+
+static int uring_find_buf(struct o2test_uring *ou, void *buf, size_t count)
+{
+	int i;
+	char *base;
+
+	for (i = 0; i < ou->ou_nr_bufs; i++) {
+		base = ou->ou_bufs[i].iov_base;
+		if ((char *)buf >= base &&
+		    (char *)buf + count <= base + ou->ou_bufs[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static int uring_find_file(struct o2test_uring *ou, int fd)
+{
+	int i;
+
+	for (i = 0; i < ou->ou_nr_files; i++)
+		if (ou->ou_files[i] == fd)
+			return i;
+
+	return -1;
+}
+
+int o2test_uring_prep(struct o2test_aio *o2a, int write, int fd, void *buf,
+		      size_t count, off_t offset, unsigned long long user_data)
+{
+	int idx;
+	struct o2test_uring *ou = o2a->o2a_uring;
+	struct io_uring_sqe *sqe;
+
+	if (count > UINT_MAX) {
+		fprintf(stderr, "io_uring request of %lu bytes is too "
+			"large\n", (unsigned long)count);
+		return -1;
+	}
+
+	/* ring is full, push what is queued before taking another slot */
+	if (ou->ou_sq_local_tail -
+	    __atomic_load_n(ou->ou_sq_head, __ATOMIC_ACQUIRE) >=
+	    *ou->ou_sq_entries) {
+		if (o2test_uring_submit(o2a) < 0)
+			return -1;
+	}
+
+	sqe = &ou->ou_sqes[ou->ou_sq_local_tail & *ou->ou_sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = count;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+
+	idx = uring_find_buf(ou, buf, count);
+	if (idx >= 0) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED :
+			IORING_OP_READ_FIXED;
+		sqe->buf_index = idx;
+	} else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	idx = uring_find_file(ou, fd);
+	if (idx >= 0) {
+		sqe->fd = idx;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+
+	ou->ou_sq_local_tail++;
+	ou->ou_to_submit++;
+
+	return 0;
+}
+
+/*
+ * The sqes the kernel did not consume are taken back off the ring and
+ * their slots freed, as no completion will ever come for them.
+ */
+static void uring_drop_unsubmitted(struct o2test_aio *o2a)
+{
+	struct o2test_uring *ou = o2a->o2a_uring;
+	unsigned int head, slot;
+
+	head = __atomic_load_n(ou->ou_sq_head, __ATOMIC_ACQUIRE);
+
+	while (ou->ou_sq_local_tail != head) {
+		ou->ou_sq_local_tail--;
+		slot = ou->ou_sqes[ou->ou_sq_local_tail &
+				   *ou->ou_sq_mask].user_data;
+		o2a->o2a_free_slots[o2a->o2a_nr_free++] = slot;
+		o2a->o2a_cr_event--;
+	}
+
+	__atomic_store_n(ou->ou_sq_tail, ou->ou_sq_local_tail,
+			 __ATOMIC_RELEASE);
+	ou->ou_to_submit = 0;
+}
+
+int o2test_uring_submit(struct o2test_aio *o2a)
+{
+	int ret, submitted = 0;
+	struct o2test_uring *ou = o2a->o2a_uring;
+
+	if (!ou->ou_to_submit)
+		return 0;
+
+	/* publish the sqes before the kernel gets to see the new tail */
+	__atomic_store_n(ou->ou_sq_tail, ou->ou_sq_local_tail,
+			 __ATOMIC_RELEASE);
+
+	while (ou->ou_to_submit) {
+		ret = sys_io_uring_enter(ou->ou_fd, ou->ou_to_submit, 0, 0);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			ret = ret ? errno : EAGAIN;
+			fprintf(stderr, "error %s during %s\n", strerror(ret),
+				"io_uring_enter");
+			uring_drop_unsubmitted(o2a);
+			return -1;
+		}
+
+		ou->ou_to_submit -= ret;
+		submitted += ret;
+	}
+
+	return submitted;
+}
+
+/*
+ * Wait for at least min_nr completions and reap up to nr of them, their
+ * user_data and results go to the arrays when those are given.
+ */
+int o2test_uring_reap(struct o2test_aio *o2a, long min_nr, long nr,
+		      unsigned long long *user_data, long *res)
+{
+	int ret;
+	long got = 0;
+	unsigned int head, tail;
+	struct o2test_uring *ou = o2a->o2a_uring;
+	struct io_uring_cqe *cqe;
+
+	while (1) {
+		head = *ou->ou_cq_head;
+		tail = __atomic_load_n(ou->ou_cq_tail, __ATOMIC_ACQUIRE);
+
+		while (got < nr && head != tail) {
+			cqe = &ou->ou_cqes[head & *ou->ou_cq_mask];
+			if (user_data)
+				user_data[got] = cqe->user_data;
+			if (res)
+				res[got] = cqe->res;
+			got++;
+			head++;
+		}
+
+		/* hand the cqes back only once they have been read */
+		__atomic_store_n(ou->ou_cq_head, head, __ATOMIC_RELEASE);
+
+		if (got >= min_nr)
+			break;
+
+		ret = sys_io_uring_enter(ou->ou_fd, 0, min_nr - got,
+					 IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR) {
+			ret = errno;
+			fprintf(stderr, "error %s during %s\n", strerror(ret),
+				"io_uring_enter");
+			return -1;
+		}
+	}
+
+	return got;
+}
+
+int o2test_uring_register_buffers(struct o2test_aio *o2a,
+				  const struct iovec *iovs, int nr)
+{
+	int ret;
+	struct o2test_uring *ou = o2a->o2a_uring;
+
+	if (ou->ou_nr_bufs) {
+		sys_io_uring_register(ou->ou_fd, IORING_UNREGISTER_BUFFERS,
+				      NULL, 0);
+		free(ou->ou_bufs);
+		ou->ou_bufs = NULL;
+		ou->ou_nr_bufs = 0;
+	}
+
+	ou->ou_bufs = malloc(sizeof(struct iovec) * nr);
+	if (!ou->ou_bufs) {
+		fprintf(stderr, "error %s during %s\n", strerror(ENOMEM),
+			"malloc");
+		return -1;
+	}
+	memcpy(ou->ou_bufs, iovs, sizeof(struct iovec) * nr);
+
+	ret = sys_io_uring_register(ou->ou_fd, IORING_REGISTER_BUFFERS,
+				    iovs, nr);
+	if (ret < 0) {
+		ret = errno;
+		fprintf(stderr, "error %s during %s\n", strerror(ret),
+			"IORING_REGISTER_BUFFERS");
+		free(ou->ou_bufs);
+		ou->ou_bufs = NULL;
+		return -1;
+	}
+
+	ou->ou_nr_bufs = nr;
+
+	return 0;
+}
+
+int o2test_uring_register_files(struct o2test_aio *o2a, const int *fds,
+				int nr)
+{
+	int ret;
+	struct o2test_uring *ou = o2a->o2a_uring;
+
+	if (ou->ou_nr_files) {
+		sys_io_uring_register(ou->ou_fd, IORING_UNREGISTER_FILES,
+				      NULL, 0);
+		free(ou->ou_files);
+		ou->ou_files = NULL;
+		ou->ou_nr_files = 0;
+	}
+
+	ou->ou_files = malloc(sizeof(int) * nr);
+	if (!ou->ou_files) {
+		fprintf(stderr, "error %s during %s\n", strerror(ENOMEM),
+			"malloc");
+		return -1;
+	}
+	memcpy(ou->ou_files, fds, sizeof(int) * nr);
+
+	ret = sys_io_uring_register(ou->ou_fd, IORING_REGISTER_FILES, fds, nr);
+	if (ret < 0) {
+		ret = errno;
+		fprintf(stderr, "error %s during %s\n", strerror(ret),
+			"IORING_REGISTER_FILES");
+		free(ou->ou_files);
+		ou->ou_files = NULL;
+		return -1;
+	}
+
+	ou->ou_nr_files = nr;
+
+	return 0;
+}
+
+int o2test_uring_destroy(struct o2test_aio *o2a)
+{
+	int ret = 0;
+	struct o2test_uring *ou = o2a->o2a_uring;
+
+	if (!ou)
+		return 0;
+
+	uring_unmap(ou);
+
+	/* closing the ring drops the registered buffers and files too */
+	if (close(ou->ou_fd)) {
+		ret = errno;
+		fprintf(stderr, "error %s during %s\n", strerror(ret),
+			"io_uring close");
+		ret = -1;
+	}
+
+	if (ou->ou_bufs)
+		free(ou->ou_bufs);
+	if (ou->ou_files)
+		free(ou->ou_files);
+
+	free(ou);
+	o2a->o2a_uring = NULL;
+
+	return ret;
+}
+
+#else
+
+static int uring_unsupported(void)
+{
+	fprintf(stderr, "io_uring backend was not built in, linux/io_uring.h "
+		"was missing at configure time\n");
+
+	return -1;
+}
+
+int o2test_uring_setup(struct o2test_aio *o2a, int nr_events)
+{
+	return uring_unsupported();
+}
+
+int o2test_uring_prep(struct o2test_aio *o2a, int write, int fd, void *buf,
+		      size_t count, off_t offset, unsigned long long user_data)
+{
+	return uring_unsupported();
+}
+
+int o2test_uring_submit(struct o2test_aio *o2a)
+{
+	return uring_unsupported();
+}
+
+int o2test_uring_reap(struct o2test_aio *o2a, long min_nr, long nr,
+		      unsigned long long *user_data, long *res)
+{
+	return uring_unsupported();
+}
+
+int o2test_uring_register_buffers(struct o2test_aio *o2a,
+				  const struct iovec *iovs, int nr)
+{
+	return uring_unsupported();
+}
+
+int o2test_uring_register_files(struct o2test_aio *o2a, const int *fds,
+				int nr)
+{
+	return uring_unsupported();
+}
+
+int o2test_uring_destroy(struct o2test_aio *o2a)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,344 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * crc32.c
+ *
+ * Provide the crc32 checksum shared by pattern verifiers of ocfs2-tests,
+ * with the fastest implementation chosen at runtime.
+ *
+ * Copyright (C) 2010 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_acle.h>
+#endif
+
+#include "crc32.h"
+
+#define CRC32_POLY_LE		0xedb88320
+
+static uint32_t crc32_table[8][256];
+
+static int crc32_always(void)
+{
+	return 1;
+}
+
+static uint32_t crc32_bytewise(uint32_t crc, const char *p, size_t len)
+{
+	const unsigned char *b = (const unsigned char *)p;
+
+	while (len--)
+		crc = crc32_table[0][(crc ^ *b++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+/*
+ * Slicing-by-8, data is loaded byte by byte so that the result is the
+ * same on either endianness, compilers merge the loads on little-endian.
+ */
+static uint32_t crc32_slice8(uint32_t crc, const char *p, size_t len)
+{
+	const unsigned char *b = (const unsigned char *)p;
+	uint32_t lo, hi;
+
+	while (len && ((uintptr_t)b & 7)) {
+		crc = crc32_table[0][(crc ^ *b++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		lo = crc ^ ((uint32_t)b[0] | (uint32_t)b[1] << 8 |
+			    (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24);
+		hi = (uint32_t)b[4] | (uint32_t)b[5] << 8 |
+		     (uint32_t)b[6] << 16 | (uint32_t)b[7] << 24;
+
+		crc = crc32_table[7][lo & 0xff] ^
+		      crc32_table[6][(lo >> 8) & 0xff] ^
+		      crc32_table[5][(lo >> 16) & 0xff] ^
+		      crc32_table[4][lo >> 24] ^
+		      crc32_table[3][hi & 0xff] ^
+		      crc32_table[2][(hi >> 8) & 0xff] ^
+		      crc32_table[1][(hi >> 16) & 0xff] ^
+		      crc32_table[0][hi >> 24];
+
+		b += 8;
+		len -= 8;
+	}
+
+	return crc32_bytewise(crc, (const char *)b, len);
+}
+
+#if defined(__x86_64__)
+/*
+ * Folding with carry-less multiplication, see Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * The constants are those of the bit-reflected crc32 polynomial.
+ *
+ * Note the SSE4.2 crc32 instruction implements crc32c (Castagnoli),
+ * which is not the polynomial our on-disk patterns and logs carry.
+ */
+static int crc32_pclmul_supported(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("pclmul") &&
+	       __builtin_cpu_supports("sse4.1");
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const unsigned char *b,
+				  size_t len)
+{
+	static const uint64_t k1k2[] __attribute__ ((aligned(16))) =
+		{ 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t k3k4[] __attribute__ ((aligned(16))) =
+		{ 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t k5k0[] __attribute__ ((aligned(16))) =
+		{ 0x0163cd6124, 0x0000000000 };
+	static const uint64_t poly[] __attribute__ ((aligned(16))) =
+		{ 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	/* len is a multiple of 16, no less than 64 */
+	x1 = _mm_loadu_si128((const __m128i *)(b + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(b + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(b + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(b + 0x30));
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+
+	b += 64;
+	len -= 64;
+
+	/* fold 4 x 128 bits in parallel */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *)(b + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(b + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(b + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(b + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		b += 64;
+		len -= 64;
+	}
+
+	/* fold into 128 bits */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* single folds of the remaining 128 bits blocks */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)b);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		b += 16;
+		len -= 16;
+	}
+
+	/* fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const char *p, size_t len)
+{
+	size_t folded = len & ~(size_t)15;
+
+	if (folded >= 64) {
+		crc = crc32_pclmul_fold(crc, (const unsigned char *)p, folded);
+		p += folded;
+		len -= folded;
+	}
+
+	return crc32_slice8(crc, p, len);
+}
+#endif
+
+#if defined(__aarch64__)
+static int crc32_armv8_supported(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+
+__attribute__((target("arch=armv8-a+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const char *p, size_t len)
+{
+	const unsigned char *b = (const unsigned char *)p;
+	uint64_t v;
+
+	while (len && ((uintptr_t)b & 7)) {
+		crc = __crc32b(crc, *b++);
+		len--;
+	}
+
+	while (len >= 8) {
+		memcpy(&v, b, sizeof(v));
+		crc = __crc32d(crc, v);
+		b += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32b(crc, *b++);
+
+	return crc;
+}
+#endif
+
+/* Ordered from the fastest to the slowest */
+static const struct crc32_engine crc32_engines[] = {
+#if defined(__x86_64__)
+	{ "pclmul", crc32_pclmul, crc32_pclmul_supported },
+#endif
+#if defined(__aarch64__)
+	{ "armv8", crc32_armv8, crc32_armv8_supported },
+#endif
+	{ "slice8", crc32_slice8, crc32_always },
+	{ "bytewise", crc32_bytewise, crc32_always },
+};
+
+#define CRC32_NR_ENGINES	(sizeof(crc32_engines) / sizeof(crc32_engines[0]))
+
+static const struct crc32_engine *crc32_cur_engine;
+
+__attribute__((constructor))
+static void crc32_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ ((c & 1) ? CRC32_POLY_LE : 0);
+		crc32_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++) {
+		c = crc32_table[0][i];
+		for (j = 1; j < 8; j++) {
+			c = crc32_table[0][c & 0xff] ^ (c >> 8);
+			crc32_table[j][i] = c;
+		}
+	}
+
+	for (i = 0; i < CRC32_NR_ENGINES; i++) {
+		if (crc32_engines[i].ce_supported()) {
+			crc32_cur_engine = &crc32_engines[i];
+			break;
+		}
+	}
+}
+
+uint32_t crc32_checksum(uint32_t crc, const char *p, size_t len)
+{
+	return crc32_cur_engine->ce_fn(crc, p, len);
+}
+
+int crc32_get_engines(const struct crc32_engine **engines)
+{
+	*engines = crc32_engines;
+
+	return CRC32_NR_ENGINES;
+}
+
+const char *crc32_engine_name(void)
+{
+	return crc32_cur_engine->ce_name;
+}
+
+int crc32_select_engine(const char *name)
+{
+	int i;
+
+	for (i = 0; i < CRC32_NR_ENGINES; i++) {
+		if (strcmp(crc32_engines[i].ce_name, name))
+			continue;
+
+		if (!crc32_engines[i].ce_supported()) {
+			fprintf(stderr, "crc32 engine %s is not supported "
+				"by this cpu\n", name);
+			return -1;
+		}
+
+		crc32_cur_engine = &crc32_engines[i];
+		return 0;
+	}
+
+	fprintf(stderr, "unknown crc32 engine %s\n", name);
+
+	return -1;
+}
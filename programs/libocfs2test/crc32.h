@@ -0,0 +1,45 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * crc32.h
+ *
+ * Copyright (C) 2010 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+typedef uint32_t (*crc32_fn)(uint32_t crc, const char *p, size_t len);
+
+struct crc32_engine {
+	const char *ce_name;
+	crc32_fn ce_fn;
+	int (*ce_supported)(void);
+};
+
+/*
+ * Little-endian (reflected 0xedb88320) crc32 as the kernel's crc32_le(),
+ * no pre/post inversion is done here, callers pass ~0 as the seed.
+ *
+ * The fastest engine supported by the running cpu is picked at startup,
+ * every engine yields the same result for the same input.
+ */
+uint32_t crc32_checksum(uint32_t crc, const char *p, size_t len);
+
+int crc32_get_engines(const struct crc32_engine **engines);
+const char *crc32_engine_name(void);
+int crc32_select_engine(const char *name);
+
+#endif
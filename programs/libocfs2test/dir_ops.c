@@ -23,29 +23,13 @@
 #include "dir_ops.h"
 #include "file_ops.h"
 
-extern unsigned long num_dirents;
-extern struct my_dirent *dirents;
-
-int is_dot_entry(struct my_dirent *dirent)
-{
-	if (dirent->name_len == 1 && dirent->name[0] == '.')
-		return 1;
-	if (dirent->name_len == 2 && dirent->name[0] == '.'
-	    && dirent->name[1] == '.')
-		return 1;
-
-	return 0;
-}
-
 int unlink_dirent(char *dirname, struct my_dirent *dirent)
 {
 	char path[PATH_MAX];
 
 	sprintf(path, "%s/%s", dirname, dirent->name);
 
-	memcpy((void *)dirent, (void *)&dirents[num_dirents - 1],
-	       sizeof(struct my_dirent));
-	num_dirents--;
+	del_my_dirent(dirent);
 
 	return unlink(path);
 }
@@ -53,23 +37,11 @@ int unlink_dirent(char *dirname, struct my_dirent *dirent)
 int create_and_prep_dir(char *dirname)
 {
 	int ret;
-	struct my_dirent *dirent;
 
-	dirents = (struct my_dirent *)malloc(sizeof(struct my_dirent) *
-					     MAX_DIRENTS);
-	memset(dirents, 0, sizeof(struct my_dirent) * MAX_DIRENTS);
-
-	dirent = &dirents[0];
-	dirent->type = S_IFDIR >> S_SHIFT;
-	dirent->name_len = 1;
-	strcpy(dirent->name, ".");
-
-	dirent = &dirents[1];
-	dirent->type = S_IFDIR >> S_SHIFT;
-	dirent->name_len = 2;
-	strcpy(dirent->name, "..");
+	ret = init_my_dirents();
+	if (ret)
+		return ret;
 
-	num_dirents = 2;
 	ret = mkdir(dirname, FILE_MODE);
 	if (ret) {
 		ret = errno;
@@ -112,33 +84,11 @@ int destroy_dir(char *dirname)
 		return ret;
 	}
 
-	num_dirents = 0;
-
-	if (dirents)
-		free(dirents);
+	free_my_dirents();
 
 	return 0;
 }
 
-struct my_dirent *find_my_dirent(char *name)
-{
-	int i, len;
-	struct my_dirent *my_dirent;
-
-	len = strlen(name);
-
-	for (i = 0; i < num_dirents; i++) {
-
-		my_dirent = &dirents[i];
-
-		if (my_dirent->name_len == len &&
-		    strcmp(my_dirent->name, name) == 0)
-			return my_dirent;
-	}
-
-	return NULL;
-}
-
 int unlink_dirent_nam(char *dirname, char *name)
 {
 	struct my_dirent *dirent;
@@ -154,13 +104,9 @@ int create_file(char *filename, char *dirname)
 	struct my_dirent *dirent;
 	char path[PATH_MAX];
 
-	dirent = &dirents[num_dirents];
-	num_dirents++;
-
-	dirent->type = S_IFREG >> S_SHIFT;
-	dirent->name_len = strlen(filename);
-	dirent->seen = 0;
-	strcpy(dirent->name, filename);
+	ret = add_my_dirent(filename, S_IFREG >> S_SHIFT, &dirent);
+	if (ret)
+		return ret;
 
 	sprintf(path, "%s/%s", dirname, dirent->name);
 
@@ -185,7 +131,8 @@ int create_files(char *prefix, unsigned long num, char *dirname)
 
 	for (i = 0; i < num; i++) {
 		if (!prefix) {
-			get_rand_nam(dirent_nam, 3, OCFS2_MAX_FILENAME_LEN);
+			get_rand_nam(dirent_nam, 3,
+				     OCFS2_MAX_FILENAME_LEN - 1);
 			ret = create_file(dirent_nam, dirname);
 		} else {
 			snprintf(path, PATH_MAX, "%s%011d", prefix, i);
@@ -375,7 +322,6 @@ int traverse_and_destroy(char *name)
 	int ret;
 	struct dirent *dirent;
 	char fullpath[PATH_MAX];
-	struct stat stat_info;
 
 	dir = opendir(name);
 	if (dir < 0) {
@@ -390,14 +336,6 @@ int traverse_and_destroy(char *name)
 		if (dirent->d_type == S_IFREG >> S_SHIFT) {
 			snprintf(fullpath, PATH_MAX, "%s/%s", name,
 				 dirent->d_name);
-			ret = stat(fullpath, &stat_info);
-			if (ret) {
-				ret = errno;
-				fprintf(stderr, "stat failure %d: %s\n", ret,
-					strerror(ret));
-				return ret;
-			}
-
 			ret = unlink(fullpath);
 			if (ret) {
 				ret = errno;
@@ -416,15 +354,6 @@ int traverse_and_destroy(char *name)
 					snprintf(fullpath, PATH_MAX, "%s/%s",
 						 name, dirent->d_name);
 
-					ret = stat(fullpath, &stat_info);
-					if (ret) {
-						ret = errno;
-						fprintf(stderr, "stat failure"
-							" %d: %s\n", ret,
-							strerror(ret));
-						return ret;
-					}
-
 					if (!is_dir_empty(fullpath))
 						traverse_and_destroy(fullpath);
 					else {
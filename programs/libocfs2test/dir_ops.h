@@ -41,21 +41,17 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
-#define OCFS2_MAX_FILENAME_LEN          255
-#define MAX_DIRENTS                     40000
+#include "dir_tree.h"
+#include "dirents.h"
 
 #define FILE_BUFFERED_RW_FLAGS  (O_CREAT|O_RDWR|O_TRUNC)
 #define FILE_MODE               (S_IRUSR|S_IWUSR|S_IXUSR|S_IROTH|\
 				 S_IWOTH|S_IXOTH|S_IRGRP|S_IWGRP|S_IXGRP)
 
-struct my_dirent {
-	unsigned int    type;
-	unsigned int    name_len;
-	unsigned int    seen;
-	char            name[OCFS2_MAX_FILENAME_LEN];
-};
-
 union semun {
 	int val;                    /* value for SETVAL */
 	struct semid_ds *buf;       /* buffer for IPC_STAT, IPC_SET */
@@ -63,12 +59,10 @@ union semun {
 	struct seminfo *__buf;      /* buffer for IPC_INFO */
 };
 
-int is_dot_entry(struct my_dirent *dirent);
 int unlink_dirent(char *dirname, struct my_dirent *dirent);
 int unlink_dirent_nam(char *dirname, char *name);
 int create_and_prep_dir(char *dirname);
 int destroy_dir(char *dirname);
-struct my_dirent *find_my_dirent(char *name);
 int create_file(char *filename, char *dirname);
 int create_files(char *prefix, unsigned long num, char *dirname);
 int is_dir_empty(char *name);
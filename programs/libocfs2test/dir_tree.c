@@ -0,0 +1,586 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * dir_tree.c
+ *
+ * Parallel, fd-relative dir tree builder and destroyer for ocfs2-tests
+ *
+ * Copyright (C) 2008 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+#include "dir_ops.h"
+#include "file_ops.h"
+
+/*
+ * Parallel tree builder and destroyer.
+ *
+ * Each directory is one task, queued on the deque of the worker which
+ * found it.  Workers pop their own deque from the tail (depth first) and
+ * steal from the head of others when theirs runs dry.  Entries inside a
+ * directory are created or unlinked relative to its fd, so the path is
+ * only built once per directory.
+ */
+struct dt_node {
+	char *dn_path;
+	struct dt_node *dn_parent;
+	unsigned long dn_level;
+	volatile long dn_pending;
+};
+
+struct dt_task {
+	struct dt_task *dt_prev;
+	struct dt_task *dt_next;
+	struct dt_node *dt_node;
+};
+
+struct dt_queue {
+	pthread_mutex_t q_lock;
+	struct dt_task *q_head;
+	struct dt_task *q_tail;
+};
+
+struct dt_pool {
+	int p_nr_workers;
+	struct dt_queue *p_queues;
+	volatile long p_pending;
+	volatile int p_error;
+	int (*p_work)(struct dt_pool *pool, int worker, struct dt_task *task);
+
+	pthread_mutex_t p_stats_lock;
+	struct dir_tree_stats *p_stats;
+
+	unsigned long p_entries;
+	unsigned long p_depth;
+	int p_is_random;
+};
+
+struct dt_worker {
+	pthread_t w_thread;
+	struct dt_pool *w_pool;
+	int w_id;
+};
+
+static double dt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void dt_account(struct dt_pool *pool, unsigned long level,
+		       unsigned long ops, double start, double end)
+{
+	struct dir_tree_level_stats *ls;
+
+	if (!pool->p_stats || !ops)
+		return;
+
+	if (level >= DIR_TREE_MAX_LEVELS)
+		level = DIR_TREE_MAX_LEVELS - 1;
+
+	pthread_mutex_lock(&pool->p_stats_lock);
+
+	ls = &pool->p_stats->ds_level[level];
+	if (!ls->dl_ops || start < ls->dl_start)
+		ls->dl_start = start;
+	if (end > ls->dl_end)
+		ls->dl_end = end;
+	ls->dl_ops += ops;
+
+	if (level + 1 > pool->p_stats->ds_levels)
+		pool->p_stats->ds_levels = level + 1;
+
+	pthread_mutex_unlock(&pool->p_stats_lock);
+}
+
+static struct dt_node *dt_new_node(const char *parent_path, const char *name,
+				   struct dt_node *parent, unsigned long level)
+{
+	struct dt_node *node;
+	size_t len;
+
+	node = (struct dt_node *)calloc(1, sizeof(*node));
+	if (!node)
+		return NULL;
+
+	if (parent_path) {
+		len = strlen(parent_path) + strlen(name) + 2;
+		node->dn_path = (char *)malloc(len);
+		if (node->dn_path)
+			snprintf(node->dn_path, len, "%s/%s", parent_path,
+				 name);
+	} else
+		node->dn_path = strdup(name);
+
+	if (!node->dn_path) {
+		free(node);
+		return NULL;
+	}
+
+	node->dn_parent = parent;
+	node->dn_level = level;
+	node->dn_pending = 1;
+
+	return node;
+}
+
+static void dt_free_node(struct dt_node *node)
+{
+	free(node->dn_path);
+	free(node);
+}
+
+static int dt_push(struct dt_pool *pool, int worker, struct dt_node *node)
+{
+	struct dt_queue *q = &pool->p_queues[worker];
+	struct dt_task *task;
+
+	task = (struct dt_task *)calloc(1, sizeof(*task));
+	if (!task)
+		return -ENOMEM;
+
+	task->dt_node = node;
+
+	__sync_add_and_fetch(&pool->p_pending, 1);
+
+	pthread_mutex_lock(&q->q_lock);
+	task->dt_prev = q->q_tail;
+	if (q->q_tail)
+		q->q_tail->dt_next = task;
+	else
+		q->q_head = task;
+	q->q_tail = task;
+	pthread_mutex_unlock(&q->q_lock);
+
+	return 0;
+}
+
+static struct dt_task *dt_pop(struct dt_queue *q, int steal)
+{
+	struct dt_task *task;
+
+	pthread_mutex_lock(&q->q_lock);
+
+	if (steal) {
+		task = q->q_head;
+		if (task) {
+			q->q_head = task->dt_next;
+			if (q->q_head)
+				q->q_head->dt_prev = NULL;
+			else
+				q->q_tail = NULL;
+		}
+	} else {
+		task = q->q_tail;
+		if (task) {
+			q->q_tail = task->dt_prev;
+			if (q->q_tail)
+				q->q_tail->dt_next = NULL;
+			else
+				q->q_head = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&q->q_lock);
+
+	return task;
+}
+
+static void *dt_worker_loop(void *arg)
+{
+	struct dt_worker *w = arg;
+	struct dt_pool *pool = w->w_pool;
+	struct dt_task *task;
+	int i, ret;
+
+	while (pool->p_pending) {
+		task = dt_pop(&pool->p_queues[w->w_id], 0);
+		for (i = 1; !task && i < pool->p_nr_workers; i++)
+			task = dt_pop(&pool->p_queues[(w->w_id + i) %
+						      pool->p_nr_workers], 1);
+
+		if (!task) {
+			sched_yield();
+			continue;
+		}
+
+		ret = pool->p_work(pool, w->w_id, task);
+		if (ret)
+			pool->p_error = ret;
+
+		free(task);
+		__sync_sub_and_fetch(&pool->p_pending, 1);
+	}
+
+	return NULL;
+}
+
+static int dt_run_pool(struct dt_pool *pool, struct dt_node *root,
+		       int nr_threads)
+{
+	struct dt_worker *workers;
+	int i, ret;
+
+	if (nr_threads < 1)
+		nr_threads = 1;
+
+	pool->p_nr_workers = nr_threads;
+	pool->p_pending = 0;
+	pool->p_error = 0;
+	pthread_mutex_init(&pool->p_stats_lock, NULL);
+
+	pool->p_queues = (struct dt_queue *)calloc(nr_threads,
+						   sizeof(struct dt_queue));
+	workers = (struct dt_worker *)calloc(nr_threads,
+					     sizeof(struct dt_worker));
+	if (!pool->p_queues || !workers) {
+		fprintf(stderr, "failed to allocate %d tree workers\n",
+			nr_threads);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_mutex_init(&pool->p_queues[i].q_lock, NULL);
+
+	ret = dt_push(pool, 0, root);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].w_pool = pool;
+		workers[i].w_id = i;
+		if (!i)
+			continue;
+
+		ret = pthread_create(&workers[i].w_thread, NULL,
+				     dt_worker_loop, &workers[i]);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed %d: %s\n", ret,
+				strerror(ret));
+			workers[i].w_thread = 0;
+		}
+	}
+
+	dt_worker_loop(&workers[0]);
+
+	for (i = 1; i < nr_threads; i++)
+		if (workers[i].w_thread)
+			pthread_join(workers[i].w_thread, NULL);
+
+	ret = pool->p_error;
+
+out:
+	if (workers)
+		free(workers);
+	if (pool->p_queues)
+		free(pool->p_queues);
+
+	return ret;
+}
+
+/* Names entries as build_dir_tree() does, random ones may not fit */
+static int dt_entry_name(struct dt_pool *pool, char *name, size_t size,
+			 const char *prefix, unsigned long layer,
+			 unsigned long i)
+{
+	char dirent[OCFS2_MAX_FILENAME_LEN];
+	int len;
+
+	if (pool->p_is_random) {
+		get_rand_nam(dirent, 1, OCFS2_MAX_FILENAME_LEN - 20);
+		prefix = dirent;
+	}
+
+	len = snprintf(name, size, "%s%ld%ld", prefix, layer, i);
+	if (len < 0 || len >= size) {
+		fprintf(stderr, "entry name %s%ld%ld is too long\n", prefix,
+			layer, i);
+		return ENAMETOOLONG;
+	}
+
+	return 0;
+}
+
+static int dt_build_dir(struct dt_pool *pool, int worker, struct dt_task *task)
+{
+	struct dt_node *node = task->dt_node, *child;
+	unsigned long i, dir_dirents, file_dirents, ops = 0;
+	unsigned long layer = pool->p_depth - node->dn_level;
+	char name[OCFS2_MAX_FILENAME_LEN + 1];
+	int dfd = -1, fd, ret = 0;
+	double start = dt_now();
+
+	if (pool->p_error || !layer)
+		goto out;
+
+	dfd = open(node->dn_path, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0) {
+		ret = errno;
+		fprintf(stderr, "open dir %s failure %d: %s\n", node->dn_path,
+			ret, strerror(ret));
+		goto out;
+	}
+
+	if (pool->p_is_random)
+		dir_dirents = get_rand(1, pool->p_entries - 1);
+	else
+		dir_dirents = pool->p_entries / 2;
+
+	file_dirents = pool->p_entries - dir_dirents;
+
+	for (i = 0; i < file_dirents; i++) {
+		ret = dt_entry_name(pool, name, sizeof(name), "F", layer, i);
+		if (ret)
+			goto out;
+
+		fd = openat(dfd, name, FILE_BUFFERED_RW_FLAGS, FILE_MODE);
+		if (fd < 0) {
+			ret = errno;
+			fprintf(stderr, "create file failure %d: %s,"
+				"filename = %s/%s\n", ret, strerror(ret),
+				node->dn_path, name);
+			goto out;
+		}
+
+		close(fd);
+		ops++;
+	}
+
+	for (i = 0; i < dir_dirents; i++) {
+		ret = dt_entry_name(pool, name, sizeof(name), "D", layer, i);
+		if (ret)
+			goto out;
+
+		ret = mkdirat(dfd, name, FILE_MODE);
+		if (ret < 0) {
+			ret = errno;
+			fprintf(stderr, "mkdir failure %d: %s, dirname = "
+				"%s/%s\n", ret, strerror(ret), node->dn_path,
+				name);
+			goto out;
+		}
+		ops++;
+
+		if (layer == 1)
+			continue;
+
+		child = dt_new_node(node->dn_path, name, NULL,
+				    node->dn_level + 1);
+		if (!child || dt_push(pool, worker, child)) {
+			if (child)
+				dt_free_node(child);
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+out:
+	if (dfd >= 0)
+		close(dfd);
+
+	dt_account(pool, node->dn_level, ops, start, dt_now());
+	dt_free_node(node);
+
+	return ret;
+}
+
+/*
+ * A directory is removed once its own entries are gone and all of its
+ * subdirectories have been removed, which may cascade up to the root.
+ */
+static int dt_finish_node(struct dt_pool *pool, struct dt_node *node)
+{
+	struct dt_node *parent;
+	int ret = 0;
+	double start;
+
+	while (node && !__sync_sub_and_fetch(&node->dn_pending, 1)) {
+		parent = node->dn_parent;
+
+		if (!pool->p_error && !ret) {
+			start = dt_now();
+			if (rmdir(node->dn_path)) {
+				ret = errno;
+				fprintf(stderr, "rmdir failure %d: %s\n", ret,
+					strerror(ret));
+			} else
+				dt_account(pool, parent ? parent->dn_level : 0,
+					   1, start, dt_now());
+		}
+
+		dt_free_node(node);
+		node = parent;
+	}
+
+	return ret;
+}
+
+static int dt_destroy_dir(struct dt_pool *pool, int worker,
+			  struct dt_task *task)
+{
+	struct dt_node *node = task->dt_node, *child;
+	unsigned long ops = 0;
+	struct dirent *dirent;
+	struct stat stat_info;
+	DIR *dir = NULL;
+	int dfd, is_dir, ret = 0;
+	double start = dt_now();
+
+	if (pool->p_error)
+		goto out;
+
+	dir = opendir(node->dn_path);
+	if (!dir) {
+		ret = errno;
+		fprintf(stderr, "dir open failure %d: %s\n", ret,
+			strerror(ret));
+		goto out;
+	}
+
+	dfd = dirfd(dir);
+
+	while ((dirent = readdir(dir))) {
+		if (!strcmp(dirent->d_name, ".") ||
+		    !strcmp(dirent->d_name, ".."))
+			continue;
+
+		if (dirent->d_type == DT_UNKNOWN) {
+			if (fstatat(dfd, dirent->d_name, &stat_info,
+				    AT_SYMLINK_NOFOLLOW)) {
+				ret = errno;
+				fprintf(stderr, "stat failure %d: %s\n", ret,
+					strerror(ret));
+				goto out;
+			}
+			is_dir = S_ISDIR(stat_info.st_mode);
+		} else
+			is_dir = (dirent->d_type == DT_DIR);
+
+		if (!is_dir) {
+			if (unlinkat(dfd, dirent->d_name, 0)) {
+				ret = errno;
+				fprintf(stderr, "unlink failure %d: %s\n", ret,
+					strerror(ret));
+				goto out;
+			}
+			ops++;
+			continue;
+		}
+
+		child = dt_new_node(node->dn_path, dirent->d_name, node,
+				    node->dn_level + 1);
+		if (!child) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		__sync_add_and_fetch(&node->dn_pending, 1);
+		if (dt_push(pool, worker, child)) {
+			__sync_sub_and_fetch(&node->dn_pending, 1);
+			dt_free_node(child);
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+out:
+	if (dir)
+		closedir(dir);
+
+	dt_account(pool, node->dn_level, ops, start, dt_now());
+
+	if (ret)
+		pool->p_error = ret;
+
+	return dt_finish_node(pool, node);
+}
+
+int build_dir_tree_parallel(char *dirname, unsigned long entries,
+			    unsigned long depth, int is_random, int nr_threads,
+			    struct dir_tree_stats *stats)
+{
+	struct dt_pool pool;
+	struct dt_node *root;
+	int ret;
+
+	ret = mkdir(dirname, FILE_MODE);
+	if (ret < 0) {
+		ret = errno;
+		fprintf(stderr, "mkdir failure %d: %s\n", ret,
+			strerror(ret));
+		return ret;
+	}
+
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+
+	if (depth == 0)
+		return 0;
+
+	root = dt_new_node(NULL, dirname, NULL, 0);
+	if (!root)
+		return -ENOMEM;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.p_work = dt_build_dir;
+	pool.p_stats = stats;
+	pool.p_entries = entries;
+	pool.p_depth = depth;
+	pool.p_is_random = is_random;
+
+	return dt_run_pool(&pool, root, nr_threads);
+}
+
+int traverse_and_destroy_parallel(char *name, int nr_threads,
+				  struct dir_tree_stats *stats)
+{
+	struct dt_pool pool;
+	struct dt_node *root;
+
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+
+	root = dt_new_node(NULL, name, NULL, 0);
+	if (!root)
+		return -ENOMEM;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.p_work = dt_destroy_dir;
+	pool.p_stats = stats;
+
+	return dt_run_pool(&pool, root, nr_threads);
+}
+
+void print_dir_tree_stats(FILE *out, const char *op,
+			  struct dir_tree_stats *stats)
+{
+	struct dir_tree_level_stats *ls;
+	unsigned long i;
+	double elapsed;
+
+	fprintf(out, "%-8s %12s %12s %12s\n", "level", op, "seconds",
+		"ops/sec");
+
+	for (i = 0; i < stats->ds_levels; i++) {
+		ls = &stats->ds_level[i];
+		elapsed = ls->dl_end - ls->dl_start;
+
+		fprintf(out, "%-8lu %12lu %12.3f %12.0f\n", i, ls->dl_ops,
+			elapsed, elapsed > 0 ? ls->dl_ops / elapsed : 0);
+	}
+}
@@ -0,0 +1,52 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * dir_tree.h
+ *
+ * Kept apart from dir_ops.h so that tests carrying their own dirent
+ * helpers can still link the parallel tree builder.
+ *
+ * Copyright (C) 2008 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef DIR_TREE_H
+#define DIR_TREE_H
+
+#include <stdio.h>
+
+/*
+ * Per-level results of the parallel tree builder and destroyer, level N
+ * counts the entries created or removed in directories N levels below
+ * the top one, ops/sec is taken over the time span the level was active.
+ */
+#define DIR_TREE_MAX_LEVELS		64
+
+struct dir_tree_level_stats {
+	unsigned long dl_ops;
+	double dl_start;
+	double dl_end;
+};
+
+struct dir_tree_stats {
+	unsigned long ds_levels;
+	struct dir_tree_level_stats ds_level[DIR_TREE_MAX_LEVELS];
+};
+
+int build_dir_tree_parallel(char *dirname, unsigned long entries,
+			    unsigned long depth, int is_random, int nr_threads,
+			    struct dir_tree_stats *stats);
+int traverse_and_destroy_parallel(char *name, int nr_threads,
+				  struct dir_tree_stats *stats);
+void print_dir_tree_stats(FILE *out, const char *op,
+			  struct dir_tree_stats *stats);
+
+#endif
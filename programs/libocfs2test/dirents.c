@@ -0,0 +1,379 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * dirents.c
+ *
+ * Track the entries a test expects to find in a directory, shared by
+ * dir_ops and the dx_dirs tests.
+ *
+ * Copyright (C) 2008 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dirents.h"
+
+#ifndef S_SHIFT
+#define S_SHIFT		12
+#endif
+
+/*
+ * dirents[] stays an array for iteration, live names (name_len != 0) are
+ * indexed by an open-addressing (linear probing) table whose slots hold
+ * index + 1 into dirents[], 0 marks a free slot.  The table is kept at
+ * most half full.  dirents_capacity is 0 while the test owns dirents[].
+ */
+static unsigned long dirents_capacity;
+static unsigned long *dirent_hash;
+static unsigned long dirent_hash_size;
+
+static unsigned long dirent_name_hash(const char *name)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return (unsigned long)hash;
+}
+
+static unsigned long *dirent_hash_slot(const char *name, unsigned int len)
+{
+	unsigned long mask = dirent_hash_size - 1;
+	unsigned long i = dirent_name_hash(name) & mask;
+	struct my_dirent *dirent;
+
+	while (dirent_hash[i]) {
+		dirent = &dirents[dirent_hash[i] - 1];
+		if (dirent->name_len == len && !strcmp(dirent->name, name))
+			break;
+		i = (i + 1) & mask;
+	}
+
+	return &dirent_hash[i];
+}
+
+/*
+ * Backward-shift deletion, entries after the freed slot which would no
+ * longer be reachable from their home slot get moved up.
+ */
+static void dirent_hash_delete(unsigned long *slot)
+{
+	unsigned long mask = dirent_hash_size - 1;
+	unsigned long i = slot - dirent_hash, j = i, home;
+
+	while (1) {
+		j = (j + 1) & mask;
+		if (!dirent_hash[j])
+			break;
+
+		home = dirent_name_hash(dirents[dirent_hash[j] - 1].name) &
+		       mask;
+		if ((j > i && (home <= i || home > j)) ||
+		    (j < i && (home <= i && home > j))) {
+			dirent_hash[i] = dirent_hash[j];
+			i = j;
+		}
+	}
+
+	dirent_hash[i] = 0;
+}
+
+/* Drop the index slot of a live entry if it points at this entry. */
+static void dirent_hash_unlink(struct my_dirent *dirent)
+{
+	unsigned long *slot;
+
+	if (!dirent_hash_size || !dirent->name_len)
+		return;
+
+	slot = dirent_hash_slot(dirent->name, dirent->name_len);
+	if (*slot == dirent - dirents + 1)
+		dirent_hash_delete(slot);
+}
+
+static int dirent_hash_resize(unsigned long nr_entries, int force)
+{
+	unsigned long i, size = 1024;
+	unsigned long *slot;
+
+	while (size < nr_entries * 2)
+		size <<= 1;
+
+	if (size <= dirent_hash_size && !force)
+		return 0;
+
+	if (dirent_hash)
+		free(dirent_hash);
+
+	dirent_hash = (unsigned long *)calloc(size, sizeof(unsigned long));
+	if (!dirent_hash) {
+		fprintf(stderr, "failed to allocate dirent index of %lu "
+			"slots\n", size);
+		dirent_hash_size = 0;
+		return -ENOMEM;
+	}
+	dirent_hash_size = size;
+
+	for (i = 0; i < num_dirents; i++) {
+		if (!dirents[i].name_len)
+			continue;
+		slot = dirent_hash_slot(dirents[i].name, dirents[i].name_len);
+		*slot = i + 1;
+	}
+
+	return 0;
+}
+
+static int grow_dirents(void)
+{
+	unsigned long capacity = dirents_capacity * 2;
+	struct my_dirent *new_dirents;
+
+	if (!dirents_capacity) {
+		fprintf(stderr, "dirents are not growable\n");
+		return -ENOSPC;
+	}
+
+	new_dirents = (struct my_dirent *)realloc(dirents,
+				sizeof(struct my_dirent) * capacity);
+	if (!new_dirents) {
+		fprintf(stderr, "failed to grow dirents to %lu\n", capacity);
+		return -ENOMEM;
+	}
+
+	memset(new_dirents + dirents_capacity, 0,
+	       sizeof(struct my_dirent) * (capacity - dirents_capacity));
+
+	dirents = new_dirents;
+	dirents_capacity = capacity;
+
+	return dirent_hash_resize(capacity, 0);
+}
+
+void free_my_dirents(void)
+{
+	if (dirents_capacity && dirents)
+		free(dirents);
+	if (dirents_capacity)
+		dirents = NULL;
+	dirents_capacity = 0;
+	num_dirents = 0;
+
+	if (dirent_hash)
+		free(dirent_hash);
+	dirent_hash = NULL;
+	dirent_hash_size = 0;
+}
+
+/* Start over with a growable dirents[] holding "." and "..". */
+int init_my_dirents(void)
+{
+	struct my_dirent *dirent;
+
+	free_my_dirents();
+
+	dirents = (struct my_dirent *)malloc(sizeof(struct my_dirent) *
+					     INIT_DIRENTS);
+	if (!dirents) {
+		fprintf(stderr, "failed to allocate dirents\n");
+		return -ENOMEM;
+	}
+	memset(dirents, 0, sizeof(struct my_dirent) * INIT_DIRENTS);
+	dirents_capacity = INIT_DIRENTS;
+
+	dirent = &dirents[0];
+	dirent->type = S_IFDIR >> S_SHIFT;
+	dirent->name_len = 1;
+	strcpy(dirent->name, ".");
+
+	dirent = &dirents[1];
+	dirent->type = S_IFDIR >> S_SHIFT;
+	dirent->name_len = 2;
+	strcpy(dirent->name, "..");
+
+	num_dirents = 2;
+
+	return dirent_hash_resize(dirents_capacity, 1);
+}
+
+/*
+ * Rebuild the index from dirents[0..num_dirents), for when the array was
+ * changed behind our back, e.g. by other processes sharing it.
+ */
+int index_my_dirents(void)
+{
+	unsigned long nr_entries = num_dirents;
+
+	if (dirents_capacity > nr_entries)
+		nr_entries = dirents_capacity;
+
+	return dirent_hash_resize(nr_entries, 1);
+}
+
+int is_dot_entry(struct my_dirent *dirent)
+{
+	if (dirent->name_len == 1 && dirent->name[0] == '.')
+		return 1;
+	if (dirent->name_len == 2 && dirent->name[0] == '.'
+	    && dirent->name[1] == '.')
+		return 1;
+
+	return 0;
+}
+
+struct my_dirent *find_my_dirent(char *name)
+{
+	unsigned long *slot;
+
+	if (!dirent_hash_size)
+		return NULL;
+
+	slot = dirent_hash_slot(name, strlen(name));
+	if (!*slot)
+		return NULL;
+
+	return &dirents[*slot - 1];
+}
+
+/*
+ * Track a new entry.  A name which is already tracked with the same type
+ * hands back the existing entry, with another type it is rejected.
+ */
+int add_my_dirent(char *name, unsigned int type, struct my_dirent **dirent)
+{
+	int ret;
+	unsigned int len = strlen(name);
+	struct my_dirent *my_dirent;
+
+	if (len >= OCFS2_MAX_FILENAME_LEN) {
+		fprintf(stderr, "dirent name too long: %u\n", len);
+		return -ENAMETOOLONG;
+	}
+
+	if (!dirent_hash_size) {
+		fprintf(stderr, "dirents are not initialized\n");
+		return -EINVAL;
+	}
+
+	my_dirent = find_my_dirent(name);
+	if (my_dirent) {
+		if (my_dirent->type != type) {
+			fprintf(stderr, "dirent %s is already tracked with "
+				"type %u, not %u\n", name, my_dirent->type,
+				type);
+			return -EEXIST;
+		}
+		goto out;
+	}
+
+	if (num_dirents >= dirents_capacity) {
+		ret = grow_dirents();
+		if (ret)
+			return ret;
+	}
+
+	my_dirent = &dirents[num_dirents];
+
+	my_dirent->type = type;
+	my_dirent->name_len = len;
+	my_dirent->seen = 0;
+	strcpy(my_dirent->name, name);
+
+	*dirent_hash_slot(name, len) = num_dirents + 1;
+	num_dirents++;
+
+out:
+	if (dirent)
+		*dirent = my_dirent;
+
+	return 0;
+}
+
+/* Mark the entry as gone but keep its name and slot, see revive_my_dirent() */
+void forget_my_dirent(struct my_dirent *dirent)
+{
+	dirent_hash_unlink(dirent);
+
+	dirent->name_len = 0;
+	dirent->seen = 0;
+}
+
+int revive_my_dirent(struct my_dirent *dirent)
+{
+	unsigned int len = strlen(dirent->name);
+	unsigned long *slot;
+
+	if (dirent->name_len)
+		return 0;
+
+	if (dirent_hash_size) {
+		slot = dirent_hash_slot(dirent->name, len);
+		if (*slot)
+			return -EEXIST;
+		*slot = dirent - dirents + 1;
+	}
+
+	dirent->name_len = len;
+	dirent->seen = 0;
+
+	return 0;
+}
+
+/* Like rename(2), an entry already holding the new name is replaced. */
+int rename_my_dirent(struct my_dirent *dirent, char *name)
+{
+	struct my_dirent *target;
+
+	if (strlen(name) >= OCFS2_MAX_FILENAME_LEN) {
+		fprintf(stderr, "dirent name too long: %zu\n", strlen(name));
+		return -ENAMETOOLONG;
+	}
+
+	target = find_my_dirent(name);
+	if (target && target != dirent)
+		forget_my_dirent(target);
+
+	forget_my_dirent(dirent);
+	strcpy(dirent->name, name);
+
+	return revive_my_dirent(dirent);
+}
+
+/* Drop the entry for good, the last entry is moved into its place. */
+void del_my_dirent(struct my_dirent *dirent)
+{
+	struct my_dirent *last = &dirents[num_dirents - 1];
+	unsigned long *slot;
+
+	dirent_hash_unlink(dirent);
+
+	if (dirent != last) {
+		if (last->name_len && dirent_hash_size) {
+			slot = dirent_hash_slot(last->name, last->name_len);
+			if (*slot == num_dirents)
+				*slot = dirent - dirents + 1;
+		}
+		memcpy((void *)dirent, (void *)last,
+		       sizeof(struct my_dirent));
+	}
+	num_dirents--;
+}
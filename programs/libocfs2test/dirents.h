@@ -0,0 +1,53 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * dirents.h
+ *
+ * In-memory copy of the entries a test expects to find in a directory,
+ * kept apart from dir_ops.h so that tests carrying their own directory
+ * helpers can still share it.
+ *
+ * Copyright (C) 2008 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef DIRENTS_H
+#define DIRENTS_H
+
+#define OCFS2_MAX_FILENAME_LEN          255
+#define INIT_DIRENTS                    40000
+
+struct my_dirent {
+	unsigned int    type;
+	unsigned int    name_len;	/* 0 once the entry is forgotten */
+	unsigned int    seen;
+	char            name[OCFS2_MAX_FILENAME_LEN];
+};
+
+/*
+ * Defined by the test, dirents[] grows on demand unless the test set it
+ * up itself (e.g. in shared memory), then only the index is maintained.
+ */
+extern struct my_dirent *dirents;
+extern unsigned long num_dirents;
+
+int init_my_dirents(void);
+void free_my_dirents(void);
+int index_my_dirents(void);
+int is_dot_entry(struct my_dirent *dirent);
+struct my_dirent *find_my_dirent(char *name);
+int add_my_dirent(char *name, unsigned int type, struct my_dirent **dirent);
+void forget_my_dirent(struct my_dirent *dirent);
+int revive_my_dirent(struct my_dirent *dirent);
+int rename_my_dirent(struct my_dirent *dirent, char *name);
+void del_my_dirent(struct my_dirent *dirent);
+
+#endif
@@ -33,12 +33,16 @@
 #include <sys/sem.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <sys/socket.h>
 #include <netdb.h>
@@ -46,60 +50,12 @@
 #include <arpa/inet.h>
 
 #include <ocfs2/byteorder.h>
-#include "crc32table.h"
+#include "crc32.h"
 #include "file_verify.h"
 
 #define FILE_MODE               (S_IRUSR|S_IWUSR|S_IXUSR|S_IROTH|\
 				 S_IWOTH|S_IXOTH|S_IRGRP|S_IWGRP|S_IXGRP)
 
-static uint32_t crc32_checksum(uint32_t crc, char *p, size_t len)
-{
-	const uint32_t      *b = (uint32_t *)p;
-	const uint32_t      *tab = crc32table_le;
-
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-# define DO_CRC(x) crc = tab[(crc ^ (x)) & 255] ^ (crc >> 8)
-#else
-# define DO_CRC(x) crc = tab[((crc >> 24) ^ (x)) & 255] ^ (crc << 8)
-#endif
-
-	crc = cpu_to_le32(crc);
-	/* Align it */
-	if (((long)b)&3 && len) {
-		do {
-			uint8_t *p = (uint8_t *)b;
-			DO_CRC(*p++);
-			b = (void *)p;
-		} while ((--len) && ((long)b)&3);
-	}
-	if (len >= 4) {
-		/* load data 32 bits wide, xor data 32 bits wide. */
-		size_t save_len = len & 3;
-		len = len >> 2;
-		--b; /* use pre increment below(*++b) for speed */
-		do {
-			crc ^= *++b;
-			DO_CRC(0);
-			DO_CRC(0);
-			DO_CRC(0);
-			DO_CRC(0);
-		} while (--len);
-		b++; /* point to next byte(s) */
-		len = save_len;
-	}
-	/* And the last few bytes */
-	if (len) {
-		do {
-			uint8_t *p = (uint8_t *)b;
-			DO_CRC(*p++);
-			b = (void *)p;
-		} while (--len);
-	}
-
-	return le32_to_cpu(crc);
-#undef DO_CRC
-}
-
 static unsigned long get_rand_ul(unsigned long min, unsigned long max)
 {
 	if (min == 0 && max == 0)
@@ -217,27 +173,142 @@ static int write_at(int fd, const void *buf, size_t count, off_t offset)
 	return count;
 }
 
+/*
+ * Every thread keeps one chunk-sized buffer for building patterns, and
+ * remembers the checksum of the last fill it did for each character,
+ * so generating a pattern costs no allocation and no crc pass.
+ *
+ * Only leaf helpers below may use the arena, callers must never hand
+ * it back in as a pattern argument.
+ */
+struct pattern_arena {
+	char *pa_buf;
+	size_t pa_size;
+	struct {
+		size_t len;
+		uint32_t checksum;
+	} pa_fill_crc[256];
+};
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void arena_destroy(void *arg)
+{
+	struct pattern_arena *pa = arg;
+
+	if (pa->pa_buf)
+		free(pa->pa_buf);
+	free(pa);
+}
+
+static void arena_key_init(void)
+{
+	pthread_key_create(&arena_key, arena_destroy);
+}
+
+static struct pattern_arena *get_arena(void)
+{
+	struct pattern_arena *pa;
+
+	pthread_once(&arena_once, arena_key_init);
+
+	pa = pthread_getspecific(arena_key);
+	if (pa)
+		return pa;
+
+	pa = (struct pattern_arena *)calloc(1, sizeof(*pa));
+	if (!pa) {
+		fprintf(stderr, "failed to allocate pattern arena\n");
+		exit(1);
+	}
+
+	pthread_setspecific(arena_key, pa);
+
+	return pa;
+}
+
+static char *get_arena_pattern(size_t size)
+{
+	struct pattern_arena *pa = get_arena();
+
+	if (pa->pa_size >= size)
+		return pa->pa_buf;
+
+	if (pa->pa_buf)
+		free(pa->pa_buf);
+
+	pa->pa_buf = (char *)malloc(size);
+	if (!pa->pa_buf) {
+		fprintf(stderr, "failed to allocate %lu bytes of pattern "
+			"arena\n", (unsigned long)size);
+		exit(1);
+	}
+	pa->pa_size = size;
+
+	return pa->pa_buf;
+}
+
+/*
+ * crc32 of len bytes of c, computed over a small block on the stack
+ * and cached per (char, len).
+ */
+static uint32_t fill_checksum(char c, size_t len)
+{
+	struct pattern_arena *pa = get_arena();
+	unsigned char idx = (unsigned char)c;
+	char block[4096];
+	uint32_t checksum = ~0;
+	size_t left, count;
+
+	if (pa->pa_fill_crc[idx].len == len && len)
+		return pa->pa_fill_crc[idx].checksum;
+
+	memset(block, c, len < sizeof(block) ? len : sizeof(block));
+
+	for (left = len; left; left -= count) {
+		count = left < sizeof(block) ? left : sizeof(block);
+		checksum = crc32_checksum(checksum, block, count);
+	}
+
+	pa->pa_fill_crc[idx].len = len;
+	pa->pa_fill_crc[idx].checksum = checksum;
+
+	return checksum;
+}
+
+/*
+ * Header and trailer are both 20 bytes, the fill in between is the only
+ * memset done per chunk.
+ */
+#define PATTERN_HDR_SIZE	(sizeof(unsigned long) +		\
+				 sizeof(unsigned long long) +		\
+				 sizeof(uint32_t))
+
+static void prep_write_unit_checksum(struct write_unit *wu)
+{
+	wu->wu_checksum = fill_checksum(wu->wu_char, (size_t)wu->wu_chunksize -
+					PATTERN_HDR_SIZE * 2);
+}
+
 int fill_chunk_pattern(char *pattern, struct write_unit *wu)
 {
 	unsigned long offset = 0;
 	uint32_t checksum = 0;
 	unsigned int chunksize = wu->wu_chunksize;
 
-	memset(pattern, 0, chunksize);
-	offset = 0;
+	prep_write_unit_checksum(wu);
+	checksum = wu->wu_checksum;
 
 	memmove(pattern , &wu->wu_chunk_no, sizeof(unsigned long));
 	offset += sizeof(unsigned long);
 	memmove(pattern + offset, &wu->wu_timestamp, sizeof(unsigned long long));
 	offset += sizeof(unsigned long long);
-
+	memmove(pattern + offset, &checksum, sizeof(uint32_t));
 	offset += sizeof(uint32_t);
 
 	memset(pattern + offset, wu->wu_char, chunksize - offset * 2);
 
-	checksum = crc32_checksum(~0, pattern + offset,
-				  (size_t)chunksize - offset * 2);
-
 	offset = chunksize - offset;
 
 	memmove(pattern + offset, &checksum, sizeof(uint32_t));
@@ -247,11 +318,6 @@ int fill_chunk_pattern(char *pattern, struct write_unit *wu)
 	offset += sizeof(unsigned long long);
 	memmove(pattern + offset, &wu->wu_chunk_no, sizeof(unsigned long));
 
-	offset = sizeof(unsigned long) + sizeof(unsigned long long);
-	memmove(pattern + offset, &checksum, sizeof(uint32_t));
-
-	wu->wu_checksum = checksum;
-
 	return 0;
 }
 
@@ -285,17 +351,11 @@ static int dump_pattern(char *pattern, unsigned int chunksize,
 
 static int verify_chunk_pattern(char *pattern, struct write_unit *wu)
 {
-	int match;
-	char *tmp_pattern;
+	char *tmp_pattern = get_arena_pattern(wu->wu_chunksize);
 
-	tmp_pattern = (char *)malloc(wu->wu_chunksize);
 	fill_chunk_pattern(tmp_pattern, wu);
-	match = !memcmp(pattern, tmp_pattern, wu->wu_chunksize);
 
-	if (tmp_pattern)
-		free(tmp_pattern);
-
-	return match;
+	return !memcmp(pattern, tmp_pattern, wu->wu_chunksize);
 }
 
 static unsigned long long get_time_microseconds(void)
@@ -313,53 +373,34 @@ static unsigned long long get_time_microseconds(void)
 void prep_rand_dest_write_unit(struct write_unit *wu, unsigned long chunk_no,
 			       unsigned int chunksize)
 {
-	char *tmp_pattern;
-
-	tmp_pattern = (char *)malloc(chunksize);
-
 	wu->wu_char = rand_char();
 	wu->wu_chunk_no = chunk_no;
 	wu->wu_chunksize = chunksize;
 	wu->wu_timestamp = get_time_microseconds();
 
-	/*
-	 * the reason to do a redundant filling here is to get a checksum;-)
-	 */
-	fill_chunk_pattern(tmp_pattern, wu);
-
-	if (tmp_pattern)
-		free(tmp_pattern);
+	prep_write_unit_checksum(wu);
 }
 
 int do_write_chunk(int fd, struct write_unit wu)
 {
-	int ret;
-	char *tmp_pattern;
+	char *tmp_pattern = get_arena_pattern(wu.wu_chunksize);
 	size_t count = wu.wu_chunksize;
 	off_t offset = wu.wu_chunksize * wu.wu_chunk_no;
 
-	tmp_pattern = (char *)malloc(wu.wu_chunksize);
 	fill_chunk_pattern(tmp_pattern, &wu);
 
-	ret = write_at(fd, tmp_pattern, count, offset);
-
-	if (tmp_pattern)
-		free(tmp_pattern);
-
-	return ret;
+	return write_at(fd, tmp_pattern, count, offset);
 }
 
 int do_read_chunk(int fd, unsigned long chunk_no, unsigned int chunksize,
 		  struct write_unit *wu)
 {
 	int ret;
-	char *tmp_pattern;
+	char *tmp_pattern = get_arena_pattern(chunksize);
 	size_t count = chunksize, i_size;
 	off_t offset = chunksize * chunk_no;
 	struct stat stat;
 
-	tmp_pattern = (char *)malloc(chunksize);
-
 	ret = fstat(fd, &stat);
 	if (ret == -1) {
 		ret = errno;
@@ -371,14 +412,10 @@ int do_read_chunk(int fd, unsigned long chunk_no, unsigned int chunksize,
 
 	ret = read_at(fd, tmp_pattern, count, offset, i_size);
 	if (ret < 0)
-		goto out;
+		return ret;
 
 	dump_pattern(tmp_pattern, chunksize, wu);
 
-out:
-	if (tmp_pattern)
-		free(tmp_pattern);
-
 	return ret;
 }
 
@@ -387,12 +424,9 @@ int prep_orig_file_in_chunks(char *file_name, unsigned long filesize,
 {
 
 	int fd, ret;
-	char *tmp_pattern;
 	unsigned long offset = 0, chunk_no = 0;
 	static struct write_unit wu;
 
-	tmp_pattern = (char *)malloc(chunksize);
-
 	fd = open_file(file_name, flags);
 	if (fd < 0)
 		return fd;
@@ -408,8 +442,6 @@ int prep_orig_file_in_chunks(char *file_name, unsigned long filesize,
 
 		prep_rand_dest_write_unit(&wu, chunk_no, chunksize);
 
-		fill_chunk_pattern(tmp_pattern, &wu);
-
 		ret = do_write_chunk(fd, wu);
 		if (ret < 0)
 			goto bail;
@@ -419,183 +451,549 @@ int prep_orig_file_in_chunks(char *file_name, unsigned long filesize,
 	}
 
 bail:
-	if (tmp_pattern)
-		free(tmp_pattern);
-
 	close(fd);
 
 	return 0;
 }
 
-int verify_file(int is_remote, FILE *logfile, struct write_unit *remote_wus,
-		char *filename, unsigned long filesize, unsigned int chunksize,
-		int verbose)
+static int read_text_record(FILE *logfile, struct write_unit *wu,
+			    unsigned int chunksize)
 {
-	int fd = 0, ret = 0;
-	struct write_unit *wus, wu, ewu;
-	unsigned long num_chunks = filesize / chunksize, i_size;
-	unsigned long i, t_bytes = sizeof(struct write_unit) * num_chunks;
-	char arg1[100], arg2[100], arg3[100], arg4[100], *tmp_pattern;
+	int ret;
+	char arg1[100], arg2[100], arg3[100], arg4[100];
 
-	tmp_pattern = (char *)malloc(chunksize);
+	ret = fscanf(logfile, "%s\t%s\t%s\t%s\n", arg1, arg2, arg3, arg4);
+	if (ret != 4) {
+		fprintf(stderr, "input failure from write log, ret "
+			"%d, %d %s\n", ret, errno, strerror(errno));
+		return -EINVAL;
+	}
 
-	memset(&wu, 0, sizeof(struct write_unit));
-	memset(&ewu, 0, sizeof(struct write_unit));
+	wu->wu_chunk_no = atol(arg1);
+	wu->wu_timestamp = atoll(arg2);
+	wu->wu_checksum = atoi(arg3);
+	wu->wu_char = arg4[0];
+	wu->wu_chunksize = chunksize;
 
-	wus = (struct write_unit *)malloc(t_bytes);
-	memset(wus, 0, t_bytes);
+	return 0;
+}
 
-	ret = get_i_size(filename, &i_size, 0);
+/*
+ * Returns 1 if fd is not a binary write log, 0 if it is, header gets
+ * filled in as well.
+ */
+static int read_binary_log_header(int fd, struct wu_log_header *hdr,
+				  unsigned long *size)
+{
+	struct stat stat;
+
+	if (fstat(fd, &stat) < 0 || !S_ISREG(stat.st_mode))
+		return 1;
+
+	if (stat.st_size < sizeof(*hdr))
+		return 1;
+
+	if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+		return 1;
+
+	if (memcmp(hdr->wlh_magic, WU_LOG_MAGIC, sizeof(hdr->wlh_magic)))
+		return 1;
+
+	if (hdr->wlh_version != WU_LOG_VERSION) {
+		fprintf(stderr, "Unsupported write log version %u\n",
+			hdr->wlh_version);
+		return -EINVAL;
+	}
+
+	*size = stat.st_size;
+
+	return 0;
+}
+
+int is_binary_logfile(FILE *logfile)
+{
+	struct wu_log_header hdr;
+	unsigned long size;
+
+	return read_binary_log_header(fileno(logfile), &hdr, &size) != 1;
+}
+
+/*
+ * Records appended after the header was last stamped (e.g. the writer
+ * got killed) are still valid, so the count is taken from the file size
+ * and a torn trailing record is ignored.
+ */
+static void *map_binary_log(FILE *logfile, unsigned int chunksize,
+			    unsigned long *nr_records, unsigned long *map_size)
+{
+	int ret, fd = fileno(logfile);
+	struct wu_log_header hdr;
+	unsigned long size;
+	void *map;
+
+	ret = read_binary_log_header(fd, &hdr, &size);
 	if (ret)
-		return ret;
+		return NULL;
 
-	if (is_remote) {
-		memcpy(wus, remote_wus, t_bytes);
-		goto verify_body;
+	if (chunksize && hdr.wlh_chunksize != chunksize) {
+		fprintf(stderr, "Write log was recorded with chunksize %u, "
+			"while %u specified.\n", hdr.wlh_chunksize, chunksize);
+		return NULL;
 	}
 
-	for (i = 0; i < num_chunks; i++) {
-		wus[i].wu_chunk_no = i;
-		wus[i].wu_chunksize = chunksize;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = errno;
+		fprintf(stderr, "mmap write log failed %d: %s\n", ret,
+			strerror(ret));
+		return NULL;
 	}
 
-	while (!feof(logfile)) {
+	madvise(map, size, MADV_SEQUENTIAL);
 
-		ret = fscanf(logfile, "%s\t%s\t%s\t%s\n", arg1, arg2,
-			     arg3, arg4);
-		if (ret != 4) {
-			fprintf(stderr, "input failure from write log, ret "
-				"%d, %d %s\n", ret, errno, strerror(errno));
-			ret = -EINVAL;
-			goto bail;
-		}
+	*nr_records = (size - sizeof(hdr)) / sizeof(struct wu_log_record);
+	*map_size = size;
+
+	return map;
+}
 
-		wu.wu_chunk_no = atol(arg1);
-		if (wu.wu_chunk_no > num_chunks) {
+static int fold_binary_log(FILE *logfile, struct write_unit *wus,
+			   unsigned long num_chunks, unsigned int chunksize)
+{
+	struct wu_log_record *rec;
+	unsigned long i, nr_records, map_size;
+	void *map;
+
+	map = map_binary_log(logfile, chunksize, &nr_records, &map_size);
+	if (!map)
+		return -EINVAL;
+
+	rec = (struct wu_log_record *)((char *)map +
+				       sizeof(struct wu_log_header));
+
+	for (i = 0; i < nr_records; i++, rec++) {
+		if (rec->wlr_chunk_no >= num_chunks) {
 			fprintf(stderr, "Chunkno grabed from write log"
 				"exceeds the filesize, you may probably"
 				" specify a too small filesize.\n");
+			munmap(map, map_size);
 			return -EINVAL;
 		}
 
-		wu.wu_timestamp = atoll(arg2);
-		wu.wu_checksum = atoi(arg3);
-		wu.wu_char = arg4[0];
-		wu.wu_chunksize = chunksize;
+		if (rec->wlr_timestamp < wus[rec->wlr_chunk_no].wu_timestamp)
+			continue;
 
-		if (wu.wu_timestamp >= wus[wu.wu_chunk_no].wu_timestamp) {
+		wus[rec->wlr_chunk_no].wu_timestamp = rec->wlr_timestamp;
+		wus[rec->wlr_chunk_no].wu_checksum = rec->wlr_checksum;
+		wus[rec->wlr_chunk_no].wu_char = rec->wlr_char;
+	}
 
-			memmove(&wus[wu.wu_chunk_no], &wu,
-				sizeof(struct write_unit));
-		}
+	munmap(map, map_size);
+
+	return 0;
+}
+
+/*
+ * Chunks are read in windows of this size, at least one chunk though.
+ */
+#define VERIFY_WINDOW_SIZE	(8 * 1024 * 1024)
+
+enum verify_error {
+	VERIFY_OK = 0,
+	VERIFY_READ_ERROR,
+	VERIFY_CHUNK_NO,
+	VERIFY_CHECKSUM,
+	VERIFY_SHORT_READ,
+	VERIFY_INCONSISTENT,
+};
+
+/*
+ * Each worker verifies chunks [vc_start, vc_end) and stops at its first
+ * mismatch, which is kept for the merged report.
+ */
+struct verify_ctxt {
+	pthread_t vc_thread;
+	const char *vc_filename;
+	struct write_unit *vc_wus;
+	unsigned int vc_chunksize;
+	unsigned long vc_i_size;
+	unsigned long vc_start;
+	unsigned long vc_end;
+	int vc_verbose;
+	volatile unsigned long *vc_first_bad;
+
+	enum verify_error vc_error;
+	int vc_ret;
+	int vc_read;
+	unsigned long vc_bad_chunk;
+	struct write_unit vc_found;
+	struct write_unit vc_expected;
+};
+
+static void verify_ctxt_fail(struct verify_ctxt *vc, unsigned long chunk_no,
+			     enum verify_error error, int ret)
+{
+	unsigned long first, old;
+
+	vc->vc_error = error;
+	vc->vc_ret = ret;
+	vc->vc_bad_chunk = chunk_no;
+
+	/*
+	 * let workers beyond this chunk give up early.
+	 */
+	first = *vc->vc_first_bad;
+	while (chunk_no < first) {
+		old = __sync_val_compare_and_swap(vc->vc_first_bad, first,
+						  chunk_no);
+		if (old == first)
+			break;
+		first = old;
 	}
+}
 
-verify_body:
-	fd = open_file(filename, O_RDONLY);
-	if (fd < 0)
-		return fd;
+static int verify_one_chunk(struct verify_ctxt *vc, char *pattern,
+			    char *tmp_pattern, unsigned long i, int bytes)
+{
+	struct write_unit wu, ewu;
+	unsigned int chunksize = vc->vc_chunksize;
 
-	for (i = 0; i < num_chunks; i++) {
+	dump_pattern(pattern, chunksize, &wu);
+
+	/*
+	 * verify pattern of chunks absent from write records.
+	 */
+	if (!vc->vc_wus[i].wu_timestamp) {
+
+		if (vc->vc_verbose)
+			fprintf(stdout, "  verifying #%lu chunk "
+				"out of write records\n", i);
 		/*
-		 * Verification consists of two following parts:
-		 *
-		 *    - verify write records.
-		 *    - verify pattern of chunks absent from write records.
+		 * skip holes
 		 */
-		memset(&wu, 0, sizeof(struct write_unit));
+		if (!wu.wu_timestamp)
+			return 0;
+
+		if (wu.wu_chunk_no != i) {
+			vc->vc_found = wu;
+			verify_ctxt_fail(vc, i, VERIFY_CHUNK_NO, -EINVAL);
+			return -1;
+		}
 
 		/*
-		 * verfication ends up touching the EOF of file.
+		 * recalculate checksum
 		 */
-		if (i * chunksize >= i_size)
+		memcpy(&ewu, &wu, sizeof(wu));
+		fill_chunk_pattern(tmp_pattern, &ewu);
+		if (wu.wu_checksum != ewu.wu_checksum) {
+			vc->vc_found = wu;
+			vc->vc_expected = ewu;
+			verify_ctxt_fail(vc, i, VERIFY_CHECKSUM, -1);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/*
+	 * verify write records in logfile.
+	 */
+	if (vc->vc_verbose)
+		fprintf(stdout, "  verifying #%lu chunk in write "
+			"records\n", i);
+
+	if (bytes < chunksize) {
+		vc->vc_read = bytes;
+		verify_ctxt_fail(vc, i, VERIFY_SHORT_READ, -1);
+		return -1;
+	}
+
+	fill_chunk_pattern(tmp_pattern, &wu);
+
+	if (!verify_chunk_pattern(tmp_pattern, &vc->vc_wus[i])) {
+		dump_pattern(tmp_pattern, chunksize, &wu);
+		vc->vc_found = wu;
+		vc->vc_expected = vc->vc_wus[i];
+		verify_ctxt_fail(vc, i, VERIFY_INCONSISTENT, -1);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *verify_chunks_range(void *arg)
+{
+	struct verify_ctxt *vc = arg;
+	unsigned int chunksize = vc->vc_chunksize;
+	unsigned long i, j, nr, window_chunks, end;
+	char *window = NULL, *tmp_pattern = NULL;
+	off_t offset;
+	int fd, ret, bytes;
+
+	window_chunks = VERIFY_WINDOW_SIZE / chunksize;
+	if (!window_chunks)
+		window_chunks = 1;
+
+	/*
+	 * verfication ends up touching the EOF of file.
+	 */
+	end = (vc->vc_i_size + chunksize - 1) / chunksize;
+	if (end > vc->vc_end)
+		end = vc->vc_end;
+
+	fd = open_file(vc->vc_filename, O_RDONLY);
+	if (fd < 0) {
+		verify_ctxt_fail(vc, vc->vc_start, VERIFY_READ_ERROR, fd);
+		return NULL;
+	}
+
+	window = (char *)malloc(window_chunks * chunksize);
+	tmp_pattern = (char *)malloc(chunksize);
+	if (!window || !tmp_pattern) {
+		fprintf(stderr, "failed to allocate verify buffers\n");
+		verify_ctxt_fail(vc, vc->vc_start, VERIFY_READ_ERROR, -ENOMEM);
+		goto out;
+	}
+
+	for (i = vc->vc_start; i < end; i += nr) {
+		if (i > *vc->vc_first_bad)
 			break;
 
-		ret = do_read_chunk(fd, i, chunksize, &wu);
-		if (ret < 0)
-			return ret;
-		/*
-		 * verify pattern of chunks absent from write records.
-		 */
-		if (!wus[i].wu_timestamp) {
+		nr = end - i;
+		if (nr > window_chunks)
+			nr = window_chunks;
+
+		offset = (off_t)chunksize * i;
+		ret = read_at(fd, window, (size_t)chunksize * nr, offset,
+			      vc->vc_i_size);
+		if (ret < 0) {
+			verify_ctxt_fail(vc, i, VERIFY_READ_ERROR, ret);
+			break;
+		}
 
-			if (verbose)
-				fprintf(stdout, "  verifying #%lu chunk "
-					"out of write records\n", i);
+		for (j = 0; j < nr; j++) {
 			/*
-			 * skip holes
+			 * the chunk straddling EOF is read short.
 			 */
-			if (!wu.wu_timestamp)
-				continue;
+			bytes = ret - (int)(j * chunksize);
+			if (bytes < 0)
+				bytes = 0;
+			if (bytes < (int)chunksize)
+				memset(window + j * chunksize + bytes, 0,
+				       chunksize - bytes);
+
+			if (verify_one_chunk(vc, window + j * chunksize,
+					     tmp_pattern, i + j, bytes))
+				goto out;
+		}
+	}
+
+out:
+	if (window)
+		free(window);
+
+	if (tmp_pattern)
+		free(tmp_pattern);
+
+	close(fd);
+
+	return NULL;
+}
+
+static void verify_report(struct verify_ctxt *vc)
+{
+	switch (vc->vc_error) {
+	case VERIFY_CHUNK_NO:
+		fprintf(stderr, "Chunk no expected: %lu, Found: %lu\n",
+			vc->vc_bad_chunk, vc->vc_found.wu_chunk_no);
+		break;
+	case VERIFY_CHECKSUM:
+		fprintf(stderr, "Checksum expected: %u Found: %u\n",
+			vc->vc_expected.wu_checksum,
+			vc->vc_found.wu_checksum);
+		break;
+	case VERIFY_SHORT_READ:
+		fprintf(stderr, "Short read(readed:%d, expected:%d)"
+			"happened, you may probably set too big "
+			"filesize for verfiy_test.\n", vc->vc_read,
+			vc->vc_chunksize);
+		break;
+	case VERIFY_INCONSISTENT:
+		fprintf(stderr, "Inconsistent chunk found in file %s!\n"
+			"Expected:\tchunkno(%ld)\ttimestmp(%llu)\t"
+			"chksum(%d)\tchar(%c)\nFound   :\tchunkno"
+			"(%ld)\ttimestmp(%llu)\tchksum(%d)\tchar(%c)\n",
+			vc->vc_filename,
+			vc->vc_expected.wu_chunk_no,
+			vc->vc_expected.wu_timestamp,
+			vc->vc_expected.wu_checksum,
+			vc->vc_expected.wu_char,
+			vc->vc_found.wu_chunk_no, vc->vc_found.wu_timestamp,
+			vc->vc_found.wu_checksum, vc->vc_found.wu_char);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Splits [0, num_chunks) across nr_threads workers, the first mismatch
+ * in file order is reported the same way as a serial pass would do.
+ */
+static int verify_chunks(const char *filename, struct write_unit *wus,
+			 unsigned long num_chunks, unsigned int chunksize,
+			 unsigned long i_size, int nr_threads, int verbose)
+{
+	struct verify_ctxt *vcs, *bad = NULL;
+	volatile unsigned long first_bad = ULONG_MAX;
+	unsigned long per_thread;
+	int i, ret = 0;
+
+	if (nr_threads < 1)
+		nr_threads = 1;
+
+	if (nr_threads > num_chunks)
+		nr_threads = num_chunks ? num_chunks : 1;
 
-			if (wu.wu_chunk_no != i) {
-				fprintf(stderr, "Chunk no expected: %lu, Found: %lu\n",
-					i, wu.wu_chunk_no);
-				return -EINVAL;
+	vcs = (struct verify_ctxt *)calloc(nr_threads, sizeof(*vcs));
+	if (!vcs) {
+		fprintf(stderr, "failed to allocate verify contexts\n");
+		return -ENOMEM;
+	}
+
+	per_thread = (num_chunks + nr_threads - 1) / nr_threads;
+
+	for (i = 0; i < nr_threads; i++) {
+		vcs[i].vc_filename = filename;
+		vcs[i].vc_wus = wus;
+		vcs[i].vc_chunksize = chunksize;
+		vcs[i].vc_i_size = i_size;
+		vcs[i].vc_start = per_thread * i;
+		vcs[i].vc_end = per_thread * (i + 1);
+		if (vcs[i].vc_start > num_chunks)
+			vcs[i].vc_start = num_chunks;
+		if (vcs[i].vc_end > num_chunks)
+			vcs[i].vc_end = num_chunks;
+		vcs[i].vc_verbose = verbose;
+		vcs[i].vc_first_bad = &first_bad;
+	}
+
+	if (nr_threads == 1) {
+		verify_chunks_range(&vcs[0]);
+	} else {
+		for (i = 0; i < nr_threads; i++) {
+			ret = pthread_create(&vcs[i].vc_thread, NULL,
+					     verify_chunks_range, &vcs[i]);
+			if (ret) {
+				fprintf(stderr, "pthread_create failed %d: "
+					"%s\n", ret, strerror(ret));
+				/*
+				 * run the range inline instead.
+				 */
+				vcs[i].vc_thread = 0;
+				verify_chunks_range(&vcs[i]);
 			}
+		}
 
-			/*
-			 * recalculate checksum
-			 */
-			memcpy(&ewu, &wu, sizeof(wu));
-                	fill_chunk_pattern(tmp_pattern, &ewu);
-                	if (wu.wu_checksum != ewu.wu_checksum) {
-                	        fprintf(stderr, "Checksum expected: %u Found: %u\n",
-                	                ewu.wu_checksum, wu.wu_checksum);
-                	        return -1;
-                	}
+		for (i = 0; i < nr_threads; i++)
+			if (vcs[i].vc_thread)
+				pthread_join(vcs[i].vc_thread, NULL);
+	}
 
+	for (i = 0; i < nr_threads; i++) {
+		if (vcs[i].vc_error == VERIFY_OK)
 			continue;
-		}
+		if (!bad || vcs[i].vc_bad_chunk < bad->vc_bad_chunk)
+			bad = &vcs[i];
+	}
 
-		/*
-		 * verify write records in logfile.
-		 */
-		if (verbose)
-			fprintf(stdout, "  verifying #%lu chunk in write "
-				"records\n", i);
-
-		if (ret < chunksize) {
-			fprintf(stderr, "Short read(readed:%d, expected:%d)"
-				"happened, you may probably set too big "
-				"filesize for verfiy_test.\n", ret, chunksize);
-			return -1;
-		}
+	if (bad) {
+		verify_report(bad);
+		ret = bad->vc_ret;
+	} else
+		ret = 0;
 
-		fill_chunk_pattern(tmp_pattern, &wu);
-
-		if (!verify_chunk_pattern(tmp_pattern, &wus[i])) {
-
-			dump_pattern(tmp_pattern, chunksize, &wu);
-			fprintf(stderr, "Inconsistent chunk found in file %s!\n"
-				"Expected:\tchunkno(%ld)\ttimestmp(%llu)\t"
-				"chksum(%d)\tchar(%c)\nFound   :\tchunkno"
-				"(%ld)\ttimestmp(%llu)\tchksum(%d)\tchar(%c)\n",
-				filename,
-				wus[i].wu_chunk_no, wus[i].wu_timestamp,
-				wus[i].wu_checksum, wus[i].wu_char,
-				wu.wu_chunk_no, wu.wu_timestamp,
-				wu.wu_checksum, wu.wu_char);
-			ret = -1;
+	free(vcs);
+
+	return ret;
+}
+
+int verify_file_parallel(int is_remote, FILE *logfile,
+			 struct write_unit *remote_wus, char *filename,
+			 unsigned long filesize, unsigned int chunksize,
+			 int verbose, int nr_threads)
+{
+	int ret = 0;
+	struct write_unit *wus, wu;
+	unsigned long num_chunks = filesize / chunksize, i_size;
+	unsigned long i, t_bytes = sizeof(struct write_unit) * num_chunks;
+
+	memset(&wu, 0, sizeof(struct write_unit));
+
+	wus = (struct write_unit *)malloc(t_bytes);
+	memset(wus, 0, t_bytes);
+
+	ret = get_i_size(filename, &i_size, 0);
+	if (ret)
+		goto bail;
+
+	if (is_remote) {
+		memcpy(wus, remote_wus, t_bytes);
+		goto verify_body;
+	}
+
+	for (i = 0; i < num_chunks; i++) {
+		wus[i].wu_chunk_no = i;
+		wus[i].wu_chunksize = chunksize;
+	}
+
+	if (is_binary_logfile(logfile)) {
+		ret = fold_binary_log(logfile, wus, num_chunks, chunksize);
+		if (ret)
 			goto bail;
+		goto verify_body;
+	}
+
+	while (!feof(logfile)) {
+
+		ret = read_text_record(logfile, &wu, chunksize);
+		if (ret)
+			goto bail;
+
+		if (wu.wu_chunk_no >= num_chunks) {
+			fprintf(stderr, "Chunkno grabed from write log"
+				"exceeds the filesize, you may probably"
+				" specify a too small filesize.\n");
+			ret = -EINVAL;
+			goto bail;
+		}
 
+		if (wu.wu_timestamp >= wus[wu.wu_chunk_no].wu_timestamp) {
+
+			memmove(&wus[wu.wu_chunk_no], &wu,
+				sizeof(struct write_unit));
 		}
 	}
 
-	ret = 0;
+verify_body:
+	ret = verify_chunks(filename, wus, num_chunks, chunksize, i_size,
+			    nr_threads, verbose);
 
 bail:
-	if (tmp_pattern)
-		free(tmp_pattern);
-
 	if (wus)
 		free(wus);
 
-	if (fd)
-		close(fd);
-	
 	return ret;
 }
 
+int verify_file(int is_remote, FILE *logfile, struct write_unit *remote_wus,
+		char *filename, unsigned long filesize, unsigned int chunksize,
+		int verbose)
+{
+	return verify_file_parallel(is_remote, logfile, remote_wus, filename,
+				    filesize, chunksize, verbose, 1);
+}
+
 int init_sock(char *serv, int port)
 {
 	int sockfd;
@@ -740,3 +1138,179 @@ int log_write(struct write_unit *wu, union log_handler log, int remote)
 
 	return ret;
 }
+
+int open_binary_logfile(FILE **logfile, const char *logname,
+			unsigned int chunksize)
+{
+	int ret;
+	struct wu_log_header hdr;
+
+	ret = open_logfile(logfile, logname, 0);
+	if (ret)
+		return ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.wlh_magic, WU_LOG_MAGIC, sizeof(hdr.wlh_magic));
+	hdr.wlh_version = WU_LOG_VERSION;
+	hdr.wlh_chunksize = chunksize;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, *logfile) != 1) {
+		fprintf(stderr, "Error %d writing logfile header: %s\n", errno,
+			strerror(errno));
+		return -EINVAL;
+	}
+
+	fflush(*logfile);
+
+	return 0;
+}
+
+/* Buffered only, the caller syncs when the records have to be durable */
+static int write_binary_record(struct write_unit *wu, FILE *logfile)
+{
+	struct wu_log_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.wlr_chunk_no = wu->wu_chunk_no;
+	rec.wlr_timestamp = wu->wu_timestamp;
+	rec.wlr_checksum = wu->wu_checksum;
+	rec.wlr_char = wu->wu_char;
+
+	if (fwrite(&rec, sizeof(rec), 1, logfile) != 1) {
+		fprintf(stderr, "Error %d writing logfile: %s\n", errno,
+			strerror(errno));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int log_write_binary(struct write_unit *wu, FILE *logfile)
+{
+	int ret;
+
+	ret = write_binary_record(wu, logfile);
+	if (ret)
+		return ret;
+
+	fflush(logfile);
+	fsync(fileno(logfile));
+
+	return 0;
+}
+
+/*
+ * Stamps the final record count into the header, readers don't depend
+ * on it though.
+ */
+int close_binary_logfile(FILE *logfile)
+{
+	int ret = 0, fd = fileno(logfile);
+	struct stat stat;
+	uint64_t records;
+
+	fflush(logfile);
+
+	if (!fstat(fd, &stat) && S_ISREG(stat.st_mode)) {
+		records = (stat.st_size - sizeof(struct wu_log_header)) /
+			  sizeof(struct wu_log_record);
+		if (pwrite(fd, &records, sizeof(records),
+			   offsetof(struct wu_log_header, wlh_records)) < 0) {
+			ret = errno;
+			fprintf(stderr, "Error %d stamping logfile header: "
+				"%s\n", ret, strerror(ret));
+			ret = -EINVAL;
+		}
+		fsync(fd);
+	}
+
+	fclose(logfile);
+
+	return ret;
+}
+
+static int convert_text_to_binary(FILE *in, FILE *out, unsigned int chunksize)
+{
+	int ret = 0;
+	struct write_unit wu;
+
+	while (!feof(in)) {
+		ret = read_text_record(in, &wu, chunksize);
+		if (ret)
+			break;
+
+		/* close_binary_logfile() syncs once at the end */
+		ret = write_binary_record(&wu, out);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+static int convert_binary_to_text(FILE *in, FILE *out)
+{
+	struct wu_log_record *rec;
+	unsigned long i, nr_records, map_size;
+	void *map;
+
+	map = map_binary_log(in, 0, &nr_records, &map_size);
+	if (!map)
+		return -EINVAL;
+
+	rec = (struct wu_log_record *)((char *)map +
+				       sizeof(struct wu_log_header));
+
+	for (i = 0; i < nr_records; i++, rec++)
+		fprintf(out, "%lu\t%llu\t%d\t%c\n",
+			(unsigned long)rec->wlr_chunk_no,
+			(unsigned long long)rec->wlr_timestamp,
+			rec->wlr_checksum, rec->wlr_char);
+
+	munmap(map, map_size);
+
+	return 0;
+}
+
+/*
+ * Converts a write log to the other format, the format of src is
+ * detected, chunksize is only needed when converting text to binary.
+ */
+int convert_logfile(const char *src, const char *dest, unsigned int chunksize)
+{
+	int ret;
+	FILE *in = NULL, *out = NULL;
+
+	ret = open_logfile(&in, src, 1);
+	if (ret)
+		return ret;
+
+	if (is_binary_logfile(in)) {
+		ret = open_logfile(&out, dest, 0);
+		if (ret)
+			goto bail;
+
+		ret = convert_binary_to_text(in, out);
+		fclose(out);
+	} else {
+		if (!chunksize) {
+			fprintf(stderr, "chunksize is needed to convert a "
+				"text write log to binary.\n");
+			ret = -EINVAL;
+			goto bail;
+		}
+
+		ret = open_binary_logfile(&out, dest, chunksize);
+		if (ret)
+			goto bail;
+
+		ret = convert_text_to_binary(in, out, chunksize);
+		if (close_binary_logfile(out) && !ret)
+			ret = -EINVAL;
+	}
+
+bail:
+	fclose(in);
+
+	return ret;
+}
@@ -26,6 +26,28 @@ struct write_unit {
 	char wu_char;
 };
 
+/*
+ * Binary write log, a header followed by fixed-width records, which
+ * verify_file() maps and folds without any parsing.
+ */
+#define WU_LOG_MAGIC		"O2WULOG"
+#define WU_LOG_VERSION		1
+
+struct wu_log_header {
+	char wlh_magic[8];
+	uint32_t wlh_version;
+	uint32_t wlh_chunksize;
+	uint64_t wlh_records;
+};
+
+struct wu_log_record {
+	uint64_t wlr_chunk_no;
+	uint64_t wlr_timestamp;
+	uint32_t wlr_checksum;
+	char wlr_char;
+	char wlr_pad[3];
+};
+
 union log_handler {
 	FILE *stream_log;
 	int socket_log;
@@ -50,6 +72,9 @@ int do_read_chunk(int fd, unsigned long chunk_no, unsigned int chunksize,
 int verify_file(int is_remote, FILE *logfile, struct write_unit *wus,
 		char *filename, unsigned long filesize, unsigned int chunksize,
 		int verbose);
+int verify_file_parallel(int is_remote, FILE *logfile, struct write_unit *wus,
+			 char *filename, unsigned long filesize,
+			 unsigned int chunksize, int verbose, int nr_threads);
 
 int init_sock(char *serv, int port);
 int set_semvalue(int sem_id, int val);
@@ -61,4 +86,11 @@ int semaphore_v(int sem_id);
 int open_logfile(FILE **logfile, const char *logname, int readonly);
 int log_write(struct write_unit *wu, union log_handler log, int remote);
 
+int open_binary_logfile(FILE **logfile, const char *logname,
+			unsigned int chunksize);
+int log_write_binary(struct write_unit *wu, FILE *logfile);
+int close_binary_logfile(FILE *logfile);
+int is_binary_logfile(FILE *logfile);
+int convert_logfile(const char *src, const char *dest, unsigned int chunksize);
+
 #endif
@@ -19,10 +19,47 @@
  * General Public License for more details.
  */
 
+#include <time.h>
+
 #include "mpi_ops.h"
 
 extern int rank, size;
-extern char *hostname;
+extern char hostname[];
+
+/* What each rank sends to rank 0 for the per-node lines of a report */
+struct mpi_lat_node {
+	char mln_host[HOSTNAME_MAX_SZ];
+	unsigned long long mln_count;
+	unsigned long long mln_bytes;
+	unsigned long long mln_elapsed;
+	unsigned long long mln_p99;
+	unsigned long long mln_max;
+};
+
+/* Waits of this rank at one barrier call site */
+struct mpi_barrier_site {
+	const char *mbs_file;
+	int mbs_line;
+	char mbs_name[MPI_BARRIER_SITE_SZ];
+	unsigned long long mbs_count;
+	unsigned long long mbs_wait;	/* in ns */
+	unsigned long long mbs_max;
+};
+
+/* A call site over all ranks, on rank 0 */
+struct mpi_barrier_merged {
+	char mbm_name[MPI_BARRIER_SITE_SZ];
+	unsigned long long mbm_count;
+	unsigned long long mbm_wait;
+	unsigned long long mbm_max;
+	int mbm_max_rank;
+	unsigned long long mbm_min_wait;
+	int mbm_min_rank;
+};
+
+/* -1 until the environment has been looked at */
+static int barrier_timing = -1;
+static struct mpi_barrier_site barrier_sites[MPI_BARRIER_MAX_SITES];
 
 void abort_printf(const char *fmt, ...)
 {
@@ -45,13 +82,203 @@ void root_printf(const char *fmt, ...)
 	}
 }
 
-void MPI_Barrier_Sync(void)
+static void mpi_barrier_account(const char *file, int line,
+				unsigned long long wait)
+{
+	unsigned int h, i;
+	struct mpi_barrier_site *site;
+
+	h = (line * 2654435761U) ^ (unsigned int)(unsigned long)file;
+
+	for (i = 0; i < MPI_BARRIER_MAX_SITES; i++) {
+		site = &barrier_sites[(h + i) % MPI_BARRIER_MAX_SITES];
+
+		if (!site->mbs_file) {
+			site->mbs_file = file;
+			site->mbs_line = line;
+			snprintf(site->mbs_name, MPI_BARRIER_SITE_SZ, "%s:%d",
+				 file, line);
+			break;
+		}
+
+		if (site->mbs_file == file && site->mbs_line == line)
+			break;
+	}
+
+	/* table is full, later sites are not accounted */
+	if (i == MPI_BARRIER_MAX_SITES)
+		return;
+
+	site->mbs_count++;
+	site->mbs_wait += wait;
+	if (wait > site->mbs_max)
+		site->mbs_max = wait;
+}
+
+void mpi_barrier_timing(int enable)
+{
+	barrier_timing = enable;
+}
+
+void MPI_Barrier_Sync_At(const char *file, int line)
 {
 	int ret;
+	char *env;
+	unsigned long long start = 0;
+
+	if (barrier_timing < 0) {
+		env = getenv("O2TEST_BARRIER_TIMING");
+		barrier_timing = env && *env && strcmp(env, "0");
+	}
+
+	if (barrier_timing)
+		start = mpi_lat_now();
 
 	ret = MPI_Barrier(MPI_COMM_WORLD);
 	if (ret != MPI_SUCCESS)
 		abort_printf("MPI_Barrier failed: %d\n", ret);
+
+	if (barrier_timing)
+		mpi_barrier_account(file, line, mpi_lat_now() - start);
+}
+
+static int mpi_barrier_merge(struct mpi_barrier_merged *merged, int nr,
+			     struct mpi_barrier_site *site, int from)
+{
+	int i;
+	struct mpi_barrier_merged *m;
+
+	for (i = 0; i < nr; i++)
+		if (!strcmp(merged[i].mbm_name, site->mbs_name))
+			break;
+
+	m = &merged[i];
+	if (i == nr) {
+		memset(m, 0, sizeof(*m));
+		memcpy(m->mbm_name, site->mbs_name, MPI_BARRIER_SITE_SZ);
+		m->mbm_min_wait = site->mbs_wait;
+		m->mbm_min_rank = from;
+		nr++;
+	}
+
+	if (site->mbs_count > m->mbm_count)
+		m->mbm_count = site->mbs_count;
+	m->mbm_wait += site->mbs_wait;
+	if (site->mbs_max > m->mbm_max) {
+		m->mbm_max = site->mbs_max;
+		m->mbm_max_rank = from;
+	}
+	if (site->mbs_wait < m->mbm_min_wait) {
+		m->mbm_min_wait = site->mbs_wait;
+		m->mbm_min_rank = from;
+	}
+
+	return nr;
+}
+
+static int mpi_barrier_cmp(const void *a, const void *b)
+{
+	const struct mpi_barrier_merged *ma = a, *mb = b;
+
+	if (ma->mbm_wait == mb->mbm_wait)
+		return 0;
+
+	return ma->mbm_wait < mb->mbm_wait ? 1 : -1;
+}
+
+/*
+ * Collective, gathers the per-site waits of every rank on rank 0 which
+ * prints the nr_worst sites by the time all ranks spent waiting there.
+ * The rank that waited least at a site is the one the others were
+ * waiting for.
+ */
+void mpi_barrier_report(int nr_worst)
+{
+	int ret, i, j, k, me, nr, nr_sites = 0, nr_merged = 0;
+	int *counts = NULL, *displs = NULL, *bytes = NULL;
+	struct mpi_barrier_site *sites, *all = NULL;
+	struct mpi_barrier_merged *merged = NULL;
+
+	if (barrier_timing <= 0)
+		return;
+
+	MPI_Comm_rank(MPI_COMM_WORLD, &me);
+	MPI_Comm_size(MPI_COMM_WORLD, &nr);
+
+	sites = malloc(sizeof(struct mpi_barrier_site) *
+		       MPI_BARRIER_MAX_SITES);
+	if (!sites)
+		abort_printf("mpi_barrier_report: out of memory\n");
+
+	for (i = 0; i < MPI_BARRIER_MAX_SITES; i++)
+		if (barrier_sites[i].mbs_file)
+			sites[nr_sites++] = barrier_sites[i];
+
+	if (!me) {
+		counts = malloc(sizeof(int) * nr);
+		displs = malloc(sizeof(int) * nr);
+		bytes = malloc(sizeof(int) * nr);
+		if (!counts || !displs || !bytes)
+			abort_printf("mpi_barrier_report: out of memory\n");
+	}
+
+	ret = MPI_Gather(&nr_sites, 1, MPI_INT, counts, 1, MPI_INT, 0,
+			 MPI_COMM_WORLD);
+	if (ret != MPI_SUCCESS)
+		abort_printf("mpi_barrier_report failed: %d\n", ret);
+
+	if (!me) {
+		for (i = 0, j = 0; i < nr; i++) {
+			displs[i] = j * sizeof(struct mpi_barrier_site);
+			bytes[i] = counts[i] * sizeof(struct mpi_barrier_site);
+			j += counts[i];
+		}
+
+		all = malloc(sizeof(struct mpi_barrier_site) * (j + 1));
+		merged = malloc(sizeof(struct mpi_barrier_merged) * (j + 1));
+		if (!all || !merged)
+			abort_printf("mpi_barrier_report: out of memory\n");
+	}
+
+	/* mbs_file pointers are meaningless on rank 0, only names are used */
+	ret = MPI_Gatherv(sites, nr_sites * sizeof(struct mpi_barrier_site),
+			  MPI_BYTE, all, bytes, displs, MPI_BYTE, 0,
+			  MPI_COMM_WORLD);
+	if (ret != MPI_SUCCESS)
+		abort_printf("mpi_barrier_report failed: %d\n", ret);
+
+	free(sites);
+
+	if (me)
+		return;
+
+	for (i = 0, j = 0; i < nr; i++)
+		for (k = 0; k < counts[i]; k++, j++)
+			nr_merged = mpi_barrier_merge(merged, nr_merged,
+						      &all[j], i);
+
+	qsort(merged, nr_merged, sizeof(struct mpi_barrier_merged),
+	      mpi_barrier_cmp);
+
+	if (nr_worst > nr_merged)
+		nr_worst = nr_merged;
+
+	printf("Barrier wait, worst %d of %d call sites:\n", nr_worst,
+	       nr_merged);
+	printf("  %-40s %8s %12s %10s %9s %9s\n", "site", "calls",
+	       "total(s)", "max(ms)", "max_rank", "straggler");
+
+	for (i = 0; i < nr_worst; i++)
+		printf("  %-40s %8llu %12.3f %10.3f %9d %9d\n",
+		       merged[i].mbm_name, merged[i].mbm_count,
+		       merged[i].mbm_wait / 1e9, merged[i].mbm_max / 1e6,
+		       merged[i].mbm_max_rank, merged[i].mbm_min_rank);
+
+	free(counts);
+	free(displs);
+	free(bytes);
+	free(all);
+	free(merged);
 }
 
 int MPI_Setup(int argc, char *argv[])
@@ -75,3 +302,168 @@ int MPI_Setup(int argc, char *argv[])
 
 	return 0;
 }
+
+unsigned long long mpi_lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void mpi_lat_init(struct mpi_lat_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->mlh_start = mpi_lat_now();
+}
+
+/*
+ * Ends the rank's run, to be called before waiting on the others so
+ * that its throughput doesn't include the slowest node's time.
+ */
+void mpi_lat_stop(struct mpi_lat_hist *h)
+{
+	h->mlh_end = mpi_lat_now();
+}
+
+static int mpi_lat_bucket(unsigned long long ns)
+{
+	int shift;
+
+	if (ns < 2 * MPI_LAT_SUB)
+		return ns;
+
+	shift = 63 - __builtin_clzll(ns) - MPI_LAT_SUB_BITS;
+
+	return (shift + 1) * MPI_LAT_SUB + ((ns >> shift) & (MPI_LAT_SUB - 1));
+}
+
+/* Highest latency falling in a bucket */
+static unsigned long long mpi_lat_bucket_max(int idx)
+{
+	int shift;
+
+	if (idx < 2 * MPI_LAT_SUB)
+		return idx;
+
+	shift = idx / MPI_LAT_SUB - 1;
+
+	return ((unsigned long long)(MPI_LAT_SUB + idx % MPI_LAT_SUB + 1)
+		<< shift) - 1;
+}
+
+void mpi_lat_record(struct mpi_lat_hist *h, unsigned long long start,
+		    unsigned long long bytes)
+{
+	unsigned long long ns = mpi_lat_now() - start;
+
+	h->mlh_buckets[mpi_lat_bucket(ns)]++;
+	h->mlh_count++;
+	h->mlh_bytes += bytes;
+	if (ns > h->mlh_max)
+		h->mlh_max = ns;
+}
+
+static unsigned long long mpi_lat_percentile(struct mpi_lat_hist *h,
+					     double pct)
+{
+	int i;
+	unsigned long long seen = 0, want, val;
+
+	if (!h->mlh_count)
+		return 0;
+
+	want = (unsigned long long)(h->mlh_count * pct / 100.0);
+	if (want < 1)
+		want = 1;
+
+	for (i = 0; i < MPI_LAT_NR_BUCKETS; i++) {
+		seen += h->mlh_buckets[i];
+		if (seen >= want)
+			break;
+	}
+
+	val = mpi_lat_bucket_max(i);
+
+	return val < h->mlh_max ? val : h->mlh_max;
+}
+
+/*
+ * Collective, every rank has to call it for the same op.  Histograms are
+ * summed up on rank 0, which prints the cluster-wide percentiles and a
+ * line per rank, so that a slow node stands out.  Rates are taken up to
+ * mpi_lat_stop(), or up to the report when the rank never stopped.
+ */
+void mpi_lat_report(const char *op, struct mpi_lat_hist *h)
+{
+	int ret, i, me, nr;
+	double secs;
+	struct mpi_lat_hist all;
+	struct mpi_lat_node node, *nodes = NULL;
+
+	MPI_Comm_rank(MPI_COMM_WORLD, &me);
+	MPI_Comm_size(MPI_COMM_WORLD, &nr);
+
+	memset(&node, 0, sizeof(node));
+	gethostname(node.mln_host, HOSTNAME_MAX_SZ - 1);
+	node.mln_count = h->mlh_count;
+	node.mln_bytes = h->mlh_bytes;
+	node.mln_elapsed = (h->mlh_end ? h->mlh_end : mpi_lat_now()) -
+			   h->mlh_start;
+	node.mln_p99 = mpi_lat_percentile(h, 99.0);
+	node.mln_max = h->mlh_max;
+
+	if (!me) {
+		nodes = malloc(sizeof(struct mpi_lat_node) * nr);
+		if (!nodes)
+			abort_printf("mpi_lat_report: out of memory\n");
+	}
+
+	memset(&all, 0, sizeof(all));
+
+	ret = MPI_Reduce(h->mlh_buckets, all.mlh_buckets, MPI_LAT_NR_BUCKETS,
+			 MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	/* mlh_count and mlh_bytes in one go */
+	if (ret == MPI_SUCCESS)
+		ret = MPI_Reduce(&h->mlh_count, &all.mlh_count, 2,
+				 MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+				 MPI_COMM_WORLD);
+	if (ret == MPI_SUCCESS)
+		ret = MPI_Reduce(&h->mlh_max, &all.mlh_max, 1,
+				 MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+				 MPI_COMM_WORLD);
+	/* nodes are expected to share the same architecture */
+	if (ret == MPI_SUCCESS)
+		ret = MPI_Gather(&node, sizeof(node), MPI_BYTE, nodes,
+				 sizeof(node), MPI_BYTE, 0, MPI_COMM_WORLD);
+	if (ret != MPI_SUCCESS)
+		abort_printf("mpi_lat_report failed: %d\n", ret);
+
+	if (me)
+		return;
+
+	printf("%s: %llu ops, latency(us) p50 %.1f p99 %.1f p999 %.1f "
+	       "max %.1f\n", op, all.mlh_count,
+	       mpi_lat_percentile(&all, 50.0) / 1000.0,
+	       mpi_lat_percentile(&all, 99.0) / 1000.0,
+	       mpi_lat_percentile(&all, 99.9) / 1000.0,
+	       all.mlh_max / 1000.0);
+
+	printf("  %-5s %-20s %10s %10s %10s %10s %10s\n", "rank", "host",
+	       "ops", "ops/s", "MB/s", "p99(us)", "max(us)");
+
+	for (i = 0; i < nr; i++) {
+		secs = nodes[i].mln_elapsed / 1e9;
+		if (secs <= 0)
+			secs = 1e-9;
+
+		printf("  %-5d %-20s %10llu %10.1f %10.2f %10.1f %10.1f\n",
+		       i, nodes[i].mln_host, nodes[i].mln_count,
+		       nodes[i].mln_count / secs,
+		       nodes[i].mln_bytes / secs / (1024 * 1024),
+		       nodes[i].mln_p99 / 1000.0, nodes[i].mln_max / 1000.0);
+	}
+
+	free(nodes);
+}
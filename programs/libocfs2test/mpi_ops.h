@@ -33,9 +33,48 @@
 
 #define HOSTNAME_MAX_SZ		100
 
+/*
+ * Log-bucketed latency histogram, each power of two is split into
+ * MPI_LAT_SUB linear buckets, which bounds the error to 1/MPI_LAT_SUB.
+ */
+#define MPI_LAT_SUB_BITS	3
+#define MPI_LAT_SUB		(1 << MPI_LAT_SUB_BITS)
+#define MPI_LAT_NR_BUCKETS	((64 - MPI_LAT_SUB_BITS + 1) * MPI_LAT_SUB)
+
+struct mpi_lat_hist {
+	unsigned long long mlh_buckets[MPI_LAT_NR_BUCKETS];
+	unsigned long long mlh_count;
+	unsigned long long mlh_bytes;
+	unsigned long long mlh_max;	/* in ns */
+	unsigned long long mlh_start;	/* in ns, set by mpi_lat_init() */
+	unsigned long long mlh_end;	/* in ns, set by mpi_lat_stop() */
+};
+
+#define MPI_BARRIER_SITE_SZ	64
+#define MPI_BARRIER_MAX_SITES	256
+
 void abort_printf(const char *fmt, ...);
 void root_printf(const char *fmt, ...);
-void MPI_Barrier_Sync(void);
 int MPI_Setup(int argc, char *argv[]);
 
+/*
+ * Barriers are keyed by call site, when timing is enabled each rank
+ * accounts how long it waited at each of them.  Timing is off unless
+ * O2TEST_BARRIER_TIMING is set in the environment of every rank (e.g.
+ * mpirun -x O2TEST_BARRIER_TIMING=1) or mpi_barrier_timing(1) is called
+ * on every rank.
+ */
+void MPI_Barrier_Sync_At(const char *file, int line);
+#define MPI_Barrier_Sync()	MPI_Barrier_Sync_At(__FILE__, __LINE__)
+
+void mpi_barrier_timing(int enable);
+void mpi_barrier_report(int nr_worst);
+
+unsigned long long mpi_lat_now(void);
+void mpi_lat_init(struct mpi_lat_hist *h);
+void mpi_lat_record(struct mpi_lat_hist *h, unsigned long long start,
+		    unsigned long long bytes);
+void mpi_lat_stop(struct mpi_lat_hist *h);
+void mpi_lat_report(const char *op, struct mpi_lat_hist *h);
+
 #endif
@@ -30,6 +30,10 @@
 #include <limits.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include <o2dlm/o2dlm.h>
 
@@ -40,6 +44,9 @@
 /* How many EX trylocks before we go back to the main loop */
 #define LOCK_GRAB_MAX_EX_TRIES 10
 
+/* How many of the hottest locks the threaded mode reports */
+#define LOCK_GRAB_DEFAULT_TOP 20
+
 
 /* What direction is our next operation */
 enum lg_direction {
@@ -59,14 +66,46 @@ struct lg_context
                                    must release locks on the next
                                    pass */
     int lg_cur_held;            /* How many locks we currently hold */
-    FILE *lg_urandom;           /* FILE for /dev/urandom */
-    char **lg_held;             /* Names of the currently held locks */
-    char **lg_free;             /* Names of currently unheld locks */
+    uint64_t lg_rand;           /* xorshift64* state */
+    char **lg_names;            /* Names of all the locks, indexed by
+                                   lock number, shared by threads */
+    int *lg_slots;              /* Lock numbers, the lg_cur_held held
+                                   ones first, then the free ones.
+                                   Moving a lock between the two sets
+                                   is a swap at the boundary */
+    struct lg_lock_stat *lg_stats;  /* Indexed by lock number, only
+                                       allocated in threaded mode */
+    int lg_quiet;               /* Don't print every lock operation */
     struct o2dlm_ctxt *lg_dlm;  /* DLM context */
+    pthread_t lg_thread;
+    int lg_ret;                 /* What run() returned in this thread */
+};
+
+/* Per lock counters of one context, summed up at the end */
+struct lg_lock_stat
+{
+    unsigned long lls_grants;           /* PR and EX locks taken */
+    unsigned long lls_trylocks;         /* EX trylocks attempted */
+    unsigned long lls_trylock_fails;
+    unsigned long long lls_wait_ns;     /* Total time until granted */
+    unsigned long long lls_max_ns;
 };
 
 sig_atomic_t caught_sig = 0;
 
+static int num_threads = 0;
+static int run_secs = 0;
+static int top_locks = LOCK_GRAB_DEFAULT_TOP;
+
+#define lg_printf(lgc, fmt, args...)            \
+    do {                                        \
+        if (!(lgc)->lg_quiet)                   \
+        {                                       \
+            fprintf(stdout, fmt, ##args);       \
+            fflush(stdout);                     \
+        }                                       \
+    } while (0)
+
 
 void handler(int signum)
 {
@@ -88,12 +127,61 @@ static int setup_signals()
     rc += sigaction(SIGHUP, &act, NULL);
     rc += sigaction(SIGTERM, &act, NULL);
     rc += sigaction(SIGINT, &act, NULL);
+    rc += sigaction(SIGALRM, &act, NULL);  /* -T run time is up */
     act.sa_handler = SIG_IGN;
     rc += sigaction(SIGPIPE, &act, NULL);  /* Get EPIPE instead */
     
     return rc;
 }
 
+static unsigned long long lg_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Seed from /dev/urandom once, then use xorshift64*.  Reading
+ * /dev/urandom through stdio for every choice costs more than the
+ * locking we want to stress.  salt keeps threads apart should
+ * /dev/urandom be unavailable.
+ */
+static void seed_random(struct lg_context *lgc, uint64_t salt)
+{
+    int fd;
+    uint64_t seed = 0;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0)
+    {
+        if (read(fd, &seed, sizeof(seed)) != sizeof(seed))
+            seed = 0;
+        close(fd);
+    }
+
+    if (!seed)
+        seed = lg_now() ^ ((uint64_t)getpid() << 32);
+
+    lgc->lg_rand = seed ^ (salt * 0x9e3779b97f4a7c15ULL);
+    if (!lgc->lg_rand)
+        lgc->lg_rand = 0x9e3779b97f4a7c15ULL;
+}
+
+static uint64_t get_random(struct lg_context *lgc)
+{
+    uint64_t x = lgc->lg_rand;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    lgc->lg_rand = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
 /*
  * The random byte is used in two ways.  First, as a heads/tails choice
  * for things like "lock or unlock".  Second, it chooses how many locks
@@ -104,17 +192,7 @@ static int setup_signals()
  */
 static int get_random_byte(struct lg_context *lgc)
 {
-    int c;
-
-    c = fgetc(lgc->lg_urandom);
-    if (c == EOF){
-        /* EOF is an error for us */
-        fprintf(stderr, "%s: Error reading from /dev/urandom\n",
-                PROGNAME);
-        return -1;
-    }
-
-    return c;
+    return get_random(lgc) >> 56;
 }
 
 static int choose_mode(struct lg_context *lgc)
@@ -185,120 +263,135 @@ static int locks_this_pass(struct lg_context *lgc, int direction)
     return rval;
 }
 
-static int build_locklist(struct lg_context *lgc)
+static char **build_locknames(int num_locks)
 {
     int strsize, i;
     char strbuf[21]; /* Big enough for 2^64, though we don't care */
+    char **names;
 
-    lgc->lg_held = malloc(lgc->lg_num_locks * sizeof(char *));
-    if (!lgc->lg_held)
-        return -ENOMEM;
-    memset(lgc->lg_held, 0, lgc->lg_num_locks * sizeof(char *));
-
-
-    lgc->lg_free = malloc(sizeof(char *) * lgc->lg_num_locks);
-    if (!lgc->lg_free)
-        return -ENOMEM;
-    memset(lgc->lg_free, 0, lgc->lg_num_locks * sizeof(char *));
+    names = malloc(num_locks * sizeof(char *));
+    if (!names)
+        return NULL;
+    memset(names, 0, num_locks * sizeof(char *));
 
     /* We know strbuf can handle an int find, don't check bounds :-) */
-    snprintf(strbuf, sizeof(strbuf), "%d", lgc->lg_num_locks - 1);
+    snprintf(strbuf, sizeof(strbuf), "%d", num_locks - 1);
     strsize = strlen(strbuf) + 1;
 
-    for (i = 0; i < lgc->lg_num_locks; i++)
+    for (i = 0; i < num_locks; i++)
     {
-        lgc->lg_free[i] = malloc(strsize * sizeof(char));
-        if (!lgc->lg_free[i])
-            return -ENOMEM;
-        snprintf(lgc->lg_free[i], strsize, "%0*d", strsize - 1, i);
+        names[i] = malloc(strsize * sizeof(char));
+        if (!names[i])
+            break;
+        snprintf(names[i], strsize, "%0*d", strsize - 1, i);
     }
-    
-    return 0;
+
+    if (i < num_locks)
+    {
+        while (i--)
+            free(names[i]);
+        free(names);
+        return NULL;
+    }
+
+    return names;
 }
 
-static void free_locklist(struct lg_context *lgc)
+static void free_locknames(char **names, int num_locks)
 {
     int i;
 
+    if (!names)
+        return;
+
+    for (i = 0; i < num_locks; i++)
+        free(names[i]);
+    free(names);
+}
+
+static int build_locklist(struct lg_context *lgc, int with_stats)
+{
+    int i;
+
+    lgc->lg_slots = malloc(lgc->lg_num_locks * sizeof(int));
+    if (!lgc->lg_slots)
+        return -ENOMEM;
+
+    /* Nothing is held yet */
     for (i = 0; i < lgc->lg_num_locks; i++)
+        lgc->lg_slots[i] = i;
+    lgc->lg_cur_held = 0;
+
+    if (with_stats)
     {
-        if (lgc->lg_held && lgc->lg_held[i])
-            free(lgc->lg_held[i]);
-        if (lgc->lg_free && lgc->lg_free[i])
-            free(lgc->lg_free[i]);
+        lgc->lg_stats = calloc(lgc->lg_num_locks,
+                               sizeof(struct lg_lock_stat));
+        if (!lgc->lg_stats)
+            return -ENOMEM;
     }
 
-    if (lgc->lg_held)
-        free(lgc->lg_held);
-    if (lgc->lg_free)
-        free(lgc->lg_free);
+    return 0;
 }
 
-static void shift_lock(struct lg_context *lgc, int direction, int num)
+static void free_locklist(struct lg_context *lgc)
+{
+    if (lgc->lg_slots)
+        free(lgc->lg_slots);
+    if (lgc->lg_stats)
+        free(lgc->lg_stats);
+}
+
+/* Lock number of the num'th free lock */
+static int free_lock(struct lg_context *lgc, int num)
+{
+    return lgc->lg_slots[lgc->lg_cur_held + num];
+}
+
+/* Lock number of the num'th held lock */
+static int held_lock(struct lg_context *lgc, int num)
+{
+    return lgc->lg_slots[num];
+}
+
+static void swap_slots(struct lg_context *lgc, int a, int b)
 {
-    int held_count = lgc->lg_cur_held;
-    int free_count = lgc->lg_num_locks - held_count;
-    int source_count, dest_count;
-    char **source_list, **dest_list;
+    int tmp = lgc->lg_slots[a];
 
+    lgc->lg_slots[a] = lgc->lg_slots[b];
+    lgc->lg_slots[b] = tmp;
+}
+
+static void shift_lock(struct lg_context *lgc, int direction, int num)
+{
     if (direction == LG_DIRECTION_LOCK)
     {
-        source_list = lgc->lg_free;
-        dest_list = lgc->lg_held;
-        source_count = free_count;
-        dest_count = held_count;
+        /* The lists are the size of the total lock count; don't go over */
+        if (lgc->lg_cur_held == lgc->lg_num_locks)
+            abort();
 
+        /* The first free slot becomes the last held one */
+        swap_slots(lgc, lgc->lg_cur_held + num, lgc->lg_cur_held);
         lgc->lg_cur_held += 1;
     }
     else if (direction == LG_DIRECTION_UNLOCK)
     {
-        source_list = lgc->lg_held;
-        dest_list = lgc->lg_free;
-        source_count = held_count;
-        dest_count = free_count;
+        if (!lgc->lg_cur_held)
+            abort();
 
+        /* The last held slot becomes the first free one */
+        swap_slots(lgc, num, lgc->lg_cur_held - 1);
         lgc->lg_cur_held -= 1;
     }
     else
         abort();
-
-    /* The lists are the size of the total lock count; don't go over */
-    if (dest_count == lgc->lg_num_locks)
-        abort();
-
-    /* First add the lock to the dest */
-    dest_list[dest_count] = source_list[num];
-
-    /* Now shift the source down */
-    if (num < (source_count - 1))
-#if 1
-        memmove(source_list + num, source_list + num + 1,
-                (source_count - num - 1) * sizeof(char *));
-#else 
-    {
-        fprintf(stdout, "Shifting %p slot %d: %p, %p, %d\n",
-                source_list, num, source_list + num,
-                source_list + num + 1,
-                (source_count - num - 1) * sizeof(char *));
-        memmove(source_list + num, source_list + num + 1,
-                (source_count - num - 1) * sizeof(char *));
-    }
-    else
-        fprintf(stdout, "No shift, num = %d, source_count = %d\n", num,
-                source_count);
-#endif
-
-    source_list[source_count - 1] = NULL;
 }
 
 static int pick_lock(struct lg_context *lgc, int direction)
 {
-    int count, ret;
+    int count;
     unsigned int randval;
 
-    ret = fread(&randval, sizeof(randval), 1, lgc->lg_urandom);
-    if (ret < 1)
-        return -EIO;
+    randval = get_random(lgc) >> 32;
 
     /*
      * Define the bounds of our random space
@@ -315,25 +408,50 @@ static int pick_lock(struct lg_context *lgc, int direction)
     return randval % count;
 }
 
+static void account_grant(struct lg_context *lgc, int lock,
+                          unsigned long long start)
+{
+    unsigned long long ns = lg_now() - start;
+    struct lg_lock_stat *st;
+
+    if (!lgc->lg_stats)
+        return;
+
+    st = &lgc->lg_stats[lock];
+    st->lls_grants++;
+    st->lls_wait_ns += ns;
+    if (ns > st->lls_max_ns)
+        st->lls_max_ns = ns;
+}
+
 static int do_one_ex_lock(struct lg_context *lgc)
 {
-    int num, stime, tries = 0;
+    int num, lock, stime, tries = 0;
+    unsigned long long start;
     errcode_t err;
     char *lock_name;
 
-    fprintf(stdout, "Trying to EX lock lockid ");
+    lg_printf(lgc, "Trying to EX lock lockid ");
     do
     {
         num = pick_lock(lgc, LG_DIRECTION_LOCK);
         if (num < 0)
             return num;
 
-        lock_name = lgc->lg_free[num];
-        fprintf(stdout, "%s ", lock_name);
-        fflush(stdout);
+        lock = free_lock(lgc, num);
+        lock_name = lgc->lg_names[lock];
+        lg_printf(lgc, "%s ", lock_name);
+        start = lg_now();
         err = o2dlm_lock(lgc->lg_dlm, lock_name, O2DLM_TRYLOCK,
                          O2DLM_LEVEL_EXMODE);
         tries++;
+
+        if (lgc->lg_stats)
+        {
+            lgc->lg_stats[lock].lls_trylocks++;
+            if (err == O2DLM_ET_TRYLOCK_FAILED)
+                lgc->lg_stats[lock].lls_trylock_fails++;
+        }
     } while ((err == O2DLM_ET_TRYLOCK_FAILED) &&
              (tries < LOCK_GRAB_MAX_EX_TRIES));
 
@@ -341,29 +459,38 @@ static int do_one_ex_lock(struct lg_context *lgc)
     {
         if (err != O2DLM_ET_TRYLOCK_FAILED)
         {
-            fprintf(stdout, "failed\n");
+            lg_printf(lgc, "failed\n");
             com_err(PROGNAME, err, "while trying to EX lock lockid %s",
                     lock_name);
             return -EIO;
         }
         else if (tries >= LOCK_GRAB_MAX_EX_TRIES) 
         {
-            fprintf(stdout, "giving up\n");
+            lg_printf(lgc, "giving up\n");
             return 0;
         }
         else
             abort();
     }
 
-    fprintf(stdout, "taken... ");
-    fflush(stdout);
+    account_grant(lgc, lock, start);
+    lg_printf(lgc, "taken... ");
 
+    /*
+     * Threads hold EX for up to 8ms rather than seconds, they are
+     * meant to churn through many locks.
+     */
     stime = get_random_byte(lgc);
     if (stime > 0)
-        sleep(stime * 30 / 1000);
+    {
+        if (lgc->lg_stats)
+            usleep(stime * 30);
+        else
+            sleep(stime * 30 / 1000);
+    }
 
     err = o2dlm_unlock(lgc->lg_dlm, lock_name);
-    fprintf(stdout, "%s\n", err ? "failed" : "dropped");
+    lg_printf(lgc, "%s\n", err ? "failed" : "dropped");
     if (err)
     {
         com_err(PROGNAME, err,
@@ -377,7 +504,8 @@ static int do_one_ex_lock(struct lg_context *lgc)
 
 static int do_one_pr_lock(struct lg_context *lgc, int direction)
 {
-    int num;
+    int num, lock;
+    unsigned long long start;
     errcode_t err;
     char *lock_name;
 
@@ -387,21 +515,24 @@ static int do_one_pr_lock(struct lg_context *lgc, int direction)
 
     if (direction == LG_DIRECTION_LOCK)
     {
-        lock_name = lgc->lg_free[num];
-        fprintf(stdout, "%s ", lock_name);
-        fflush(stdout);
+        lock = free_lock(lgc, num);
+        lock_name = lgc->lg_names[lock];
+        lg_printf(lgc, "%s ", lock_name);
+        start = lg_now();
         err = o2dlm_lock(lgc->lg_dlm, lock_name, 0, O2DLM_LEVEL_PRMODE);
         if (err)
-            fprintf(stdout, "failed\n");
+            lg_printf(lgc, "failed\n");
+        else
+            account_grant(lgc, lock, start);
     }
     else if (direction == LG_DIRECTION_UNLOCK)
     {
-        lock_name = lgc->lg_held[num];
-        fprintf(stdout, "%s ", lock_name);
-        fflush(stdout);
+        lock = held_lock(lgc, num);
+        lock_name = lgc->lg_names[lock];
+        lg_printf(lgc, "%s ", lock_name);
         err = o2dlm_unlock(lgc->lg_dlm, lock_name);
         if (err)
-            fprintf(stdout, "failed\n");
+            lg_printf(lgc, "failed\n");
     }
     else
         abort();
@@ -422,11 +553,7 @@ static int do_one_pr_lock(struct lg_context *lgc, int direction)
 
 static int run(struct lg_context *lgc)
 {
-    int ret, mode, direction, this_pass, i;
-    
-    ret = setup_signals();
-    if (ret)
-        return ret;
+    int ret = 0, mode, direction, this_pass, i;
 
     while (!caught_sig && !ret)
     {
@@ -460,12 +587,11 @@ static int run(struct lg_context *lgc)
             break;
         }
 
-        fprintf(stdout,
-                (direction == LG_DIRECTION_LOCK) ?
-                "PR locking %d lockid(s): " :
-                "Dropping PR lock for %d lockid(s): ",
-                this_pass);
-        fflush(stdout);
+        lg_printf(lgc,
+                  (direction == LG_DIRECTION_LOCK) ?
+                  "PR locking %d lockid(s): " :
+                  "Dropping PR lock for %d lockid(s): ",
+                  this_pass);
         for (i = 0; i < this_pass; i++)
         {
             ret = do_one_pr_lock(lgc, direction);
@@ -475,9 +601,201 @@ static int run(struct lg_context *lgc)
                 break;
         }
         if (!ret)
-            fprintf(stdout, "done\n");
+            lg_printf(lgc, "done\n");
+    }
+
+    return ret;
+}
+
+static void *run_thread(void *arg)
+{
+    struct lg_context *lgc = arg;
+    errcode_t err;
+
+    err = o2dlm_initialize(DEFAULT_DLMFS_PATH, DEFAULT_DLMFS_DOMAIN,
+                           &lgc->lg_dlm);
+    if (err) {
+        com_err(PROGNAME, err, "while initializing dlmfs domain %s",
+                DEFAULT_DLMFS_DOMAIN);
+        lgc->lg_ret = -ENOSYS;
+        caught_sig = SIGTERM;
+        return NULL;
+    }
+
+    lgc->lg_ret = run(lgc);
+    /* One thread failing stops them all */
+    if (lgc->lg_ret)
+        caught_sig = SIGTERM;
+
+    err = o2dlm_destroy(lgc->lg_dlm);
+    if (err) {
+        com_err(PROGNAME, err,
+                "while disconnecting from dlmfs domain %s",
+                DEFAULT_DLMFS_DOMAIN);
+        if (!lgc->lg_ret)
+            lgc->lg_ret = -EINVAL;
     }
 
+    return NULL;
+}
+
+static int lls_cmp(const void *a, const void *b)
+{
+    const struct lg_lock_stat *la = *(const struct lg_lock_stat **)a;
+    const struct lg_lock_stat *lb = *(const struct lg_lock_stat **)b;
+
+    if (la->lls_wait_ns != lb->lls_wait_ns)
+        return (la->lls_wait_ns < lb->lls_wait_ns) ? 1 : -1;
+    if (la->lls_trylock_fails != lb->lls_trylock_fails)
+        return (la->lls_trylock_fails < lb->lls_trylock_fails) ? 1 : -1;
+
+    return 0;
+}
+
+/*
+ * Sums up the per thread counters and prints the hottest locks, that
+ * is those the threads spent the most time waiting on.
+ */
+static int report_stats(struct lg_context *lgcs, int nr, double secs)
+{
+    int i, t, num_locks = lgcs[0].lg_num_locks;
+    struct lg_lock_stat *sum, *st, **sorted;
+    struct lg_lock_stat total;
+
+    sum = calloc(num_locks, sizeof(struct lg_lock_stat));
+    sorted = malloc(num_locks * sizeof(struct lg_lock_stat *));
+    if (!sum || !sorted)
+    {
+        free(sum);
+        free(sorted);
+        return -ENOMEM;
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < num_locks; i++)
+    {
+        for (t = 0; t < nr; t++)
+        {
+            st = &lgcs[t].lg_stats[i];
+            sum[i].lls_grants += st->lls_grants;
+            sum[i].lls_trylocks += st->lls_trylocks;
+            sum[i].lls_trylock_fails += st->lls_trylock_fails;
+            sum[i].lls_wait_ns += st->lls_wait_ns;
+            if (st->lls_max_ns > sum[i].lls_max_ns)
+                sum[i].lls_max_ns = st->lls_max_ns;
+        }
+
+        total.lls_grants += sum[i].lls_grants;
+        total.lls_trylocks += sum[i].lls_trylocks;
+        total.lls_trylock_fails += sum[i].lls_trylock_fails;
+        total.lls_wait_ns += sum[i].lls_wait_ns;
+        if (sum[i].lls_max_ns > total.lls_max_ns)
+            total.lls_max_ns = sum[i].lls_max_ns;
+
+        sorted[i] = &sum[i];
+    }
+
+    if (secs <= 0)
+        secs = 1e-9;
+
+    fprintf(stdout,
+            "%s: %d threads, %d locks, %.1f seconds, %lu grants "
+            "(%.1f/s), avg grant %.1fus, max grant %.1fus, "
+            "trylock failures %lu/%lu (%.1f%%)\n",
+            PROGNAME, nr, num_locks, secs, total.lls_grants,
+            total.lls_grants / secs,
+            total.lls_grants ?
+            total.lls_wait_ns / 1000.0 / total.lls_grants : 0,
+            total.lls_max_ns / 1000.0,
+            total.lls_trylock_fails, total.lls_trylocks,
+            total.lls_trylocks ?
+            100.0 * total.lls_trylock_fails / total.lls_trylocks : 0);
+
+    qsort(sorted, num_locks, sizeof(struct lg_lock_stat *), lls_cmp);
+
+    fprintf(stdout, "%-12s %10s %10s %12s %12s %10s %8s\n", "lockid",
+            "grants", "holds/s", "avg_us", "max_us", "trylocks",
+            "fail%");
+
+    for (i = 0; i < num_locks && i < top_locks; i++)
+    {
+        st = sorted[i];
+        if (!st->lls_grants && !st->lls_trylocks)
+            break;
+
+        fprintf(stdout, "%-12s %10lu %10.1f %12.1f %12.1f %10lu %8.1f\n",
+                lgcs[0].lg_names[st - sum], st->lls_grants,
+                st->lls_grants / secs,
+                st->lls_grants ?
+                st->lls_wait_ns / 1000.0 / st->lls_grants : 0,
+                st->lls_max_ns / 1000.0, st->lls_trylocks,
+                st->lls_trylocks ?
+                100.0 * st->lls_trylock_fails / st->lls_trylocks : 0);
+    }
+
+    free(sorted);
+    free(sum);
+
+    return 0;
+}
+
+/*
+ * Every thread owns a context, with its own held and free sets, on the
+ * same domain.  Runs until -T seconds have passed or a signal comes in.
+ */
+static int run_threaded(struct lg_context *template)
+{
+    int i, ret = 0, started;
+    unsigned long long start;
+    struct lg_context *lgcs;
+
+    lgcs = calloc(num_threads, sizeof(struct lg_context));
+    if (!lgcs)
+        return -ENOMEM;
+
+    for (i = 0; i < num_threads; i++)
+    {
+        lgcs[i] = *template;
+        lgcs[i].lg_quiet = 1;
+        seed_random(&lgcs[i], i + 1);
+        ret = build_locklist(&lgcs[i], 1);
+        if (ret)
+            goto out_free;
+    }
+
+    if (run_secs)
+        alarm(run_secs);
+
+    start = lg_now();
+    for (started = 0; started < num_threads; started++)
+    {
+        ret = pthread_create(&lgcs[started].lg_thread, NULL, run_thread,
+                             &lgcs[started]);
+        if (ret)
+        {
+            fprintf(stderr, "%s: Error creating thread: %s\n",
+                    PROGNAME, strerror(ret));
+            ret = -ret;
+            caught_sig = SIGTERM;
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(lgcs[i].lg_thread, NULL);
+        if (lgcs[i].lg_ret && !ret)
+            ret = lgcs[i].lg_ret;
+    }
+
+    if (started)
+        report_stats(lgcs, started, (lg_now() - start) / 1e9);
+
+out_free:
+    for (i = 0; i < num_threads; i++)
+        free_locklist(&lgcs[i]);
+    free(lgcs);
+
     return ret;
 }
 
@@ -486,8 +804,14 @@ static void print_usage(int rc)
     FILE *output = rc ? stderr : stdout;
 
     fprintf(output,
-            "Usage: %s [-c <num_locks>] [-L <min_held>] [-H <max_held>]\n",
-            PROGNAME);
+            "Usage: %s [-c <num_locks>] [-L <min_held>] [-H <max_held>]\n"
+            "       [-t <threads> [-T <seconds>] [-n <top_locks>]]\n"
+            "\n"
+            "-t runs that many threads, each with its own context on the\n"
+            "   domain, quietly, and reports grant latency, trylock failures\n"
+            "   and holds per second of the <top_locks> hottest locks\n"
+            "   (default %d) once -T seconds have passed or on a signal.\n",
+            PROGNAME, LOCK_GRAB_DEFAULT_TOP);
 
     exit(rc);
 }
@@ -501,7 +825,7 @@ static int parse_args(int argc, char *argv[], struct lg_context *lgc)
     int count_set = 0, max_set = 0, min_set = 0;
 
     opterr = 0;
-    while ((c = getopt(argc, argv, ":hc:L:H:-:")) != EOF)
+    while ((c = getopt(argc, argv, ":hc:L:H:t:T:n:-:")) != EOF)
     {
         switch (c)
         {
@@ -553,6 +877,36 @@ static int parse_args(int argc, char *argv[], struct lg_context *lgc)
                 max_set = 1;
                 break;
 
+            case 't':
+                tmp = atoi(optarg);
+                if (tmp < 1) {
+                    fprintf(stderr, "%s: Invalid thread count: %s\n",
+                            PROGNAME, optarg);
+                    return -EINVAL;
+                }
+                num_threads = tmp;
+                break;
+
+            case 'T':
+                tmp = atoi(optarg);
+                if (tmp < 1) {
+                    fprintf(stderr, "%s: Invalid run time: %s\n",
+                            PROGNAME, optarg);
+                    return -EINVAL;
+                }
+                run_secs = tmp;
+                break;
+
+            case 'n':
+                tmp = atoi(optarg);
+                if (tmp < 0) {
+                    fprintf(stderr, "%s: Invalid top lock count: %s\n",
+                            PROGNAME, optarg);
+                    return -EINVAL;
+                }
+                top_locks = tmp;
+                break;
+
             case '?':
                 fprintf(stderr, "%s: Invalid option: \'-%c\'\n",
                         PROGNAME, optopt);
@@ -663,12 +1017,30 @@ int main(int argc, char *argv[])
             PROGNAME, lgc.lg_num_locks, lgc.lg_max_held,
             lgc.lg_min_held);
 
-    ret = build_locklist(&lgc);
-    if (ret)
+    lgc.lg_names = build_locknames(lgc.lg_num_locks);
+    if (!lgc.lg_names)
+    {
+        ret = -ENOMEM;
         goto out_free;
+    }
 
     initialize_o2dl_error_table();
 
+    ret = setup_signals();
+    if (ret)
+        goto out_free;
+
+    if (num_threads)
+    {
+        ret = run_threaded(&lgc);
+        goto out_free;
+    }
+
+    seed_random(&lgc, 0);
+    ret = build_locklist(&lgc, 0);
+    if (ret)
+        goto out_free;
+
     err = o2dlm_initialize(DEFAULT_DLMFS_PATH, DEFAULT_DLMFS_DOMAIN,
                            &lgc.lg_dlm);
     if (err) {
@@ -678,20 +1050,8 @@ int main(int argc, char *argv[])
         goto out_free;
     }
 
-    lgc.lg_urandom = fopen("/dev/urandom", "r");
-    if (!lgc.lg_urandom)
-    {
-        fprintf(stderr, "%s: Error opening /dev/urandom: %s\n",
-                PROGNAME, strerror(errno));
-        ret = -EIO;
-        goto out_destroy;
-    }
-
     ret = run(&lgc);
 
-    fclose(lgc.lg_urandom);
-
-out_destroy:
     err = o2dlm_destroy(lgc.lg_dlm);
     if (err) {
         com_err(PROGNAME, err,
@@ -703,6 +1063,7 @@ out_destroy:
 
 out_free:
     free_locklist(&lgc);
+    free_locknames(lgc.lg_names, lgc.lg_num_locks);
 
     return ret;
 }
@@ -40,15 +40,38 @@
 
 #include <ocfs2/byteorder.h>
 
+#include "mpi_ops.h"
+
 #define DEFAULT_ITER     10000
+#define DEFAULT_PROGRESS 1000
+
+/* Lock calls timed in quiet mode, for each of EX and PR */
+enum lvb_op {
+	LVB_OP_LOCK = 0,
+	LVB_OP_READ_LVB,
+	LVB_OP_UNLOCK,
+	LVB_NR_OPS,
+};
+
+static const char *lvb_op_names[LVB_NR_OPS] = {
+	"lock",
+	"read_lvb",
+	"unlock",
+};
+
+/* mpi_ops.c expects these two */
+char hostname[HOSTNAME_MAX_SZ];
+int rank, size;
 
-#define HOSTNAME_SIZE 50
-static char hostname[HOSTNAME_SIZE];
 static char *prog;
-static int rank, num_procs;
 static unsigned long long max_iter = DEFAULT_ITER;
+static unsigned long long progress = DEFAULT_PROGRESS;
+static int quiet;
 static sig_atomic_t caught_sig = 0;
 
+/* [0] for EX, [1] for PR */
+static struct mpi_lat_hist lat_hists[2][LVB_NR_OPS];
+
 static void handler(int signum)
 {
     caught_sig = signum;
@@ -90,37 +113,87 @@ static void rprintf(int rank, const char *fmt, ...)
 	MPI_Abort(MPI_COMM_WORLD, 1);
 }
 
+static void lat_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < LVB_NR_OPS; j++)
+			mpi_lat_init(&lat_hists[i][j]);
+}
+
+/* Collective, every rank prints nothing but rank 0 */
+static void lat_report(void)
+{
+	int i, j;
+	char op[32];
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < LVB_NR_OPS; j++) {
+			snprintf(op, sizeof(op), "%s %s", i ? "PR" : "EX",
+				 lvb_op_names[j]);
+			mpi_lat_report(op, &lat_hists[i][j]);
+		}
+	}
+}
+
+static void print_progress(unsigned long long iter, unsigned long long start)
+{
+	double secs = (mpi_lat_now() - start) / 1e9;
+	struct mpi_lat_hist *ex = &lat_hists[0][LVB_OP_LOCK];
+	struct mpi_lat_hist *pr = &lat_hists[1][LVB_OP_LOCK];
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	printf("%s: iter %llu/%llu, %.1f iters/s, max lock(us) EX %.1f "
+	       "PR %.1f\n", hostname, iter, max_iter, iter / secs,
+	       ex->mlh_max / 1000.0, pr->mlh_max / 1000.0);
+	fflush(stdout);
+}
+
 static void run_test(struct o2dlm_ctxt *dlm, char *lockid)
 {
 	unsigned long long iter = 0;
 	unsigned long long expected, to_write = 0;
+	unsigned long long start, t;
 	int ret;
 	unsigned int read, written;
 	errcode_t err;
 	enum o2dlm_lock_level level;
+	struct mpi_lat_hist *hists;
 	__u64 lvb;
 
+	lat_init();
+	start = mpi_lat_now();
+
 	while (iter < max_iter && !caught_sig) {
 		expected = iter;
 
-		if ((iter % num_procs) == rank)
+		if ((iter % size) == rank)
 			level = O2DLM_LEVEL_EXMODE;
 		else
 			level = O2DLM_LEVEL_PRMODE;
 
+		hists = lat_hists[level == O2DLM_LEVEL_PRMODE];
+
 		if (level == O2DLM_LEVEL_PRMODE) {
 			ret = MPI_Barrier(MPI_COMM_WORLD);
 			if (ret != MPI_SUCCESS)
 				rprintf(rank, "read MPI_Barrier failed: %d\n", ret);
+			t = mpi_lat_now();
 			err = o2dlm_lock(dlm, lockid, 0, level);
 			if (err)
 				rprintf(rank, "o2dlm_lock failed: %d\n", err);
+			mpi_lat_record(&hists[LVB_OP_LOCK], t, 0);
 
 			expected++;
 		} else {
+			t = mpi_lat_now();
 			err = o2dlm_lock(dlm, lockid, 0, level);
 			if (err)
 				rprintf(rank, "o2dlm_lock failed: %d\n", err);
+			mpi_lat_record(&hists[LVB_OP_LOCK], t, 0);
 
 			ret = MPI_Barrier(MPI_COMM_WORLD);
 			if (ret != MPI_SUCCESS)
@@ -128,25 +201,29 @@ static void run_test(struct o2dlm_ctxt *dlm, char *lockid)
 			to_write = iter + 1;
 		}
 
+		t = mpi_lat_now();
 		err = o2dlm_read_lvb(dlm, lockid, (char *)&lvb, sizeof(lvb),
 				     &read);
 		if (err)
 			rprintf(rank, "o2dlm_read_lvb failed: %d\n", err);
+		mpi_lat_record(&hists[LVB_OP_READ_LVB], t, read);
 
 		lvb = be64_to_cpu(lvb);
 
-		if (level == O2DLM_LEVEL_PRMODE)
-			printf("%s: read  iter: %llu, lvb: %llu exp: %llu\n",
-			       hostname, (unsigned long long)iter,
-			       (unsigned long long)lvb,
-			       (unsigned long long)expected);
-		else
-			printf("%s: write iter: %llu, lvb: %llu wri: %llu\n",
-			       hostname, (unsigned long long)iter,
-			       (unsigned long long)lvb,
-			       (unsigned long long)to_write);
-
-		fflush(stdout);
+		if (!quiet) {
+			if (level == O2DLM_LEVEL_PRMODE)
+				printf("%s: read  iter: %llu, lvb: %llu exp: %llu\n",
+				       hostname, (unsigned long long)iter,
+				       (unsigned long long)lvb,
+				       (unsigned long long)expected);
+			else
+				printf("%s: write iter: %llu, lvb: %llu wri: %llu\n",
+				       hostname, (unsigned long long)iter,
+				       (unsigned long long)lvb,
+				       (unsigned long long)to_write);
+
+			fflush(stdout);
+		}
 
 		if (lvb != expected) {
 			printf("Test failed! %s: rank %d, read lvb %llu, expected %llu\n",
@@ -166,9 +243,11 @@ static void run_test(struct o2dlm_ctxt *dlm, char *lockid)
 				rprintf(rank, "o2dlm_write_lvb() wrote %d, we asked for %d\n", written, sizeof(lvb));
 		}
 
+		t = mpi_lat_now();
 		err = o2dlm_unlock(dlm, lockid);
 		if (err)
 			rprintf(rank, "o2dlm_unlock failed: %d\n", err);
+		mpi_lat_record(&hists[LVB_OP_UNLOCK], t, 0);
 
 		/* This second barrier is not necessary and can be
 		 * commented out to ramp the test up */
@@ -177,7 +256,13 @@ static void run_test(struct o2dlm_ctxt *dlm, char *lockid)
 			rprintf(rank, "unlock MPI_Barrier failed: %d\n", ret);
 
 		iter++;
+
+		if (quiet && progress && !rank && !(iter % progress))
+			print_progress(iter, start);
 	}
+
+	if (quiet)
+		lat_report();
 }
 
 static void clear_lock(struct o2dlm_ctxt *dlm, char *lockid)
@@ -286,8 +371,12 @@ static char *hb_dev = NULL;
 
 static void usage(char *prog)
 {
-	printf("usage: %s [-h <heartbeat device>] [-d <dlmfs path>] [-i <iterations>] <domain> <lockname>\n", prog);
+	printf("usage: %s [-h <heartbeat device>] [-d <dlmfs path>] [-i <iterations>] [-q [-p <progress>]] <domain> <lockname>\n", prog);
 	printf("<iterations> defaults to %d\n", DEFAULT_ITER);
+	printf("-q does not print every iteration but the latency of lock, "
+	       "read_lvb and unlock\n   for EX and PR once done, rank 0 "
+	       "reports progress every <progress>\n   iterations, "
+	       "defaults to %d, 0 disables it\n", DEFAULT_PROGRESS);
 	printf("<dlmfs path> defaults to %s\n", dlmfs_path);
 	printf("if <heartbeat device> is given, heartbeat will be started for "
 	       "you, otherwise it is expected to be up.\n");
@@ -301,7 +390,7 @@ int parse_opts(int argc, char **argv)
 	int c;
 
 	while (1) {
-		c = getopt(argc, argv, "h:d:i:");
+		c = getopt(argc, argv, "h:d:i:qp:");
 		if (c == -1)
 			break;
 
@@ -315,6 +404,12 @@ int parse_opts(int argc, char **argv)
 		case 'i':
 			max_iter = atoll(optarg);
 			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'p':
+			progress = atoll(optarg);
+			break;
 		default:
 			return EINVAL;
 		}
@@ -354,14 +449,14 @@ int main(int argc, char *argv[])
         if (error != MPI_SUCCESS)
                 rprintf(-1, "MPI_Comm_rank failed: %d\n", error);
 
-	error = MPI_Comm_size(MPI_COMM_WORLD, &num_procs);
+	error = MPI_Comm_size(MPI_COMM_WORLD, &size);
 	if (error != MPI_SUCCESS)
 		rprintf(rank, "MPI_Comm_size failed: %d\n", error);
 
-        if (gethostname(hostname, HOSTNAME_SIZE) < 0)
+        if (gethostname(hostname, HOSTNAME_MAX_SZ) < 0)
                 rprintf(rank, "gethostname failed: %s\n", strerror(errno));
 
-        printf("%s: rank: %d, nodes: %d, dlm: %s, dom: %s, lock: %s, iter: %llu\n", hostname, rank, num_procs, dlmfs_path, domain, lockid, (unsigned long long) max_iter);
+        printf("%s: rank: %d, nodes: %d, dlm: %s, dom: %s, lock: %s, iter: %llu\n", hostname, rank, size, dlmfs_path, domain, lockid, (unsigned long long) max_iter);
 
 	
 	if (access(dlmfs_path, W_OK) < 0) {
@@ -8,6 +8,9 @@
 #include <errno.h>
 #include <poll.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
 #include <et/com_err.h>
 
 #include <o2dlm/o2dlm.h>
@@ -15,9 +18,58 @@
 #define DOMAINNAME	"o2dlm-polltest"
 #define LOCKNAME	"/contendme"
 
+#define DEFAULT_REQUESTERS	1
+#define DEFAULT_SECONDS		60
+#define DEFAULT_RETRY_MS	10
+#define DEFAULT_PROGRESS	5
+
+#define BENCH_MAX_EVENTS	256
+#define LAT_NR_BUCKETS		64
+
+/*
+ * Benchmark mode, -n locks.
+ *
+ * The servicer, the main process, holds all of the locks with a bast
+ * fd each, waits for basts on all of them with epoll and releases a
+ * lock as soon as another node wants it.  Released locks are taken
+ * back with trylocks, so that the servicer never blocks and keeps
+ * servicing basts.
+ *
+ * Trylocks don't bast the holder, so the contention comes from the
+ * requesters, child processes with a domain context of their own which
+ * take random locks in EX with blocking requests and drop them right
+ * away.  Run it on every node with the same lock count.
+ */
+struct bench_lock {
+	char bl_name[O2DLM_LOCK_ID_MAX_LEN];
+	int bl_fd;			/* bast fd, -1 when not held */
+	enum o2dlm_lock_level bl_level;
+	unsigned long long bl_due;	/* when to try it again, in ns */
+};
+
+/* Power of two buckets, in ns */
+struct lat_hist {
+	unsigned long long lh_buckets[LAT_NR_BUCKETS];
+	unsigned long long lh_count;
+	unsigned long long lh_total;
+	unsigned long long lh_max;
+};
+
 static sig_atomic_t sig_exit;
 static int bast_error;
 
+static int nr_locks;
+static int nr_requesters = DEFAULT_REQUESTERS;
+static int run_secs = DEFAULT_SECONDS;
+static int retry_ms = DEFAULT_RETRY_MS;
+static int progress_secs = DEFAULT_PROGRESS;
+
+static struct o2dlm_ctxt *bench_dlm;
+static struct bench_lock *bench_locks;
+static struct lat_hist bast_lat;
+static unsigned long long bench_wakeup;
+static unsigned long long bench_basts;
+
 static int setup_domain(struct o2dlm_ctxt **dlm)
 {
 	errcode_t ret;
@@ -151,16 +203,432 @@ static int run_test(struct o2dlm_ctxt *dlm)
 	return rc;
 }
 
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lat_record(struct lat_hist *h, unsigned long long ns)
+{
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	h->lh_buckets[bucket]++;
+	h->lh_count++;
+	h->lh_total += ns;
+	if (ns > h->lh_max)
+		h->lh_max = ns;
+}
+
+/* Upper bound of the bucket the percentile falls in, in us */
+static double lat_percentile(struct lat_hist *h, double pct)
+{
+	int i;
+	unsigned long long seen = 0, want;
+
+	if (!h->lh_count)
+		return 0;
+
+	want = (unsigned long long)(h->lh_count * pct / 100.0);
+	if (want < 1)
+		want = 1;
+
+	for (i = 0; i < LAT_NR_BUCKETS - 1; i++) {
+		seen += h->lh_buckets[i];
+		if (seen >= want)
+			break;
+	}
+
+	if (i == LAT_NR_BUCKETS - 1 || (2ULL << i) > h->lh_max)
+		return h->lh_max / 1000.0;
+
+	return (2ULL << i) / 1000.0;
+}
+
+static void lat_print(const char *what, struct lat_hist *h, double secs)
+{
+	fprintf(stdout, "%s: %llu in %.1fs, %.1f/s, latency(us) avg %.1f "
+		"p50 %.1f p99 %.1f p999 %.1f max %.1f\n", what, h->lh_count,
+		secs, secs > 0 ? h->lh_count / secs : 0,
+		h->lh_count ? h->lh_total / 1000.0 / h->lh_count : 0,
+		lat_percentile(h, 50.0), lat_percentile(h, 99.0),
+		lat_percentile(h, 99.9), h->lh_max / 1000.0);
+}
+
+/* The downconvert: dlmfs can only release the lock */
+static void bench_bast_func(void *arg)
+{
+	errcode_t ret;
+	struct bench_lock *bl = arg;
+
+	ret = o2dlm_unlock(bench_dlm, bl->bl_name);
+	if (ret) {
+		com_err(DOMAINNAME, ret, "while releasing %s", bl->bl_name);
+		bast_error = 1;
+		return;
+	}
+
+	/* The fd is closed, which takes it off the epoll set as well */
+	bl->bl_fd = -1;
+	bench_basts++;
+	lat_record(&bast_lat, now_ns() - bench_wakeup);
+}
+
+/*
+ * Returns 1 if the lock is held, 0 if someone else has it, in which
+ * case the caller tries it again later.
+ */
+static int bench_trylock(int epfd, struct bench_lock *bl)
+{
+	errcode_t ret;
+	struct epoll_event ev;
+
+	ret = o2dlm_lock_with_bast(bench_dlm, bl->bl_name, O2DLM_TRYLOCK,
+				   bl->bl_level, bench_bast_func, bl,
+				   &bl->bl_fd);
+	if (ret == O2DLM_ET_TRYLOCK_FAILED) {
+		bl->bl_fd = -1;
+		return 0;
+	}
+	if (ret) {
+		com_err(DOMAINNAME, ret, "while trying to lock %s",
+			bl->bl_name);
+		bl->bl_fd = -1;
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLHUP;
+	ev.data.ptr = bl;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, bl->bl_fd, &ev) < 0) {
+		perror("Error adding a bast fd to epoll");
+		return -1;
+	}
+
+	return 1;
+}
+
+/* Takes and drops random locks in EX until the time is up */
+static int run_requester(int id)
+{
+	int rc = 0;
+	char name[O2DLM_LOCK_ID_MAX_LEN];
+	unsigned int seed = getpid() ^ (id << 16);
+	unsigned long long start, begin;
+	errcode_t ret;
+	struct o2dlm_ctxt *dlm;
+	struct lat_hist lat;
+	char what[64];
+
+	memset(&lat, 0, sizeof(lat));
+
+	if (setup_domain(&dlm))
+		return 1;
+
+	begin = now_ns();
+	while (!sig_exit) {
+		snprintf(name, sizeof(name), "contend%d",
+			 rand_r(&seed) % nr_locks);
+
+		start = now_ns();
+		ret = o2dlm_lock(dlm, name, 0, O2DLM_LEVEL_EXMODE);
+		if (ret) {
+			/* A signal telling us to stop may get here first */
+			if (sig_exit)
+				break;
+			com_err(DOMAINNAME, ret, "while locking %s", name);
+			rc = 1;
+			break;
+		}
+		lat_record(&lat, now_ns() - start);
+
+		ret = o2dlm_unlock(dlm, name);
+		if (ret) {
+			com_err(DOMAINNAME, ret, "while unlocking %s", name);
+			rc = 1;
+			break;
+		}
+	}
+
+	snprintf(what, sizeof(what), "requester %d EX grants", id);
+	lat_print(what, &lat, (now_ns() - begin) / 1e9);
+
+	if (teardown_domain(dlm))
+		rc = 1;
+
+	return rc;
+}
+
+static int run_servicer(int epfd)
+{
+	int i, n, rc = 0, held = 0, head = 0, nr_pending = nr_locks;
+	int *pending, timeout;
+	unsigned long long start, now, next_progress, last_basts = 0;
+	unsigned long long trylocks = 0, trylock_fails = 0;
+	struct epoll_event events[BENCH_MAX_EVENTS];
+	struct bench_lock *bl;
+
+	/* A ring of the locks not held, oldest release first */
+	pending = malloc(sizeof(int) * nr_locks);
+	if (!pending) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < nr_locks; i++)
+		pending[i] = i;
+
+	start = now_ns();
+	next_progress = start + progress_secs * 1000000000ULL;
+
+	while (!sig_exit && !bast_error) {
+		/* Take back whatever is due, queue the rest again */
+		now = now_ns();
+		for (i = nr_pending; i > 0; i--) {
+			bl = &bench_locks[pending[head]];
+			if (bl->bl_due > now)
+				break;
+
+			head = (head + 1) % nr_locks;
+			nr_pending--;
+			trylocks++;
+
+			rc = bench_trylock(epfd, bl);
+			if (rc < 0)
+				goto out;
+			if (rc) {
+				held++;
+				continue;
+			}
+
+			trylock_fails++;
+			bl->bl_due = now + retry_ms * 1000000ULL;
+			pending[(head + nr_pending) % nr_locks] = bl - bench_locks;
+			nr_pending++;
+		}
+		rc = 0;
+
+		timeout = 1000;
+		if (nr_pending) {
+			bl = &bench_locks[pending[head]];
+			now = now_ns();
+			timeout = bl->bl_due > now ?
+				(bl->bl_due - now) / 1000000 + 1 : 0;
+		}
+
+		n = epoll_wait(epfd, events, BENCH_MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error waiting for basts");
+			rc = -1;
+			break;
+		}
+
+		/* Events of this batch wait for those before them */
+		bench_wakeup = now_ns();
+		for (i = 0; i < n; i++) {
+			bl = events[i].data.ptr;
+
+			if (events[i].events & EPOLLHUP) {
+				fprintf(stdout, "Hangup on lock %s\n",
+					bl->bl_name);
+				rc = -1;
+				goto out;
+			}
+
+			if (!(events[i].events & EPOLLIN) || bl->bl_fd < 0)
+				continue;
+
+			o2dlm_process_bast(bench_dlm, bl->bl_fd);
+			if (bast_error) {
+				rc = -1;
+				goto out;
+			}
+			if (bl->bl_fd >= 0)
+				continue;
+
+			held--;
+			bl->bl_due = bench_wakeup + retry_ms * 1000000ULL;
+			pending[(head + nr_pending) % nr_locks] = bl - bench_locks;
+			nr_pending++;
+		}
+
+		now = now_ns();
+		if (progress_secs && now >= next_progress) {
+			fprintf(stdout, "held %d, waiting %d, basts/s %.1f\n",
+				held, nr_pending,
+				(bench_basts - last_basts) /
+				(double)progress_secs);
+			fflush(stdout);
+			last_basts = bench_basts;
+			next_progress = now + progress_secs * 1000000000ULL;
+		}
+	}
+
+out:
+	lat_print("bast to release", &bast_lat, (now_ns() - start) / 1e9);
+	fprintf(stdout, "trylocks: %llu, failed %llu (%.1f%%), held at exit "
+		"%d of %d\n", trylocks, trylock_fails,
+		trylocks ? 100.0 * trylock_fails / trylocks : 0, held,
+		nr_locks);
+	fflush(stdout);
+
+	for (i = 0; i < nr_locks; i++) {
+		bl = &bench_locks[i];
+		if (bl->bl_fd < 0)
+			continue;
+		if (o2dlm_unlock(bench_dlm, bl->bl_name))
+			rc = -1;
+		bl->bl_fd = -1;
+	}
+
+	free(pending);
+
+	return rc;
+}
+
+static int run_bench(void)
+{
+	int i, rc = -1, status, epfd = -1, started = 0;
+	pid_t *pids;
+
+	pids = calloc(nr_requesters + 1, sizeof(pid_t));
+	bench_locks = calloc(nr_locks, sizeof(struct bench_lock));
+	if (!pids || !bench_locks) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	srand(getpid());
+	for (i = 0; i < nr_locks; i++) {
+		snprintf(bench_locks[i].bl_name, O2DLM_LOCK_ID_MAX_LEN,
+			 "contend%d", i);
+		bench_locks[i].bl_fd = -1;
+		bench_locks[i].bl_level = (rand() & 0x01) ?
+			O2DLM_LEVEL_EXMODE : O2DLM_LEVEL_PRMODE;
+	}
+
+	/* The children get a domain context of their own */
+	for (started = 0; started < nr_requesters; started++) {
+		pids[started] = fork();
+		if (pids[started] < 0) {
+			perror("fork");
+			goto out_kill;
+		}
+		if (!pids[started])
+			exit(run_requester(started));
+	}
+
+	if (setup_domain(&bench_dlm))
+		goto out_kill;
+
+	epfd = epoll_create(nr_locks);
+	if (epfd < 0) {
+		perror("epoll_create");
+		teardown_domain(bench_dlm);
+		goto out_kill;
+	}
+
+	fprintf(stdout, "Servicing %d locks with %d requesters for %ds\n",
+		nr_locks, nr_requesters, run_secs);
+	fflush(stdout);
+
+	alarm(run_secs);
+	rc = run_servicer(epfd);
+
+	close(epfd);
+	if (teardown_domain(bench_dlm))
+		rc = -1;
+
+out_kill:
+	for (i = 0; i < started; i++)
+		kill(pids[i], SIGINT);
+	for (i = 0; i < started; i++) {
+		if (waitpid(pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			rc = -1;
+	}
+
+out:
+	free(bench_locks);
+	free(pids);
+
+	return rc;
+}
+
 static void handler(int signum)
 {
 	sig_exit = 1;
 }
 
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n <locks> [-r <requesters>] "
+		"[-t <seconds>] [-w <retry ms>]\n"
+		"          [-p <progress seconds>]]\n"
+		"Without -n, contends on a single lock until interrupted.\n"
+		"-n holds that many locks, releases them on basts and "
+		"reports bast to release\n   latency and basts per second.  "
+		"<requesters> processes, default %d,\n   take random locks "
+		"in EX to contend with the other nodes.  Runs for\n   "
+		"<seconds>, default %d, released locks are taken again after "
+		"<retry ms>,\n   default %d, progress is printed every "
+		"<progress seconds>, default %d.\n", prog,
+		DEFAULT_REQUESTERS, DEFAULT_SECONDS, DEFAULT_RETRY_MS,
+		DEFAULT_PROGRESS);
+	exit(1);
+}
+
+static void parse_opts(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "n:r:t:w:p:h")) != -1) {
+		switch (c) {
+		case 'n':
+			nr_locks = atoi(optarg);
+			if (nr_locks < 1)
+				usage(argv[0]);
+			break;
+		case 'r':
+			nr_requesters = atoi(optarg);
+			if (nr_requesters < 0)
+				usage(argv[0]);
+			break;
+		case 't':
+			run_secs = atoi(optarg);
+			if (run_secs < 1)
+				usage(argv[0]);
+			break;
+		case 'w':
+			retry_ms = atoi(optarg);
+			if (retry_ms < 0)
+				usage(argv[0]);
+			break;
+		case 'p':
+			progress_secs = atoi(optarg);
+			if (progress_secs < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind < argc)
+		usage(argv[0]);
+}
+
 int main(int argc, char *argv[])
 {
 	int rc = -1;
 	struct o2dlm_ctxt *dlm = NULL;
 
+	parse_opts(argc, argv);
+
 	initialize_o2dl_error_table();
 
 	if (signal(SIGINT, handler) == SIG_ERR) {
@@ -168,6 +636,15 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (nr_locks) {
+		if (signal(SIGALRM, handler) == SIG_ERR) {
+			perror("SIGALRM");
+			goto out;
+		}
+		rc = run_bench();
+		goto out;
+	}
+
 	if (setup_domain(&dlm))
 		goto out;
 
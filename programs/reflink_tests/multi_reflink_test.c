@@ -22,6 +22,7 @@
 
 #include "reflink_test.h"
 #include "xattr_test.h"
+#include "mpi_ops.h"
 
 #include <mpi.h>
 
@@ -43,15 +44,18 @@ char *prog;
 static char workplace[PATH_MAX];
 static char orig_path[PATH_MAX];
 static char ref_path[PATH_MAX];
-static char hostname[HOSTNAME_MAX_SZ];
+char hostname[HOSTNAME_MAX_SZ];
 
 static int iteration = 1;
 static int testno = 1;
 
-static int rank = -1, size;
+int rank = -1, size;
+
+static struct mpi_lat_hist lat;
 
 static unsigned long ref_counts = 10;
 static unsigned long ref_trees = 10;
+static unsigned long storm_secs;
 
 int test_flags = 0x00000000;
 
@@ -91,33 +95,11 @@ char *name_get;
 
 static unsigned long list_sz;
 
-static void abort_printf(const char *fmt, ...)
-{
-	va_list ap;
-
-	printf("%s (rank %d): ", hostname, rank);
-	va_start(ap, fmt);
-	vprintf(fmt, ap);
-
-	MPI_Abort(MPI_COMM_WORLD, 1);
-}
-
-static void root_printf(const char *fmt, ...)
-{
-	va_list ap;
-
-	if (rank == 0) {
-		va_start(ap, fmt);
-		vprintf(fmt, ap);
-	}
-
-}
-
 static void usage(void)
 {
        root_printf("Usage: multi_reflink_test [-i iteration] [-l file_size] "
 	       "[-p refcount_tree_pairs] [-n reflink_nums] <-w work_place> "
-	       "[-f] [-x] [-r] [-m] [-y] [-s] [-c] [-O] [-A]\n"
+	       "[-f] [-x] [-r] [-m] [-y] [-s] [-c] [-O] [-A] [-t seconds]\n"
 	       "iteration specify the running times.\n"
 	       "file_size specify the size of original file.\n"
 	       "reflink_nums specify the number of reflinks.\n"
@@ -131,7 +113,10 @@ static void usage(void)
 	       "-c specify the comprehensive test.here need 6 ranks at least.\n"
 	       "-O specify O_DIRECT test.\n"
 	       "-A specify asynchronous io test.\n"
-	       "-m specify the mmap test.\n");
+	       "-m specify the mmap test.\n"
+	       "-t specify the CoW storm test, every rank does random CoW "
+	       "writes,\n   truncates and xattr CoWs on reflinks of one "
+	       "refcount tree for seconds.\n");
 
 	MPI_Finalize();
 	exit(1);
@@ -143,7 +128,7 @@ int parse_opts(int argc, char **argv)
 	int c;
 
 	while (1) {
-		c = getopt(argc, argv, "I:i:w:OAfFrRmMyYcCsSW:n:N:l:L:p:P:x:X:");
+		c = getopt(argc, argv, "I:i:w:OAfFrRmMyYcCsSW:n:N:l:L:p:P:x:X:t:");
 		if (c == -1)
 			break;
 
@@ -203,6 +188,10 @@ int parse_opts(int argc, char **argv)
 		case 'S':
 			test_flags |= STRS_TEST;
 			break;
+		case 't':
+			test_flags |= STRM_TEST;
+			storm_secs = atol(optarg);
+			break;
 		default:
 			break;
 		}
@@ -211,16 +200,10 @@ int parse_opts(int argc, char **argv)
 	if (strcmp(workplace, "") == 0)
 		return EINVAL;
 
-	return 0;
-}
-
-static void MPI_Barrier_Sync(void)
-{
-	int ret;
+	if ((test_flags & STRM_TEST) && !storm_secs)
+		return EINVAL;
 
-	ret = MPI_Barrier(MPI_COMM_WORLD);
-	if (ret != MPI_SUCCESS)
-		abort_printf("MPI_Barrier failed: %d\n", ret);
+	return 0;
 }
 
 static void setup(int argc, char *argv[])
@@ -313,6 +296,7 @@ static void teardown(int ret)
 
 	if (ret == MPI_RET_SUCCESS) {
 
+		mpi_barrier_report(10);
 		MPI_Finalize();
 		exit(0);
 
@@ -343,6 +327,7 @@ static int basic_test(void)
 	unsigned long write_size = 0, read_size = 0;
 	unsigned long append_size = 0, truncate_size = 0;
 	unsigned long interval, offset = 0;
+	unsigned long long start;
 
 	write_buf = (char *)malloc(HUNK_SIZE * 2);
 	read_buf = (char *)malloc(HUNK_SIZE * 2);
@@ -397,6 +382,8 @@ static int basic_test(void)
 	root_printf("  *SubTest %d:Cowing reflinks among nodes.\n",
 		    sub_testno++);
 
+	mpi_lat_init(&lat);
+
 	if (rank) {
 
 		snprintf(dest, PATH_MAX, "%s-%s-%d", orig_path, hostname, rank);
@@ -412,6 +399,7 @@ static int basic_test(void)
 				write_size = file_size - offset;
 
 			get_rand_buf(write_buf, write_size);
+			start = mpi_lat_now();
 			if (test_flags & MMAP_TEST)
 				ret = mmap_write_at_file(dest, write_buf,
 							 write_size, offset);
@@ -422,6 +410,8 @@ static int basic_test(void)
 			if (ret)
 				goto bail_free;
 
+			mpi_lat_record(&lat, start, write_size);
+
 			if (test_flags & RAND_TEST)
 				offset += write_size + get_rand(1, interval);
 			else
@@ -429,8 +419,12 @@ static int basic_test(void)
 		}
 	}
 
+	mpi_lat_stop(&lat);
+
 	MPI_Barrier_Sync();
 
+	mpi_lat_report("CoW write", &lat);
+
 	if (!rank) {
 		ret = verify_orig_file(orig_path);
 		if (ret)
@@ -445,6 +439,8 @@ static int basic_test(void)
 	root_printf("  *SubTest %d:Reading reflinks among nodes.\n",
 		    sub_testno++);
 
+	mpi_lat_init(&lat);
+
 	if (rank) {
 
 		snprintf(dest, PATH_MAX, "%s-%s-%d", orig_path, hostname, rank);
@@ -459,6 +455,7 @@ static int basic_test(void)
 			if (offset + read_size > file_size)
 				read_size = file_size - offset;
 
+			start = mpi_lat_now();
 			if (test_flags & MMAP_TEST)
 				ret = mmap_read_at_file(dest, read_buf,
 							read_size, offset);
@@ -469,6 +466,8 @@ static int basic_test(void)
 			if (ret)
 				goto bail_free;
 
+			mpi_lat_record(&lat, start, read_size);
+
 			if (test_flags & RAND_TEST)
 				offset = offset + read_size +
 					 get_rand(1, interval);
@@ -478,8 +477,12 @@ static int basic_test(void)
 
 	}
 
+	mpi_lat_stop(&lat);
+
 	MPI_Barrier_Sync();
 
+	mpi_lat_report("Read", &lat);
+
 	if (!rank) {
 		ret = verify_orig_file(orig_path);
 		if (ret)
@@ -622,6 +625,7 @@ static int directio_test(void)
 	unsigned long write_size = 0, read_size = 0;
 	unsigned long append_size = 0, truncate_size = 0;
 	unsigned long interval, offset = 0;
+	unsigned long long start;
 
 	unsigned long align_slice = 512;
 	unsigned long align_filesz = align_slice;
@@ -674,6 +678,9 @@ static int directio_test(void)
 
 	root_printf("  *SubTest %d:Cowing reflinks by O_DIRECT writes among"
 		    " nodes.\n", sub_testno++);
+
+	mpi_lat_init(&lat);
+
 	if (rank) {
 
 		snprintf(dest, PATH_MAX, "%s-%s-%d", orig_path, hostname, rank);
@@ -689,22 +696,31 @@ static int directio_test(void)
 
 			get_rand_buf(dio_buf, write_size);
 
+			start = mpi_lat_now();
 			ret = write_at_file(dest, dio_buf, write_size, offset);
 
 			should_exit(ret);
 
+			mpi_lat_record(&lat, start, write_size);
+
 			offset += write_size + interval;
 		}
 	}
 
+	mpi_lat_stop(&lat);
+
 	MPI_Barrier_Sync();
 
+	mpi_lat_report("O_DIRECT CoW write", &lat);
+
 	/*
 	* All ranks try to read reflinks concurrently
 	*/
 	root_printf("  *SubTest %d:O_DIRECT reading reflinks among nodes.\n",
 		    sub_testno++);
 
+	mpi_lat_init(&lat);
+
 	if (rank) {
 
 		snprintf(dest, PATH_MAX, "%s-%s-%d", orig_path, hostname, rank);
@@ -718,17 +734,24 @@ static int directio_test(void)
 			if (offset + read_size > align_filesz)
 				read_size = align_filesz - offset;
 
+			start = mpi_lat_now();
 			ret = read_at_file(dest, dio_buf, read_size, offset);
 
 			should_exit(ret);
 
+			mpi_lat_record(&lat, start, read_size);
+
 			offset = offset + read_size + interval;
 		}
 
 	}
 
+	mpi_lat_stop(&lat);
+
 	MPI_Barrier_Sync();
 
+	mpi_lat_report("O_DIRECT read", &lat);
+
 	/*
 	* All ranks try to append reflinks concurrently
 	*/
@@ -1634,6 +1657,173 @@ bail:
 	return ret;
 }
 
+#define STORM_XATTRS		8
+#define STORM_XATTR_SZ		256
+
+enum {
+	STORM_WRITE = 0,
+	STORM_TRUNCATE,
+	STORM_XATTR,
+	STORM_REFLINK,
+	STORM_NR_OPS,
+};
+
+static int storm_xattr(char *path, char *value)
+{
+	int ret;
+	char name[32];
+
+	snprintf(name, sizeof(name), "user.storm%ld",
+		 get_rand(0, STORM_XATTRS - 1));
+	get_rand_buf(value, STORM_XATTR_SZ);
+
+	ret = setxattr(path, name, value, STORM_XATTR_SZ, 0);
+	if (ret < 0) {
+		ret = errno;
+		fprintf(stderr, "setxattr on %s failed:%d:%s\n", path, ret,
+			strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Every rank hammers its own reflinks of one original file for
+ * storm_secs, all of them sharing a single refcount tree.  Truncated
+ * reflinks lose their shared extents, the reflink op recreates one from
+ * the original so that the tree stays busy.
+ */
+static int storm_test(void)
+{
+	int ret = 0, op, sub_testno = 1;
+	unsigned long i, k, offset, write_size;
+	unsigned long long start, deadline;
+	char ref_pfx[PATH_MAX], *write_buf = NULL;
+	struct mpi_lat_hist hists[STORM_NR_OPS];
+	char *op_names[] = { "Storm CoW write", "Storm truncate",
+			     "Storm xattr CoW", "Storm reflink" };
+
+	write_buf = (char *)malloc(HUNK_SIZE);
+	if (!write_buf)
+		abort_printf("malloc failed.\n");
+
+	root_printf("Test %d: Multi-nodes CoW storm test.\n", testno++);
+
+	snprintf(orig_path, PATH_MAX, "%s/multi_original_storm_refile",
+		 workplace);
+	snprintf(ref_pfx, PATH_MAX, "%s_rank%d_", orig_path, rank);
+
+	root_printf("  *SubTest %d: Prep original inode with %d EAs.\n",
+		    sub_testno++, STORM_XATTRS);
+
+	if (!rank) {
+		ret = prep_orig_file(orig_path, file_size, 1);
+		should_exit(ret);
+
+		for (i = 0; i < STORM_XATTRS; i++) {
+			snprintf(ref_path, PATH_MAX, "user.storm%ld", i);
+			get_rand_buf(write_buf, STORM_XATTR_SZ);
+			ret = setxattr(orig_path, ref_path, write_buf,
+				       STORM_XATTR_SZ, 0);
+			if (ret < 0)
+				abort_printf("setxattr on %s failed:%d:%s\n",
+					     orig_path, errno,
+					     strerror(errno));
+		}
+	}
+
+	MPI_Barrier_Sync();
+
+	root_printf("  *SubTest %d: Do %ld reflinks on each rank.\n",
+		    sub_testno++, ref_counts);
+	ret = do_reflinks(orig_path, ref_pfx, ref_counts, 0);
+	should_exit(ret);
+
+	MPI_Barrier_Sync();
+
+	root_printf("  *SubTest %d: Storm for %lu seconds.\n", sub_testno++,
+		    storm_secs);
+
+	for (op = 0; op < STORM_NR_OPS; op++)
+		mpi_lat_init(&hists[op]);
+
+	deadline = mpi_lat_now() + storm_secs * 1000000000ULL;
+
+	while (mpi_lat_now() < deadline) {
+		k = get_rand(0, ref_counts - 1);
+		snprintf(ref_path, PATH_MAX, "%sr%ld", ref_pfx, k);
+		op = get_rand(0, STORM_NR_OPS - 1);
+		write_size = 0;
+
+		start = mpi_lat_now();
+
+		switch (op) {
+		case STORM_WRITE:
+			offset = get_rand(0, file_size - 1);
+			write_size = get_rand(1, HUNK_SIZE);
+			if (offset + write_size > file_size)
+				write_size = file_size - offset;
+			get_rand_buf(write_buf, write_size);
+			ret = write_at_file(ref_path, write_buf, write_size,
+					    offset);
+			break;
+		case STORM_TRUNCATE:
+			ret = truncate(ref_path, get_rand(0, file_size));
+			if (ret < 0) {
+				ret = errno;
+				fprintf(stderr, "truncate %s failed:%d:%s\n",
+					ref_path, ret, strerror(ret));
+				ret = -1;
+			}
+			break;
+		case STORM_XATTR:
+			ret = storm_xattr(ref_path, write_buf);
+			break;
+		case STORM_REFLINK:
+			ret = do_unlink(ref_path);
+			if (!ret)
+				ret = reflink(orig_path, ref_path, 1);
+			break;
+		}
+
+		if (ret)
+			abort_printf("storm %s on %s failed.\n", op_names[op],
+				     ref_path);
+
+		mpi_lat_record(&hists[op], start, write_size);
+	}
+
+	for (op = 0; op < STORM_NR_OPS; op++)
+		mpi_lat_stop(&hists[op]);
+
+	MPI_Barrier_Sync();
+
+	for (op = 0; op < STORM_NR_OPS; op++)
+		mpi_lat_report(op_names[op], &hists[op]);
+
+	root_printf("  *SubTest %d: Verify original inode and unlink "
+		    "reflinks.\n", sub_testno++);
+
+	ret = do_unlinks(ref_pfx, ref_counts);
+	should_exit(ret);
+
+	MPI_Barrier_Sync();
+
+	if (!rank) {
+		ret = verify_orig_file(orig_path);
+		should_exit(ret);
+		ret = do_unlink(orig_path);
+		should_exit(ret);
+	}
+
+	MPI_Barrier_Sync();
+
+	free(write_buf);
+
+	return 0;
+}
+
 static int dest_test(void)
 {
 	int ret;
@@ -1730,6 +1920,9 @@ static void run_test(void)
 
 		if (test_flags & COMP_TEST)
 			comp_test();
+
+		if (test_flags & STRM_TEST)
+			storm_test();
 	}
 }
 
@@ -54,6 +54,9 @@ static char dest_log_path[PATH_MAX];
 
 static char lsnr_addr[HOSTNAME_LEN];
 
+static char bench_report[PATH_MAX];
+static FILE *bench_fp;
+
 static int iteration = 1;
 static int testno = 1;
 static unsigned long port = 9999;
@@ -62,6 +65,7 @@ static unsigned long ref_counts = 10;
 static unsigned long ref_trees = 10;
 static unsigned long child_nums = 10;
 static unsigned long hole_nums = 100;
+static unsigned long fanout_threads;
 
 static pid_t *child_pid_list;
 
@@ -108,7 +112,8 @@ static void usage(void)
 	printf("Usage: reflink_tests [-i iteration] <-n ref_counts> "
 	       "<-p refcount_tree_pairs> <-l file_size> <-d disk> "
 	       "<-w workplace> -f -b [-c conc_procs] -m -s -r [-x xattr_nums]"
-	       " [-h holes_num] [-o holes_filling_log] -O -A -D <child_nums> -I -H -T\n\n"
+	       " [-h holes_num] [-o holes_filling_log] -O -A -D <child_nums> -I -H -T"
+	       " -E [-e bench_report] [-j threads] -k\n\n"
 	       "-f enable basic feature test.\n"
 	       "-b enable boundary test.\n"
 	       "-c enable concurrent tests with conc_procs processes.\n"
@@ -119,9 +124,18 @@ static void usage(void)
 	       "-A enable asynchronous io test.\n"
 	       "-D enable destructive test.\n"
 	       "-v enable verification for destructive test.\n"
+	       "-k log binary records in destructive test, verification "
+	       "detects\n   the log format by itself.\n"
 	       "-H enable CoW verification test for punching holes.\n"
 	       "-T enable CoW verification test for truncating.\n"
 	       "-I enable inline-data test.\n"
+	       "-j enable parallel reflink fan-out test with up to threads "
+	       "threads.\n"
+	       "-e enable reflink/CoW benchmark, results are written to "
+	       "bench_report\n   as one tab separated key=value record "
+	       "per line.\n"
+	       "-E verify reflinks in basic test, extents still shared "
+	       "with the\n   original (per fiemap) are only spot-checked.\n"
 	       "-x enable combination test with xattr.\n"
 	       "-h enable holes punching and filling tests.\n"
 	       "-o specify logfile for holes filling tests,it takes effect"
@@ -144,8 +158,8 @@ static int parse_opts(int argc, char **argv)
 
 	while (1) {
 		c = getopt(argc, argv,
-			   "i:d:w:IOAfFbBsSrRHTmMW:n:N:"
-			   "l:L:c:C:p:x:X:h:o:v:a:P:D:");
+			   "i:d:w:IOAEkfFbBsSrRHTmMW:n:N:"
+			   "l:L:c:C:p:x:X:h:o:v:a:P:D:e:j:");
 		if (c == -1)
 			break;
 
@@ -173,6 +187,20 @@ static int parse_opts(int argc, char **argv)
 		case 'A':
 			test_flags |= ASIO_TEST;
 			break;
+		case 'E':
+			test_flags |= FMAP_TEST;
+			break;
+		case 'k':
+			test_flags |= BLOG_TEST;
+			break;
+		case 'e':
+			test_flags |= BNCH_TEST;
+			strcpy(bench_report, optarg);
+			break;
+		case 'j':
+			test_flags |= FANO_TEST;
+			fanout_threads = strtoul(optarg, NULL, 0);
+			break;
 		case 'D':
 			test_flags |= DSCV_TEST;
 			child_nums = atol(optarg);
@@ -253,6 +281,9 @@ static int parse_opts(int argc, char **argv)
 		if (strcmp(lsnr_addr, "") == 0)
 			return EINVAL;
 
+	if ((test_flags & FANO_TEST) && !fanout_threads)
+		return EINVAL;
+
 	return 0;
 }
 
@@ -368,6 +399,13 @@ static int basic_test()
 		       ref_counts);
 		ret = do_reflinks(orig_path, orig_path, ref_counts, 0);
 		should_exit(ret);
+		if (test_flags & FMAP_TEST) {
+			printf("  *SubTest %d: Verify %ld reflinks.\n",
+			       sub_testno++, ref_counts);
+			ret = verify_reflinks(orig_path, orig_path,
+					      ref_counts);
+			should_exit(ret);
+		}
 		printf("  *SubTest %d: Read %ld reflinks.\n", sub_testno++,
 		       ref_counts);
 		ret = do_reads_on_reflinks(orig_path, ref_counts, file_size,
@@ -1914,6 +1952,7 @@ static int destructive_test(void)
 	int o_flags_rw, o_flags_ro, sockfd, i, j, status;
 	int ret, o_ret, fd, rc, sub_testno = 1;
 	char log_rec[1024], dest[PATH_MAX];
+	struct dest_log_rec rec;
 
 	struct dest_write_unit dwu;
 
@@ -2025,7 +2064,18 @@ static int destructive_test(void)
 				ret = do_write_chunk(fd, &dwu);
 				if (ret)
 					goto child_bail;
-				write(sockfd, log_rec, strlen(log_rec) + 1);
+				if (test_flags & BLOG_TEST) {
+					memset(&rec, 0, sizeof(rec));
+					rec.r_magic = DEST_LOG_MAGIC;
+					rec.r_type = DEST_LOG_CHUNK;
+					rec.r_char = dwu.d_char;
+					rec.r_checksum = dwu.d_checksum;
+					rec.r_chunk_no = dwu.d_chunk_no;
+					rec.r_timestamp = dwu.d_timestamp;
+					write(sockfd, &rec, sizeof(rec));
+				} else
+					write(sockfd, log_rec,
+					      strlen(log_rec) + 1);
 
 				if (semaphore_v(sem_id) < 0) {
 					ret = -1;
@@ -2049,8 +2099,16 @@ static int destructive_test(void)
 					ret = reflink(orig_path, dest, 1);
 					if (ret)
 						goto child_bail;
-					write(sockfd, log_rec,
-					      strlen(log_rec) + 1);
+					if (test_flags & BLOG_TEST) {
+						memset(&rec, 0, sizeof(rec));
+						rec.r_magic = DEST_LOG_MAGIC;
+						rec.r_type = DEST_LOG_REFLINK;
+						rec.r_pid = getpid();
+						rec.r_chunk_no = j;
+						write(sockfd, &rec, sizeof(rec));
+					} else
+						write(sockfd, log_rec,
+						      strlen(log_rec) + 1);
 					
 					if (semaphore_v(sem_id) < 0) {
 						ret = -1;
@@ -2611,6 +2669,432 @@ bail:
 	return ret;
 }
 
+/*
+ * Creates ref_counts reflinks with 1, 2, 4 ... fanout_threads threads
+ * for each topology, contention is the average reflink latency against
+ * the one of a single thread.
+ */
+static int fanout_test(void)
+{
+	int ret, manner;
+	int sub_testno = 1;
+	unsigned long threads, next;
+	double base_us;
+	struct fanout_stat stat;
+	char *manners[] = { "star", "chain", "random" };
+
+	printf("Test %d: Parallel reflink fan-out test.\n", testno++);
+
+	snprintf(orig_path, PATH_MAX, "%s/original_fanout_refile", workplace);
+
+	printf("  *SubTest %d: Prepare file.\n", sub_testno++);
+	ret = prep_orig_file(orig_path, file_size, 0);
+	should_exit(ret);
+
+	for (manner = 0; manner < 3; manner++) {
+		printf("  *SubTest %d: Do %ld reflinks in %s.\n", sub_testno++,
+		       ref_counts, manners[manner]);
+		printf("  %8s %12s %10s %10s %10s\n", "threads", "reflinks/s",
+		       "avg_us", "max_us", "contention");
+
+		base_us = 0;
+		for (threads = 1; threads; threads = next) {
+			ret = do_reflinks_threaded(orig_path, orig_path,
+						   ref_counts, manner, threads,
+						   &stat);
+			should_exit(ret);
+
+			if (!base_us)
+				base_us = stat.f_avg_us ? stat.f_avg_us : 1;
+
+			printf("  %8lu %12.1f %10.1f %10llu %10.2f\n", threads,
+			       stat.f_rate, stat.f_avg_us, stat.f_max_us,
+			       stat.f_avg_us / base_us);
+
+			ret = do_unlinks(orig_path, ref_counts);
+			should_exit(ret);
+
+			/* the last step runs fanout_threads, powers of 2 or not */
+			next = threads * 2;
+			if (threads >= fanout_threads)
+				next = 0;
+			else if (next > fanout_threads)
+				next = fanout_threads;
+		}
+
+		ret = verify_orig_file(orig_path);
+		should_exit(ret);
+	}
+
+	printf("  *SubTest %d: Unlink original file.\n", sub_testno++);
+	ret = do_unlink(orig_path);
+	should_exit(ret);
+
+	return 0;
+}
+
+/*
+ * Latency samples of one benchmark run, reported as percentiles.
+ */
+struct bench_lat {
+	unsigned long bl_nr;
+	unsigned long bl_max;
+	unsigned long long *bl_us;
+};
+
+static int bench_lat_init(struct bench_lat *bl, unsigned long max)
+{
+	bl->bl_nr = 0;
+	bl->bl_max = max;
+	bl->bl_us = malloc(sizeof(unsigned long long) * max);
+	if (!bl->bl_us) {
+		fprintf(stderr, "malloc failed.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void bench_lat_add(struct bench_lat *bl, unsigned long long us)
+{
+	if (bl->bl_nr < bl->bl_max)
+		bl->bl_us[bl->bl_nr++] = us;
+}
+
+static int bench_cmp_us(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Emits one record, params is a tab separated list of key=value */
+static void bench_lat_report(const char *test, const char *params,
+			     struct bench_lat *bl)
+{
+	unsigned long i;
+	unsigned long long sum = 0;
+	char line[512];
+
+	if (!bl->bl_nr)
+		return;
+
+	qsort(bl->bl_us, bl->bl_nr, sizeof(unsigned long long),
+	      bench_cmp_us);
+
+	for (i = 0; i < bl->bl_nr; i++)
+		sum += bl->bl_us[i];
+
+	snprintf(line, sizeof(line), "test=%s\t%s\tcount=%lu\tavg_us=%.1f\t"
+		 "min_us=%llu\tp50_us=%llu\tp99_us=%llu\tmax_us=%llu",
+		 test, params, bl->bl_nr, (double)sum / bl->bl_nr,
+		 bl->bl_us[0], bl->bl_us[bl->bl_nr / 2],
+		 bl->bl_us[bl->bl_nr * 99 / 100], bl->bl_us[bl->bl_nr - 1]);
+
+	printf("    %s\n", line);
+	fprintf(bench_fp, "%s\n", line);
+
+	bl->bl_nr = 0;
+}
+
+/*
+ * Reflink creation latency against the number of extents of the source
+ * and against the number of reflinks already sharing its refcount tree,
+ * bucketed by powers of two.
+ */
+static int bench_reflink_create(void)
+{
+	int ret = 0;
+	unsigned long nr_extents, i, depth;
+	unsigned long long start;
+	char dest[PATH_MAX], params[128];
+	struct bench_lat bl;
+
+	ret = bench_lat_init(&bl, ref_counts);
+	if (ret)
+		return ret;
+
+	snprintf(orig_path, PATH_MAX, "%s/original_bench_create_refile",
+		 workplace);
+
+	for (nr_extents = 1; nr_extents * clustersize <= file_size;
+	     nr_extents *= 4) {
+		fill_pattern(clustersize);
+		ret = prep_orig_file_with_pattern(orig_path,
+						  nr_extents * clustersize,
+						  clustersize, orig_pattern,
+						  nr_extents == 1);
+		if (ret)
+			goto bail;
+		sync();
+
+		for (i = 0, depth = 1; i < ref_counts; i++) {
+			snprintf(dest, PATH_MAX, "%sr%ld", orig_path, i);
+
+			start = get_time_microseconds();
+			ret = reflink(orig_path, dest, 1);
+			if (ret)
+				goto bail;
+			bench_lat_add(&bl, get_time_microseconds() - start);
+
+			/* report the bucket [depth, 2 * depth) when full */
+			if (i + 1 == 2 * depth - 1 || i + 1 == ref_counts) {
+				snprintf(params, sizeof(params),
+					 "extents=%lu\tsharers_min=%lu\t"
+					 "sharers_max=%lu", nr_extents,
+					 depth, i + 1);
+				bench_lat_report("reflink_create", params,
+						 &bl);
+				depth *= 2;
+			}
+		}
+
+		ret = do_unlinks(orig_path, ref_counts);
+		if (ret)
+			goto bail;
+
+		ret = do_unlink(orig_path);
+		if (ret)
+			goto bail;
+	}
+
+bail:
+	free(bl.bl_us);
+
+	return ret;
+}
+
+/*
+ * First write to each cluster of a reflink pays for the CoW, the
+ * rewrite of the same block is the baseline without CoW.
+ */
+static int bench_first_write_cow(char *buf)
+{
+	int ret = 0, fd = -1, pass;
+	unsigned long nr_clusters, i;
+	unsigned long long start;
+	char dest[PATH_MAX], params[128];
+	struct bench_lat bl;
+
+	nr_clusters = file_size / clustersize;
+	if (!nr_clusters)
+		return 0;
+
+	ret = bench_lat_init(&bl, nr_clusters);
+	if (ret)
+		return ret;
+
+	snprintf(orig_path, PATH_MAX, "%s/original_bench_cow_refile",
+		 workplace);
+	snprintf(dest, PATH_MAX, "%sr0", orig_path);
+
+	ret = prep_orig_file(orig_path, file_size, 1);
+	if (ret)
+		goto bail;
+
+	ret = reflink(orig_path, dest, 1);
+	if (ret)
+		goto bail;
+	sync();
+
+	fd = open64(dest, open_rw_flags);
+	if (fd < 0) {
+		ret = errno;
+		fprintf(stderr, "open file %s failed:%d:%s\n", dest, ret,
+			strerror(ret));
+		ret = -1;
+		goto bail;
+	}
+
+	get_rand_buf(buf, blocksize);
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < nr_clusters; i++) {
+			start = get_time_microseconds();
+			ret = write_at(fd, buf, blocksize, i * clustersize);
+			if (ret < 0)
+				goto bail;
+			bench_lat_add(&bl, get_time_microseconds() - start);
+		}
+
+		snprintf(params, sizeof(params), "clustersize=%lu\t"
+			 "blocksize=%u\tio=%s", clustersize, blocksize,
+			 (open_rw_flags & O_DIRECT) ? "direct" : "buffered");
+		bench_lat_report(pass ? "rewrite" : "first_write_cow",
+				 params, &bl);
+	}
+
+	close(fd);
+	fd = -1;
+
+	ret = do_unlink(dest);
+	if (ret)
+		goto bail;
+
+	ret = do_unlink(orig_path);
+
+bail:
+	if (fd >= 0)
+		close(fd);
+	free(bl.bl_us);
+
+	return ret;
+}
+
+/* Overwrites the whole file once, including the fsync */
+static int bench_overwrite(char *path, char *buf, double *mbps)
+{
+	int ret, fd;
+	unsigned long offset, write_size;
+	unsigned long long start, elapsed;
+
+	fd = open64(path, open_rw_flags);
+	if (fd < 0) {
+		ret = errno;
+		fprintf(stderr, "open file %s failed:%d:%s\n", path, ret,
+			strerror(ret));
+		return -1;
+	}
+
+	start = get_time_microseconds();
+
+	for (offset = 0; offset < file_size; offset += write_size) {
+		write_size = HUNK_SIZE;
+		if (offset + write_size > file_size)
+			write_size = file_size - offset;
+
+		ret = write_at(fd, buf, write_size, offset);
+		if (ret < 0)
+			goto bail;
+	}
+
+	ret = fsync(fd);
+	if (ret < 0) {
+		ret = errno;
+		fprintf(stderr, "fsync failed:%d:%s\n", ret, strerror(ret));
+		ret = -1;
+		goto bail;
+	}
+
+	elapsed = get_time_microseconds() - start;
+	if (!elapsed)
+		elapsed = 1;
+	*mbps = (double)file_size / M_SIZE * 1000000 / elapsed;
+bail:
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Sustained write throughput on a reflink shared ref_counts times,
+ * against the same reflink once private and a file never shared.
+ */
+static int bench_shared_throughput(char *buf)
+{
+	int ret, i;
+	double mbps;
+	char dest[PATH_MAX], private[PATH_MAX], line[256];
+	char *names[] = { "shared", "unshared", "private" };
+	char *paths[] = { dest, dest, private };
+
+	snprintf(orig_path, PATH_MAX, "%s/original_bench_tput_refile",
+		 workplace);
+	snprintf(dest, PATH_MAX, "%sr0", orig_path);
+	snprintf(private, PATH_MAX, "%s_private", orig_path);
+
+	ret = prep_orig_file(orig_path, file_size, 1);
+	if (ret)
+		return ret;
+
+	ret = prep_orig_file(private, file_size, 1);
+	if (ret)
+		return ret;
+
+	ret = do_reflinks(orig_path, orig_path, ref_counts, 0);
+	if (ret)
+		return ret;
+	sync();
+
+	get_rand_buf(buf, HUNK_SIZE);
+
+	for (i = 0; i < 3; i++) {
+		ret = bench_overwrite(paths[i], buf, &mbps);
+		if (ret)
+			return ret;
+
+		snprintf(line, sizeof(line), "test=write_throughput\t"
+			 "file=%s\tsharers=%lu\tsize=%lu\tmb_per_s=%.2f",
+			 names[i], i ? 0 : ref_counts, file_size, mbps);
+		printf("    %s\n", line);
+		fprintf(bench_fp, "%s\n", line);
+	}
+
+	ret = do_unlinks(orig_path, ref_counts);
+	if (ret)
+		return ret;
+
+	ret = do_unlink(private);
+	if (ret)
+		return ret;
+
+	return do_unlink(orig_path);
+}
+
+static int bench_test(void)
+{
+	int ret;
+	int sub_testno = 1;
+	char *buf = NULL;
+
+	printf("Test %d: Reflink and CoW benchmark.\n", testno++);
+
+	bench_fp = fopen(bench_report, "w");
+	if (!bench_fp) {
+		ret = errno;
+		fprintf(stderr, "open file %s failed:%d:%s\n", bench_report,
+			ret, strerror(ret));
+		should_exit(-1);
+	}
+
+	fprintf(bench_fp, "test=config\tblocksize=%u\tclustersize=%lu\t"
+		"file_size=%lu\tref_counts=%lu\n", blocksize, clustersize,
+		file_size, ref_counts);
+
+	ret = posix_memalign((void **)&buf, DIRECTIO_SLICE, HUNK_SIZE);
+	if (ret) {
+		fprintf(stderr, "malloc failed.\n");
+		ret = -1;
+		goto bail;
+	}
+
+	printf("  *SubTest %d: Reflink creation latency.\n", sub_testno++);
+	ret = bench_reflink_create();
+	if (ret)
+		goto bail;
+
+	printf("  *SubTest %d: First write CoW latency.\n", sub_testno++);
+	ret = bench_first_write_cow(buf);
+	if (ret)
+		goto bail;
+
+	printf("  *SubTest %d: Write throughput on shared and private "
+	       "files.\n", sub_testno++);
+	ret = bench_shared_throughput(buf);
+
+bail:
+	if (buf)
+		free(buf);
+
+	fclose(bench_fp);
+	bench_fp = NULL;
+
+	should_exit(ret ? -1 : 0);
+
+	return 0;
+}
+
 static void run_test(void)
 {
 	int i;
@@ -2661,6 +3145,12 @@ static void run_test(void)
 		if (test_flags & TRUC_TEST)
 			verify_truncate_cow_test();
 
+		if (test_flags & FANO_TEST)
+			fanout_test();
+
+		if (test_flags & BNCH_TEST)
+			bench_test();
+
 	}
 }
 
@@ -35,10 +35,13 @@
 #include <linux/types.h>
 #include <sys/time.h>
 #include <sys/sem.h>
+#include <pthread.h>
+#include <linux/fiemap.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 #include <getopt.h>
 
@@ -49,7 +52,7 @@
 
 #include <ocfs2/ocfs2.h>
 #include <ocfs2/byteorder.h>
-#include "crc32table.h"
+#include "crc32.h"
 
 #include "aio.h"
 
@@ -86,6 +89,11 @@
 #define PUNH_TEST		0x00004000
 #define TRUC_TEST		0x00008000
 #define ASIO_TEST		0x00010000
+#define FMAP_TEST		0x00020000
+#define BNCH_TEST		0x00040000
+#define FANO_TEST		0x00080000
+#define STRM_TEST		0x00100000
+#define BLOG_TEST		0x00200000
 
 #define MPI_RET_SUCCESS		0
 #define MPI_RET_FAILED		1
@@ -97,6 +105,10 @@
 #define CHUNK_SIZE	(1024*8)
 #define HOSTNAME_LEN	256
 
+#ifndef FS_IOC_FIEMAP
+#define FS_IOC_FIEMAP		_IOWR('f', 11, struct fiemap)
+#endif
+
 struct write_unit {
 	char w_char;
 	unsigned long w_offset;
@@ -110,9 +122,45 @@ struct dest_write_unit{
 	char d_char;
 };
 
-struct dest_logs {
-	char filename[PATH_MAX];
-	unsigned long index;
+/*
+ * Binary record of the destructive test log, in host byte order.  A
+ * reflink record names the reflink the child made as
+ * "<orig>_target_<r_pid>_<r_chunk_no>".
+ */
+#define DEST_LOG_MAGIC		0x52464c47	/* "RFLG" */
+#define DEST_LOG_CHUNK		1
+#define DEST_LOG_REFLINK	2
+
+struct dest_log_rec {
+	uint32_t r_magic;
+	uint8_t r_type;
+	char r_char;
+	uint16_t r_pad;
+	uint32_t r_checksum;
+	uint32_t r_pid;
+	uint64_t r_chunk_no;
+	uint64_t r_timestamp;
+};
+
+/*
+ * Gathered by verify_reflink_pair() with FMAP_TEST, extents still
+ * pointing at the same clusters in both files are only spot-checked.
+ */
+struct share_stat {
+	unsigned long s_pairs;
+	unsigned long s_shared_extents;
+	unsigned long s_unshared_extents;
+	unsigned long long s_shared_bytes;
+	unsigned long long s_unshared_bytes;
+	unsigned long long s_hole_bytes;
+	unsigned long long s_read_bytes;
+};
+
+/* Result of do_reflinks_threaded() */
+struct fanout_stat {
+	double f_rate;
+	double f_avg_us;
+	unsigned long long f_max_us;
 };
 
 union semun {
@@ -148,8 +196,13 @@ int verify_orig_file(char *orig);
 
 int reflink(const char *oldpath, const char *newpath, unsigned long preserve);
 int verify_reflink_pair(const char *src, const char *dest);
+int verify_reflinks(const char *src, const char *dest_prefix,
+		    unsigned long iter);
 int do_reflinks(const char *src, const char *dest_prefix, unsigned long iter,
 		int manner);
+int do_reflinks_threaded(const char *src, const char *dest_prefix,
+			 unsigned long iter, int manner, unsigned long threads,
+			 struct fanout_stat *stat);
 int do_reflinks_at_random(const char *src, const char *dest_prefix,
 			  unsigned long iter);
 int do_reads_on_reflinks(char *ref_pfx, unsigned long iter, unsigned long size,
@@ -181,10 +234,7 @@ int do_write_chunk(int fd, struct dest_write_unit *dwu);
 int do_write_chunk_file(char *fname, struct dest_write_unit *du);
 */
 int init_sock(char *serv, int port);
-long get_verify_logs_num(char *log);
-int verify_dest_file(char *log, struct dest_logs d_log, unsigned long chunk_no);
 int verify_dest_files(char *log, char *orig, unsigned long chunk_no);
-uint32_t crc32_checksum(uint32_t crc, char *p, size_t len);
 
 /* Add utils for semaphore ops */
 int set_semvalue(int sem_id, int val);
@@ -43,54 +43,6 @@ extern char *prog;
 static char buf_dio[DIRECTIO_SLICE] __attribute__ ((aligned(DIRECTIO_SLICE)));
 static char chunk_pattern[CHUNK_SIZE] __attribute__ ((aligned(DIRECTIO_SLICE)));
 
-uint32_t crc32_checksum(uint32_t crc, char *p, size_t len)
-{
-	const uint32_t      *b = (uint32_t *)p;
-	const uint32_t      *tab = crc32table_le;
-
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-# define DO_CRC(x) crc = tab[(crc ^ (x)) & 255] ^ (crc >> 8)
-#else
-# define DO_CRC(x) crc = tab[((crc >> 24) ^ (x)) & 255] ^ (crc << 8)
-#endif
-
-	crc = cpu_to_le32(crc);
-	/* Align it */
-	if (((long)b)&3 && len) {
-		do {
-			uint8_t *p = (uint8_t *)b;
-			DO_CRC(*p++);
-			b = (void *)p;
-		} while ((--len) && ((long)b)&3);
-	}
-	if (len >= 4) {
-		/* load data 32 bits wide, xor data 32 bits wide. */
-		size_t save_len = len & 3;
-		len = len >> 2;
-		--b; /* use pre increment below(*++b) for speed */
-		do {
-			crc ^= *++b;
-			DO_CRC(0);
-			DO_CRC(0);
-			DO_CRC(0);
-			DO_CRC(0);
-		} while (--len);
-		b++; /* point to next byte(s) */
-		len = save_len;
-	}
-	/* And the last few bytes */
-	if (len) {
-		do {
-			uint8_t *p = (uint8_t *)b;
-			DO_CRC(*p++);
-			b = (void *)p;
-		} while (--len);
-	}
-
-	return le32_to_cpu(crc);
-#undef DO_CRC
-}
-
 unsigned long get_rand(unsigned long min, unsigned long max)
 {
 	if (min == 0 && max == 0)
@@ -770,14 +722,245 @@ int prep_orig_file_in_chunks(char *file_name, unsigned long chunks)
 	return 0;
 }
 
+#define FIEMAP_BATCH		256
+#define SPOT_CHECK_SIZE		4096
+
+static struct share_stat share_stat;
+
+/* Maps the whole file, *extents is allocated and grown as needed */
+static int get_fiemap(int fd, struct fiemap_extent **extents,
+		      unsigned long *nr_extents)
+{
+	int ret, last = 0;
+	unsigned long nr = 0, max = 0;
+	unsigned int i;
+	struct fiemap *fm;
+	struct fiemap_extent *fe = NULL, *tmp;
+
+	fm = malloc(sizeof(struct fiemap) +
+		    FIEMAP_BATCH * sizeof(struct fiemap_extent));
+	if (!fm) {
+		fprintf(stderr, "malloc failed.\n");
+		return -1;
+	}
+
+	memset(fm, 0, sizeof(struct fiemap));
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_flags = FIEMAP_FLAG_SYNC;
+
+	while (!last) {
+		fm->fm_extent_count = FIEMAP_BATCH;
+		fm->fm_mapped_extents = 0;
+
+		ret = ioctl(fd, FS_IOC_FIEMAP, fm);
+		if (ret < 0) {
+			ret = errno;
+			if (ret != EOPNOTSUPP && ret != ENOTTY)
+				fprintf(stderr, "fiemap failed:%d:%s\n", ret,
+					strerror(ret));
+			ret = -ret;
+			goto bail;
+		}
+
+		if (!fm->fm_mapped_extents)
+			break;
+
+		if (nr + fm->fm_mapped_extents > max) {
+			max = (nr + fm->fm_mapped_extents) * 2;
+			tmp = realloc(fe, max * sizeof(struct fiemap_extent));
+			if (!tmp) {
+				fprintf(stderr, "malloc failed.\n");
+				ret = -1;
+				goto bail;
+			}
+			fe = tmp;
+		}
+
+		for (i = 0; i < fm->fm_mapped_extents; i++) {
+			fe[nr++] = fm->fm_extents[i];
+			if (fm->fm_extents[i].fe_flags & FIEMAP_EXTENT_LAST)
+				last = 1;
+		}
+
+		tmp = &fm->fm_extents[fm->fm_mapped_extents - 1];
+		fm->fm_start = tmp->fe_logical + tmp->fe_length;
+	}
+
+	*extents = fe;
+	*nr_extents = nr;
+	fe = NULL;
+	ret = 0;
+bail:
+	free(fe);
+	free(fm);
+
+	return ret;
+}
+
+static int compare_range(int fds, int fdd, char *bufs, char *bufd,
+			 unsigned long long offset, unsigned long long len)
+{
+	int ret;
+	unsigned long count;
+
+	while (len) {
+		count = len > HUNK_SIZE ? HUNK_SIZE : len;
+
+		ret = read_at(fds, bufs, count, offset);
+		if (ret < 0)
+			return ret;
+
+		ret = read_at(fdd, bufd, count, offset);
+		if (ret < 0)
+			return ret;
+
+		if (memcmp(bufs, bufd, count)) {
+			fprintf(stderr, "data readed are different in [%llu, "
+				"%llu)\n", offset, offset + count);
+			return 1;
+		}
+
+		share_stat.s_read_bytes += count;
+		offset += count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the end of the run starting at pos: the end of the extent
+ * covering pos, or the start of the next one if pos is in a hole.
+ */
+static unsigned long long extent_boundary(struct fiemap_extent *fe,
+					  unsigned long nr, unsigned long *i,
+					  unsigned long long pos)
+{
+	while (*i < nr && fe[*i].fe_logical + fe[*i].fe_length <= pos)
+		(*i)++;
+
+	if (*i == nr)
+		return ULLONG_MAX;
+
+	if (fe[*i].fe_logical > pos)
+		return fe[*i].fe_logical;
+
+	return fe[*i].fe_logical + fe[*i].fe_length;
+}
+
+static int extent_shared(struct fiemap_extent *fs, struct fiemap_extent *fd,
+			 unsigned long long pos)
+{
+	unsigned int mask = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+			    FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_INLINE |
+			    FIEMAP_EXTENT_NOT_ALIGNED;
+
+	if (fs->fe_logical > pos || fd->fe_logical > pos)
+		return 0;
+
+	if ((fs->fe_flags | fd->fe_flags) & mask)
+		return 0;
+
+	if ((fs->fe_flags ^ fd->fe_flags) & FIEMAP_EXTENT_UNWRITTEN)
+		return 0;
+
+	return fs->fe_physical - fs->fe_logical ==
+	       fd->fe_physical - fd->fe_logical;
+}
+
+/*
+ * Walks the extent maps of both files side by side, ranges backed by
+ * the same clusters in both are only spot-checked and holes in both
+ * are skipped, everything else (CoW-ed extents) is compared in full.
+ */
+static int verify_reflink_pair_fiemap(int fds, int fdd, char *bufs,
+				      char *bufd)
+{
+	int ret;
+	unsigned long nrs, nrd, is = 0, id = 0;
+	unsigned long long pos = 0, end, bs, bd, size;
+	struct fiemap_extent *fes = NULL, *fed = NULL;
+	struct stat st;
+
+	ret = fstat(fds, &st);
+	if (ret < 0) {
+		ret = errno;
+		fprintf(stderr, "stat failed:%d:%s\n", ret, strerror(ret));
+		return -1;
+	}
+	size = st.st_size;
+
+	ret = fstat(fdd, &st);
+	if (ret < 0) {
+		ret = errno;
+		fprintf(stderr, "stat failed:%d:%s\n", ret, strerror(ret));
+		return -1;
+	}
+
+	if (size != st.st_size) {
+		fprintf(stderr, "data readed are not in the same size\n");
+		return 1;
+	}
+
+	ret = get_fiemap(fds, &fes, &nrs);
+	if (ret)
+		return ret;
+
+	ret = get_fiemap(fdd, &fed, &nrd);
+	if (ret)
+		goto bail;
+
+	while (pos < size) {
+		bs = extent_boundary(fes, nrs, &is, pos);
+		bd = extent_boundary(fed, nrd, &id, pos);
+		end = bs < bd ? bs : bd;
+		if (end > size)
+			end = size;
+
+		if ((is == nrs || fes[is].fe_logical > pos) &&
+		    (id == nrd || fed[id].fe_logical > pos)) {
+			share_stat.s_hole_bytes += end - pos;
+			ret = 0;
+		} else if (is < nrs && id < nrd &&
+			   extent_shared(&fes[is], &fed[id], pos)) {
+			share_stat.s_shared_extents++;
+			share_stat.s_shared_bytes += end - pos;
+			ret = compare_range(fds, fdd, bufs, bufd, pos,
+					    end - pos > SPOT_CHECK_SIZE ?
+					    SPOT_CHECK_SIZE : end - pos);
+		} else {
+			share_stat.s_unshared_extents++;
+			share_stat.s_unshared_bytes += end - pos;
+			ret = compare_range(fds, fdd, bufs, bufd, pos,
+					    end - pos);
+		}
+
+		if (ret)
+			goto bail;
+
+		pos = end;
+	}
+
+	share_stat.s_pairs++;
+bail:
+	free(fes);
+	free(fed);
+
+	return ret;
+}
+
 int verify_reflink_pair(const char *src, const char *dest)
 {
 	int fds = -1, fdd = -1, ret = 0;
 	char *bufs = NULL, *bufd = NULL;
 	unsigned long reads, readd;
 
-	bufs = (char *)malloc(HUNK_SIZE);
-	bufd = (char *)malloc(HUNK_SIZE);
+	if (posix_memalign((void **)&bufs, DIRECTIO_SLICE, HUNK_SIZE) ||
+	    posix_memalign((void **)&bufd, DIRECTIO_SLICE, HUNK_SIZE)) {
+		fprintf(stderr, "malloc failed.\n");
+		ret = -1;
+		goto bail;
+	}
 
 	fds = open64(src, open_ro_flags);
 	if (fds < 0) {
@@ -797,6 +980,17 @@ int verify_reflink_pair(const char *src, const char *dest)
 		goto bail;
 	}
 
+	if (test_flags & FMAP_TEST) {
+		ret = verify_reflink_pair_fiemap(fds, fdd, bufs, bufd);
+		if (ret != -EOPNOTSUPP && ret != -ENOTTY)
+			goto bail;
+
+		fprintf(stderr, "fiemap is not supported, falling back to "
+			"full comparison\n");
+		test_flags &= ~FMAP_TEST;
+		ret = 0;
+	}
+
 	while ((reads = read(fds, bufs, HUNK_SIZE)) &&
 	       (readd = read(fdd, bufd, HUNK_SIZE))) {
 
@@ -830,35 +1024,173 @@ bail:
 	return ret;
 }
 
-int verify_pattern(char *buf, unsigned long offset, unsigned long size)
+/*
+ * Verifies the reflinks made by do_reflinks() against src, reporting
+ * how much of them is still shared when FMAP_TEST is set.
+ */
+int verify_reflinks(const char *src, const char *dest_prefix,
+		    unsigned long iter)
 {
+	int ret;
 	unsigned long i;
+	unsigned long long start, elapsed, total;
+	char dest[PATH_MAX];
 
-	char *start = orig_pattern + offset;
+	memset(&share_stat, 0, sizeof(share_stat));
+	start = get_time_microseconds();
 
-	for (i = 0; i < size; i++) {
-		if (buf[i] != start[i]) {
-			fprintf(stderr, "original file verify failed at byte: "
-				"%ld\n", i);
+	for (i = 0; i < iter; i++) {
+		snprintf(dest, PATH_MAX, "%sr%ld", dest_prefix, i);
+		ret = verify_reflink_pair(src, dest);
+		if (ret) {
+			fprintf(stderr, "verify reflink %s failed\n", dest);
 			return -1;
 		}
 	}
 
+	elapsed = get_time_microseconds() - start;
+
+	if (!(test_flags & FMAP_TEST))
+		return 0;
+
+	total = share_stat.s_shared_bytes + share_stat.s_unshared_bytes;
+	printf("  %lu reflinks: %lu shared extents, %lu unshared extents, "
+	       "%.2f%% of %llu mapped bytes shared, %llu bytes of holes, "
+	       "%llu bytes read in %llu us\n",
+	       share_stat.s_pairs, share_stat.s_shared_extents,
+	       share_stat.s_unshared_extents,
+	       total ? 100.0 * share_stat.s_shared_bytes / total : 0.0,
+	       total, share_stat.s_hole_bytes, share_stat.s_read_bytes,
+	       elapsed);
+
 	return 0;
 }
 
+#define VERIFY_WINDOW		(64 * M_SIZE)
+#define VERIFY_BLOCK		4096
 
-int verify_orig_file(char *orig)
+/* Mismatches found by verify_pattern() since the last reset */
+struct verify_state {
+	unsigned long v_first_start;
+	unsigned long v_first_end;
+	unsigned long v_ranges;
+	unsigned long v_bytes;
+	unsigned long v_last;		/* end of the last bad range */
+};
+
+static struct verify_state verify_state;
+
+static void verify_add_bad(unsigned long start, unsigned long end)
 {
-	int ret = 0, fd, o_ret;
-	unsigned long readed, offset = 0;
-	unsigned long verify_size = 0;
-	char *buf = NULL;
+	struct verify_state *v = &verify_state;
+
+	if (v->v_ranges && start == v->v_last) {
+		if (v->v_ranges == 1)
+			v->v_first_end = end;
+	} else {
+		if (!v->v_ranges) {
+			v->v_first_start = start;
+			v->v_first_end = end;
+		}
+		v->v_ranges++;
+	}
+
+	v->v_bytes += end - start;
+	v->v_last = end;
+}
+
+/*
+ * Compares by blocks with memcmp(), which is vectorized by libc, and
+ * only walks bytes of the blocks that differ to find the bad ranges.
+ */
+static void verify_range(const char *buf, const char *pat, unsigned long off,
+			 unsigned long len)
+{
+	unsigned long i, b, n, start;
+
+	for (b = 0; b < len; b += n) {
+		n = len - b > VERIFY_BLOCK ? VERIFY_BLOCK : len - b;
+		if (!memcmp(buf + b, pat + b, n))
+			continue;
+
+		for (i = b; i < b + n; i++) {
+			if (buf[i] == pat[i])
+				continue;
+
+			start = i;
+			while (i < b + n && buf[i] != pat[i])
+				i++;
+			verify_add_bad(off + start, off + i);
+		}
+	}
+}
+
+/*
+ * buf holds the file data at offset, files bigger than PATTERN_SIZE
+ * repeat orig_pattern.
+ */
+int verify_pattern(char *buf, unsigned long offset, unsigned long size)
+{
+	unsigned long done, pos, len;
+	unsigned long ranges = verify_state.v_ranges;
+
+	for (done = 0; done < size; done += len) {
+		pos = (offset + done) % PATTERN_SIZE;
+		len = size - done;
+		if (len > PATTERN_SIZE - pos)
+			len = PATTERN_SIZE - pos;
 
-	unsigned int mmap_size = page_size;
+		verify_range(buf + done, orig_pattern + pos, offset + done,
+			     len);
+	}
+
+	return verify_state.v_ranges != ranges ? -1 : 0;
+}
+
+static int verify_orig_window(int fd, char *buf, unsigned long offset,
+			      unsigned long len)
+{
+	int ret;
 	void *region;
 
-	buf = (char *)malloc(HUNK_SIZE);
+	if (!(test_flags & MMAP_TEST)) {
+		ret = read_at(fd, buf, len, offset);
+		if (ret < 0)
+			return ret;
+
+		verify_pattern(buf, offset, len);
+		return 0;
+	}
+
+	region = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+	if (region == MAP_FAILED) {
+		ret = errno;
+		fprintf(stderr, "mmap (read) error %d: \"%s\"\n", ret,
+			strerror(ret));
+		return -1;
+	}
+
+	madvise(region, len, MADV_SEQUENTIAL);
+	verify_pattern(region, offset, len);
+	munmap(region, len);
+
+	return 0;
+}
+
+/*
+ * Streams the original file through verify_pattern() in VERIFY_WINDOW
+ * pieces, by read() or by mmap() with MMAP_TEST, and reports every bad
+ * range at once.
+ */
+int verify_orig_file(char *orig)
+{
+	int ret = 0, fd;
+	unsigned long offset, len, verify_size;
+	unsigned long long start, elapsed;
+	char *buf = NULL;
+	struct stat st;
+
+	memset(&verify_state, 0, sizeof(verify_state));
 
 	fd = open64(orig, open_ro_flags);
 	if (fd < 0) {
@@ -869,52 +1201,58 @@ int verify_orig_file(char *orig)
 		goto bail;
 	}
 
-	if (file_size > PATTERN_SIZE)
-		verify_size = PATTERN_SIZE;
-	else
-		verify_size = file_size;
-
-	/*
-	* use mmap read to verify original file
-	*/
-	if (test_flags & MMAP_TEST) {
-
-		while (mmap_size < verify_size)
-			mmap_size += page_size;
+	if (fstat(fd, &st) < 0) {
+		ret = errno;
+		fprintf(stderr, "stat file %s failed:%d:%s\n", orig, ret,
+			strerror(ret));
+		ret = -1;
+		goto bail;
+	}
 
-		region = mmap(NULL, mmap_size, PROT_READ, MAP_SHARED, fd, 0);
-		if (region == MAP_FAILED) {
-			o_ret = ret;
-			ret = errno;
-			fprintf(stderr, "mmap (read) error %d: \"%s\"\n", ret,
-				strerror(ret));
-			ret = o_ret;
-			goto bail;
-		}
+	verify_size = file_size;
+	if (verify_size > st.st_size)
+		verify_size = st.st_size;
 
-		ret = verify_pattern(region, 0, verify_size);
+	if (!(test_flags & MMAP_TEST)) {
+		ret = posix_memalign((void **)&buf, page_size, VERIFY_WINDOW);
 		if (ret) {
-			fprintf(stderr, "Verify orig file by mmap failed\n");
+			fprintf(stderr, "malloc failed.\n");
+			buf = NULL;
+			ret = -1;
 			goto bail;
 		}
+		posix_fadvise(fd, 0, verify_size, POSIX_FADV_SEQUENTIAL);
+	}
 
-		munmap(region, mmap_size);
-		return 0;
+	start = get_time_microseconds();
 
-	}
+	for (offset = 0; offset < verify_size; offset += len) {
+		len = verify_size - offset;
+		if (len > VERIFY_WINDOW)
+			len = VERIFY_WINDOW;
 
-	while ((readed = read(fd, buf, HUNK_SIZE)) > 0) {
-		ret = verify_pattern(buf, offset, readed);
-		if (ret) {
-			fprintf(stderr, "Verify original file failed\n");
+		ret = verify_orig_window(fd, buf, offset, len);
+		if (ret)
 			goto bail;
-		}
+	}
 
-		offset += readed;
-		if (offset >= PATTERN_SIZE)
-			break;
+	elapsed = get_time_microseconds() - start;
+	if (!elapsed)
+		elapsed = 1;
+
+	if (verify_state.v_ranges) {
+		fprintf(stderr, "Verify original file %s failed: first bad "
+			"range [%lu, %lu), %lu bad ranges, %lu bad bytes\n",
+			orig, verify_state.v_first_start,
+			verify_state.v_first_end, verify_state.v_ranges,
+			verify_state.v_bytes);
+		ret = -1;
+		goto bail;
 	}
 
+	printf("  Verified %lu bytes of original file at %.2f GB/s\n",
+	       verify_size, (double)verify_size / elapsed / 1000);
+
 bail:
 	if (buf)
 		free(buf);
@@ -963,6 +1301,168 @@ int do_reflinks(const char *src, const char *dest_prefix,
 	return 0;
 }
 
+struct reflink_fanout {
+	const char *rf_src;
+	const char *rf_prefix;
+	unsigned long rf_iter;
+	int rf_manner;
+	unsigned long rf_threads;
+	unsigned long rf_next;
+	unsigned char *rf_done;
+	unsigned long long *rf_lat;
+	int rf_ret;
+};
+
+struct reflink_fanout_thread {
+	struct reflink_fanout *t_fo;
+	unsigned long t_no;
+	unsigned int t_seed;
+	pthread_t t_id;
+};
+
+/*
+ * Picks the next reflink of a thread and its source, following the
+ * manners of do_reflinks(): 0 is a star on src, 1 a chain, one per
+ * thread, and others reflink a random reflink already made.
+ */
+static int fanout_next(struct reflink_fanout_thread *t, unsigned long *i,
+		       char *from)
+{
+	struct reflink_fanout *fo = t->t_fo;
+	unsigned long j = 0;
+	int from_reflink = 0;
+
+	if (fo->rf_manner == 1) {
+		*i = t->t_no;
+		t->t_no += fo->rf_threads;
+		if (*i >= fo->rf_threads) {
+			j = *i - fo->rf_threads;
+			from_reflink = 1;
+		}
+	} else {
+		*i = __atomic_fetch_add(&fo->rf_next, 1, __ATOMIC_RELAXED);
+		if (fo->rf_manner > 1 && *i) {
+			j = rand_r(&t->t_seed) % *i;
+			/* still in flight on another thread, use src */
+			from_reflink = __atomic_load_n(&fo->rf_done[j],
+						       __ATOMIC_ACQUIRE);
+		}
+	}
+
+	if (*i >= fo->rf_iter)
+		return 0;
+
+	/* as in do_reflinks(), r0 is never a source, src stands for it */
+	if (from_reflink && j)
+		snprintf(from, PATH_MAX, "%sr%ld", fo->rf_prefix, j);
+	else
+		strcpy(from, fo->rf_src);
+
+	return 1;
+}
+
+static void *fanout_worker(void *arg)
+{
+	struct reflink_fanout_thread *t = arg;
+	struct reflink_fanout *fo = t->t_fo;
+	unsigned long i;
+	unsigned long long start;
+	char from[PATH_MAX], to[PATH_MAX];
+	int ret;
+
+	while (!__atomic_load_n(&fo->rf_ret, __ATOMIC_RELAXED) &&
+	       fanout_next(t, &i, from)) {
+		snprintf(to, PATH_MAX, "%sr%ld", fo->rf_prefix, i);
+
+		start = get_time_microseconds();
+		ret = reflink(from, to, 1);
+		if (ret) {
+			fprintf(stderr, "do_reflinks_threaded failed\n");
+			__atomic_store_n(&fo->rf_ret, ret, __ATOMIC_RELAXED);
+			break;
+		}
+		fo->rf_lat[i] = get_time_microseconds() - start;
+
+		__atomic_store_n(&fo->rf_done[i], 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/*
+ * Makes the same reflinks as do_reflinks() with threads creating them
+ * concurrently, latencies grow with the contention on the refcount tree.
+ */
+int do_reflinks_threaded(const char *src, const char *dest_prefix,
+			 unsigned long iter, int manner, unsigned long threads,
+			 struct fanout_stat *stat)
+{
+	int ret = 0;
+	unsigned long i, started;
+	unsigned long long start, elapsed, sum = 0;
+	struct reflink_fanout fo;
+	struct reflink_fanout_thread *t;
+
+	memset(&fo, 0, sizeof(fo));
+	fo.rf_src = src;
+	fo.rf_prefix = dest_prefix;
+	fo.rf_iter = iter;
+	fo.rf_manner = manner;
+	fo.rf_threads = threads;
+
+	fo.rf_done = calloc(iter, 1);
+	fo.rf_lat = calloc(iter, sizeof(unsigned long long));
+	t = calloc(threads, sizeof(struct reflink_fanout_thread));
+	if (!fo.rf_done || !fo.rf_lat || !t) {
+		fprintf(stderr, "malloc failed.\n");
+		ret = -1;
+		goto bail;
+	}
+
+	start = get_time_microseconds();
+
+	for (started = 0; started < threads; started++) {
+		t[started].t_fo = &fo;
+		t[started].t_no = started;
+		t[started].t_seed = rand();
+		ret = pthread_create(&t[started].t_id, NULL, fanout_worker,
+				     &t[started]);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed:%d:%s\n", ret,
+				strerror(ret));
+			fo.rf_ret = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(t[i].t_id, NULL);
+
+	elapsed = get_time_microseconds() - start;
+	if (!elapsed)
+		elapsed = 1;
+
+	ret = fo.rf_ret;
+	if (ret)
+		goto bail;
+
+	memset(stat, 0, sizeof(*stat));
+	for (i = 0; i < iter; i++) {
+		sum += fo.rf_lat[i];
+		if (fo.rf_lat[i] > stat->f_max_us)
+			stat->f_max_us = fo.rf_lat[i];
+	}
+
+	stat->f_rate = (double)iter * 1000000 / elapsed;
+	stat->f_avg_us = iter ? (double)sum / iter : 0;
+bail:
+	free(fo.rf_done);
+	free(fo.rf_lat);
+	free(t);
+
+	return ret;
+}
+
 int do_reflinks_at_random(const char *src, const char *dest_prefix,
 				 unsigned long iter)
 {
@@ -1693,255 +2193,290 @@ int init_sock(char *serv, int port)
 	return sockfd;
 }
 
-long get_verify_logs_num(char *log)
+/* Walks a destructive test log mapped in memory, text or binary */
+struct dest_log_iter {
+	char *l_buf;
+	size_t l_size;
+	size_t l_pos;
+	int l_binary;
+	char *l_orig;
+};
+
+static int dest_log_next_bin(struct dest_log_iter *it,
+			     struct dest_write_unit *dwu, char *name)
 {
-	FILE *logfile;
-	long num_logs = 1;
-	int ret;
-	char arg1[100], arg2[100], arg3[100], arg4[100];
+	struct dest_log_rec rec;
 
-	logfile = fopen(log, "r");
-	if (!logfile) {
-		fprintf(stderr, "Error %d opening dest log: %s\n", errno,
-			strerror(errno));
-		num_logs = -1;
-		goto bail;
-	}
-
-	while (!feof(logfile)) {
+	/* a crash may leave a partial record at the end */
+	if (it->l_pos + sizeof(rec) > it->l_size)
+		return 0;
 
-		ret = fscanf(logfile, "%s\t%s\t%s\t%s\n", arg1, arg2,
-			     arg3, arg4);
-		if (ret != 4) {
-			fprintf(stderr, "input failure from dest log, ret "
-				"%d, %d %s\n", ret, errno, strerror(errno));
-			num_logs = -1;
-			goto bail;
-		}
+	memcpy(&rec, it->l_buf + it->l_pos, sizeof(rec));
+	if (rec.r_magic != DEST_LOG_MAGIC) {
+		fprintf(stderr, "bad record in binary dest log at byte %lu\n",
+			(unsigned long)it->l_pos);
+		return -EINVAL;
+	}
+	it->l_pos += sizeof(rec);
 
-		if (strcmp(arg1, "Reflink:"))
-			continue;
-		else
-			num_logs++;
+	if (rec.r_type == DEST_LOG_REFLINK) {
+		snprintf(name, PATH_MAX, "%s_target_%u_%lu", it->l_orig,
+			 rec.r_pid, (unsigned long)rec.r_chunk_no);
+		return DEST_LOG_REFLINK;
 	}
 
-bail:
-	if (logfile)
-		fclose(logfile);
+	dwu->d_chunk_no = rec.r_chunk_no;
+	dwu->d_timestamp = rec.r_timestamp;
+	dwu->d_checksum = rec.r_checksum;
+	dwu->d_char = rec.r_char;
 
-	return num_logs;
+	return DEST_LOG_CHUNK;
 }
 
-int verify_dest_file(char *log, struct dest_logs d_log, unsigned long chunk_no)
+/*
+ * Text records are "chunkno\ttimestamp\tchecksum\tchar" or
+ * "Reflink:\torig\t->\tdest", the sender also wrote the NUL ending
+ * each of them.
+ */
+static int dest_log_next_text(struct dest_log_iter *it,
+			      struct dest_write_unit *dwu, char *name)
 {
-	FILE *logfile;
-	struct dest_write_unit *dwus, dwu;
-	unsigned long i, t_bytes = sizeof(struct dest_write_unit) * chunk_no;
-	unsigned long record_index = 0;
-	int fd = 0, ret = 0, o_ret;
-	char arg1[100], arg2[100], arg3[100], arg4[100];
+	char *p, *end, *field, line[PATH_MAX * 2 + 32];
+	size_t len;
 
-	memset(&dwu, 0, sizeof(struct dest_write_unit));
+	while (it->l_pos < it->l_size &&
+	       (it->l_buf[it->l_pos] == '\0' ||
+		isspace(it->l_buf[it->l_pos])))
+		it->l_pos++;
 
-	dwus = (struct dest_write_unit *)malloc(t_bytes);
-	memset(dwus, 0, t_bytes);
-
-	for (i = 0; i < chunk_no; i++)
-		dwus[i].d_chunk_no = i;
-
-	logfile = fopen(log, "r");
-	if (!logfile) {
-		fprintf(stderr, "Error %d opening dest log: %s\n", errno,
-			strerror(errno));
-		ret = -EINVAL;
-		goto bail;
-	}
-
-	while (!feof(logfile)) {
-
-		ret = fscanf(logfile, "%s\t%s\t%s\t%s\n", arg1, arg2,
-			     arg3, arg4);
-		if (ret != 4) {
-			fprintf(stderr, "input failure from dest log, ret "
-				"%d, %d %s\n", ret, errno, strerror(errno));
-			ret = -EINVAL;
-			goto bail;
-		}
-
-		if (!strcmp(arg1, "Reflink:"))
-			continue;
-		else {
-			dwu.d_chunk_no = atol(arg1);
-			if (dwu.d_chunk_no > chunk_no) {
-				fprintf(stderr, "Chunkno grabed from logfile "
-					"exceeds the filesize, you may probably"
-					" specify a too small filesize.\n");
-				return -1;
-			}
-			dwu.d_timestamp = atoll(arg2);
-			dwu.d_checksum = atoi(arg3);
-			dwu.d_char = arg4[0];
+	if (it->l_pos == it->l_size)
+		return 0;
 
-			record_index++;
+	p = it->l_buf + it->l_pos;
+	end = memchr(p, '\n', it->l_size - it->l_pos);
+	len = end ? end - p : it->l_size - it->l_pos;
+	it->l_pos += len;
+
+	if (len >= sizeof(line)) {
+		fprintf(stderr, "input failure from dest log, record too "
+			"long\n");
+		return -EINVAL;
+	}
+	memcpy(line, p, len);
+	line[len] = '\0';
+
+	if (!strncmp(line, "Reflink:", 8)) {
+		field = strrchr(line, '\t');
+		if (!field) {
+			fprintf(stderr, "input failure from dest log: %s\n",
+				line);
+			return -EINVAL;
 		}
+		strncpy(name, field + 1, PATH_MAX - 1);
+		name[PATH_MAX - 1] = '\0';
+		return DEST_LOG_REFLINK;
+	}
 
-		if (dwu.d_timestamp >= dwus[dwu.d_chunk_no].d_timestamp) {
-
-			memmove(&dwus[dwu.d_chunk_no], &dwu,
-				sizeof(struct dest_write_unit));
-		}
+	errno = 0;
+	dwu->d_chunk_no = strtoul(line, &p, 10);
+	if (*p == '\t')
+		dwu->d_timestamp = strtoull(p + 1, &p, 10);
+	if (*p == '\t')
+		dwu->d_checksum = strtol(p + 1, &p, 10);
+	if (errno || *p != '\t' || !p[1]) {
+		fprintf(stderr, "input failure from dest log: %s\n", line);
+		return -EINVAL;
+	}
+	dwu->d_char = p[1];
 
-		if (record_index == d_log.index)
-			break;
+	return DEST_LOG_CHUNK;
+}
 
-	}
+/* Checks every chunk of filename against the latest record of it */
+static int verify_dest_chunks(const char *filename,
+			      struct dest_write_unit *latest,
+			      unsigned long chunk_no, char *buf,
+			      unsigned long buf_chunks)
+{
+	int fd, ret = 0;
+	unsigned long i, j, n;
+	struct dest_write_unit dwu;
 
-	fd = open64(d_log.filename, open_ro_flags, FILE_MODE);
+	fd = open64(filename, open_ro_flags);
 	if (fd < 0) {
-		ret = fd;
-		fd = errno;
-		fprintf(stderr, "open file %s failed:%d:%s\n",
-			d_log.filename, fd, strerror(fd));
-		goto bail;
+		ret = errno;
+		fprintf(stderr, "open file %s failed:%d:%s\n", filename, ret,
+			strerror(ret));
+		return -1;
 	}
 
-	fprintf(stdout, "Verify file %s :", d_log.filename);
+	fprintf(stdout, "Verify file %s :", filename);
 
-	for (i = 0; i < chunk_no; i++) {
+	for (i = 0; i < chunk_no; i += n) {
+		n = chunk_no - i;
+		if (n > buf_chunks)
+			n = buf_chunks;
 
-		ret = pread(fd, chunk_pattern, CHUNK_SIZE, CHUNK_SIZE * i);
+		ret = pread(fd, buf, n * CHUNK_SIZE, i * CHUNK_SIZE);
 		if (ret < 0) {
-			o_ret = ret;
 			ret = errno;
 			fprintf(stderr, "read failed:%d:%s\n", ret,
 				strerror(ret));
-			ret = o_ret;
+			ret = -1;
 			goto bail;
 		}
 
-		if (ret < CHUNK_SIZE) {
+		if (ret < n * CHUNK_SIZE) {
 			fprintf(stderr, "Short read happened, you may probably"
 				" set too big filesize for verfiy_test.\n");
-			return -1;
+			ret = -1;
+			goto bail;
 		}
 
-		/*
-		dump_pattern(chunk_pattern, &dwu);
-		fprintf(stdout, "#%lu\t%llu\t%d\t%c\n", dwus[i].d_chunk_no,
-			dwus[i].d_timestamp, dwus[i].d_checksum,
-			dwus[i].d_char);
-		*/
-
-		/*
-		dump_pattern(chunk_pattern, &dwu);
-		fprintf(stdout, "#%lu\t%llu\t%d\t%c\n", dwu.d_chunk_no,
-			dwu.d_timestamp, dwu.d_checksum, dwu.d_char);
-		*/
-
-		if (!verify_chunk_pattern(chunk_pattern, &dwus[i])) {
+		for (j = 0; j < n; j++) {
+			if (verify_chunk_pattern(buf + j * CHUNK_SIZE,
+						 &latest[i + j]))
+				continue;
 
-			dump_pattern(chunk_pattern, &dwu);
+			dump_pattern(buf + j * CHUNK_SIZE, &dwu);
 			fprintf(stderr, "Inconsistent chunk found in file %s!\n"
 				"Expected:\tchunkno(%ld)\ttimestmp(%llu)\t"
 				"chksum(%d)\tchar(%c)\nFound   :\tchunkno"
 				"(%ld)\ttimestmp(%llu)\tchksum(%d)\tchar(%c)\n",
-				d_log.filename,
-				dwus[i].d_chunk_no, dwus[i].d_timestamp,
-				dwus[i].d_checksum, dwus[i].d_char,
+				filename,
+				latest[i + j].d_chunk_no,
+				latest[i + j].d_timestamp,
+				latest[i + j].d_checksum, latest[i + j].d_char,
 				dwu.d_chunk_no, dwu.d_timestamp,
 				dwu.d_checksum, dwu.d_char);
 			ret = -1;
 			goto bail;
-
 		}
 	}
 
 	fprintf(stdout, "Pass\n");
-
+	ret = 0;
 bail:
-	if (dwus)
-		free(dwus);
-
-	if (logfile)
-		fclose(logfile);
-
-	if (fd)
-		close(fd);
+	close(fd);
 
 	return ret;
 }
 
+/*
+ * Replays the log once, keeping the latest record of every chunk.  A
+ * reflink is checked against that index when its record shows up, as
+ * it froze the chunks written before it, and the original file is
+ * checked at the end.
+ */
 int verify_dest_files(char *log, char *orig, unsigned long chunk_no)
 {
-	unsigned long record_index = 0, log_index = 0, i;
-	long log_nums;
-	int ret = 0;
-
-	struct dest_logs *logs = NULL;
-	FILE *logfile = NULL;
-	char arg1[100], arg2[100], arg3[100], arg4[100];
-
-	log_nums = get_verify_logs_num(log);
-	if (log_nums < 0) {
-		ret = log_nums;
+	int ret = 0, fd = -1, type;
+	unsigned long i, records = 0, reflinks = 0;
+	unsigned long buf_chunks = HUNK_SIZE / CHUNK_SIZE;
+	unsigned long long start, elapsed;
+	struct dest_log_iter it;
+	struct dest_write_unit *latest = NULL, dwu;
+	struct stat st;
+	char *buf = NULL, name[PATH_MAX];
+
+	memset(&it, 0, sizeof(it));
+	it.l_orig = orig;
+	it.l_buf = MAP_FAILED;
+
+	start = get_time_microseconds();
+
+	latest = calloc(chunk_no, sizeof(struct dest_write_unit));
+	if (!latest ||
+	    posix_memalign((void **)&buf, DIRECTIO_SLICE, HUNK_SIZE)) {
+		fprintf(stderr, "malloc failed.\n");
+		ret = -1;
 		goto bail;
 	}
 
-	logs = (struct dest_logs *)malloc(sizeof(struct dest_logs) * log_nums);
-
-	strncpy(logs[0].filename, orig, PATH_MAX);
+	for (i = 0; i < chunk_no; i++)
+		latest[i].d_chunk_no = i;
 
-	logfile = fopen(log, "r");
-	if (!logfile) {
+	fd = open(log, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
 		fprintf(stderr, "Error %d opening dest log: %s\n", errno,
 			strerror(errno));
 		ret = -EINVAL;
 		goto bail;
 	}
 
-	while (!feof(logfile)) {
-
-		ret = fscanf(logfile, "%s\t%s\t%s\t%s\n", arg1, arg2,
-			     arg3, arg4);
-		if (ret != 4) {
-			fprintf(stderr, "input failure from dest log, ret "
-				"%d, %d %s\n", ret, errno, strerror(errno));
-			ret = -EINVAL;
+	it.l_size = st.st_size;
+	if (it.l_size) {
+		it.l_buf = mmap(NULL, it.l_size, PROT_READ, MAP_PRIVATE, fd,
+				0);
+		if (it.l_buf == MAP_FAILED) {
+			fprintf(stderr, "mmap dest log failed:%d:%s\n", errno,
+				strerror(errno));
+			ret = -1;
 			goto bail;
 		}
+		madvise(it.l_buf, it.l_size, MADV_SEQUENTIAL);
 
-		if (strcmp(arg1, "Reflink:")) {
-			record_index++;
-			continue;
-		} else {
-			log_index++;
-			strncpy(logs[log_index].filename, arg4, PATH_MAX);
-			logs[log_index].index = record_index;
-			/*
-			printf(" #%lu log: %s, index = %lu\n",log_index, arg4, record_index);
-			*/
-		}
+		it.l_binary = it.l_size >= sizeof(uint32_t) &&
+			      *(uint32_t *)it.l_buf == DEST_LOG_MAGIC;
 	}
 
-	logs[0].index = record_index;
+	while (1) {
+		memset(&dwu, 0, sizeof(dwu));
 
-	for (i = 0; i < log_nums; i++) {
-		ret = verify_dest_file(log, logs[i], chunk_no);
-		if (ret < 0) {
+		if (it.l_binary)
+			type = dest_log_next_bin(&it, &dwu, name);
+		else
+			type = dest_log_next_text(&it, &dwu, name);
+		if (type <= 0) {
+			ret = type;
+			break;
+		}
+
+		if (type == DEST_LOG_REFLINK) {
+			ret = verify_dest_chunks(name, latest, chunk_no, buf,
+						 buf_chunks);
+			if (ret)
+				goto bail;
+			reflinks++;
+			continue;
+		}
+
+		if (dwu.d_chunk_no >= chunk_no) {
+			fprintf(stderr, "Chunkno grabed from logfile "
+				"exceeds the filesize, you may probably"
+				" specify a too small filesize.\n");
 			ret = -1;
 			goto bail;
 		}
+
+		if (dwu.d_timestamp >= latest[dwu.d_chunk_no].d_timestamp)
+			latest[dwu.d_chunk_no] = dwu;
+		records++;
 	}
 
+	if (ret)
+		goto bail;
+
+	ret = verify_dest_chunks(orig, latest, chunk_no, buf, buf_chunks);
+	if (ret)
+		goto bail;
+
+	elapsed = get_time_microseconds() - start;
+	fprintf(stdout, "Verified %lu reflinks and the original file "
+		"against %lu %s log records in %.2fs\n", reflinks, records,
+		it.l_binary ? "binary" : "text", elapsed / 1000000.0);
+
 bail:
-	if (logfile)
-		fclose(logfile);
+	if (it.l_buf != MAP_FAILED)
+		munmap(it.l_buf, it.l_size);
 
-	if (logs)
+	if (fd >= 0)
+		close(fd);
 
-		free(logs);
+	free(latest);
+	free(buf);
 
-	return ret;
+	return ret < 0 ? -1 : ret;
 }
 
 int set_semvalue(int sem_id, int val)
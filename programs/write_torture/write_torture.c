@@ -1,6 +1,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -9,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 
 //#define dprintf printf
 #define dprintf(str, ...) 
@@ -27,6 +29,43 @@ static int logfd = STDOUT_FILENO;
 #endif
 static char hostn[MAXHOSTNAMELEN];
 
+/*
+ * What each worker accounts, in memory shared with the parent which
+ * prints them at exit.  Writers count the bytes they wrote, truncaters
+ * by how much they changed i_size.
+ */
+#define WT_LAT_BUCKETS 64	/* power of two buckets, in ns */
+
+struct wt_stats {
+	unsigned long long ws_ops;
+	unsigned long long ws_bytes;
+	unsigned long long ws_lat_total;
+	unsigned long long ws_lat_max;
+	unsigned long long ws_lat[WT_LAT_BUCKETS];
+};
+
+enum wt_worker {
+	WT_APPEND = 0,
+	WT_IN_PLACE,
+	WT_PAST_SIZE,
+	WT_TRUNCATE_DOWN,
+	WT_TRUNCATE_UP,
+	WT_STRADDLING,
+	WT_NR_WORKERS,
+};
+
+static const char *wt_worker_names[WT_NR_WORKERS] = {
+	"append",
+	"in_place",
+	"past_size",
+	"truncate_down",
+	"truncate_up",
+	"straddling_eof",
+};
+
+static struct wt_stats *all_stats;
+static struct wt_stats *mystats;
+
 static void __logprint(const char *fmt, ...)
 {
 	int len;
@@ -55,6 +94,27 @@ static unsigned long get_rand(unsigned long min, unsigned long max)
 	return min + ((rand() % max) - min);
 }
 
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void account_op(unsigned long long start, unsigned long long bytes)
+{
+	unsigned long long ns = now_ns() - start;
+
+	mystats->ws_ops++;
+	mystats->ws_bytes += bytes;
+	mystats->ws_lat_total += ns;
+	if (ns > mystats->ws_lat_max)
+		mystats->ws_lat_max = ns;
+	mystats->ws_lat[ns ? 63 - __builtin_clzll(ns) : 0]++;
+}
+
 static void random_sleep(unsigned int max_usecs)
 {
 	int r = rand();
@@ -75,7 +135,8 @@ static void signal_handler(int sig)
 	die = 1;
 }
 
-static int launch_child(char *fname, int open_flags, int (*newmain)(void))
+static int launch_child(char *fname, int open_flags, int (*newmain)(void),
+			enum wt_worker worker)
 {
 	pid_t pid;
 	int ret = 0;
@@ -92,6 +153,7 @@ static int launch_child(char *fname, int open_flags, int (*newmain)(void))
 		}
 
 		mypid = getpid();
+		mystats = &all_stats[worker];
 		srand(mypid);
 		ret = newmain();
 		exit(ret);
@@ -107,8 +169,12 @@ static int launch_child(char *fname, int open_flags, int (*newmain)(void))
 static int do_write(int fd, const char *buf, unsigned int len)
 {
 	int written, ret = 0;
+	unsigned long long start;
 
+	start = now_ns();
 	written = write(fd, buf, len);
+	if (written >= 0)
+		account_op(start, written);
 	if (written == -1) {
 		ret = errno;
 		fprintf(stderr, "%s:%d: append write failure %d len[%d]\n", 
@@ -223,6 +289,7 @@ static int truncate_caller(int up)
 {
 	int ret = 0;
 	unsigned long size;
+	unsigned long long start;
 	off_t len;
 	char *where = "down";
 
@@ -245,6 +312,7 @@ static int truncate_caller(int up)
 			logprint("truncate %s to size        : %d\n",
 				 where, len);
 
+			start = now_ns();
 			ret = ftruncate(fd, len);
 			if (ret == -1) {
 				ret = errno;
@@ -252,6 +320,7 @@ static int truncate_caller(int up)
 					hostn, mypid, ret);
 				break;
 			}
+			account_op(start, up ? len - size : size - len);
 		}
 
 		random_sleep(200000 + 200000 * up);
@@ -303,6 +372,56 @@ static int straddling_eof_writer(void)
 	return ret;
 }
 
+/* Upper bound of the bucket the percentile falls in, in us */
+static double lat_percentile(struct wt_stats *ws, double pct)
+{
+	int i;
+	unsigned long long seen = 0, want;
+
+	if (!ws->ws_ops)
+		return 0;
+
+	want = (unsigned long long)(ws->ws_ops * pct / 100.0);
+	if (want < 1)
+		want = 1;
+
+	for (i = 0; i < WT_LAT_BUCKETS - 1; i++) {
+		seen += ws->ws_lat[i];
+		if (seen >= want)
+			break;
+	}
+
+	if (i == WT_LAT_BUCKETS - 1 || (2ULL << i) > ws->ws_lat_max)
+		return ws->ws_lat_max / 1000.0;
+
+	return (2ULL << i) / 1000.0;
+}
+
+static void print_stats(double secs)
+{
+	int i;
+	struct wt_stats *ws;
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	printf("%s: workers ran for %.1f seconds\n", hostn, secs);
+	printf("%-15s %10s %10s %10s %10s %10s %10s %10s %10s\n", "worker",
+	       "ops", "ops/s", "MB", "MB/s", "avg(us)", "p50(us)", "p99(us)",
+	       "max(us)");
+
+	for (i = 0; i < WT_NR_WORKERS; i++) {
+		ws = &all_stats[i];
+		printf("%-15s %10llu %10.1f %10.2f %10.2f %10.1f %10.1f "
+		       "%10.1f %10.1f\n", wt_worker_names[i], ws->ws_ops,
+		       ws->ws_ops / secs, ws->ws_bytes / (1024.0 * 1024.0),
+		       ws->ws_bytes / (1024.0 * 1024.0) / secs,
+		       ws->ws_ops ? ws->ws_lat_total / 1000.0 / ws->ws_ops : 0,
+		       lat_percentile(ws, 50.0), lat_percentile(ws, 99.0),
+		       ws->ws_lat_max / 1000.0);
+	}
+}
+
 static void usage(void)
 {
 	fprintf(stderr,
@@ -350,6 +469,7 @@ int main(int argc, char **argv)
 	int status;
 	pid_t pid;
 	char *fname;
+	unsigned long long start;
 	printf("will get hostname\n");
         gethostname(hostn, MAXHOSTNAMELEN);
 	printf("got hostname\n");
@@ -389,6 +509,17 @@ int main(int argc, char **argv)
 	}
 	close(fd);
 
+	all_stats = mmap(NULL, sizeof(struct wt_stats) * WT_NR_WORKERS,
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			 -1, 0);
+	if (all_stats == MAP_FAILED) {
+		ret = errno;
+		fprintf(stderr, "%s: Error %d mapping worker stats\n",
+			hostn, ret);
+		return ret;
+	}
+	memset(all_stats, 0, sizeof(struct wt_stats) * WT_NR_WORKERS);
+
 	parent = mypid = getpid();
 
 	/* setup the parent. */
@@ -404,17 +535,25 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	ret = launch_child(fname, O_RDWR|O_APPEND, append_writer);
+	/* Don't have the children flush what we printed so far again */
+	fflush(stdout);
+	start = now_ns();
+
+	ret = launch_child(fname, O_RDWR|O_APPEND, append_writer, WT_APPEND);
 	if (!ret)
-		ret = launch_child(fname, O_RDWR, random_in_place_writer);
+		ret = launch_child(fname, O_RDWR, random_in_place_writer,
+				   WT_IN_PLACE);
 	if (!ret)
-		ret = launch_child(fname, O_RDWR, random_past_size_writer);
+		ret = launch_child(fname, O_RDWR, random_past_size_writer,
+				   WT_PAST_SIZE);
 	if (!ret)
-		ret = launch_child(fname, O_RDWR, truncate_down);
+		ret = launch_child(fname, O_RDWR, truncate_down,
+				   WT_TRUNCATE_DOWN);
 	if (!ret)
-		ret = launch_child(fname, O_RDWR, truncate_up);
+		ret = launch_child(fname, O_RDWR, truncate_up, WT_TRUNCATE_UP);
 	if (!ret)
-		ret = launch_child(fname, O_WRONLY, straddling_eof_writer);
+		ret = launch_child(fname, O_WRONLY, straddling_eof_writer,
+				   WT_STRADDLING);
 	if (ret) {
 		fprintf(stderr, "%s: Error %d launching children\n", 
 		        hostn, ret);
@@ -486,5 +625,11 @@ kill_all:
 		dprintf("%s: Killed children\n", hostn);
 	}
 
+	/* Their counters are final once they are all gone */
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+
+	print_stats((now_ns() - start) / 1e9);
+
 	return ret == -ECHILD ? ret : 0;
 }